@@ -0,0 +1,238 @@
+// Benchmarks for the editing engine, driven headlessly with synthetic keystrokes
+// Usage: bench [size in MB]...
+//        bench --replay trace [filename]
+// Prints one tab separated line per operation and input size
+#define _GNU_SOURCE
+#include <ncurses.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "write.h"
+
+#define BENCH_TYPED_KEYS 2000
+#define BENCH_PAGES 2000
+#define BENCH_FINDS 200
+#define BENCH_PASTES 100
+#define BENCH_NEEDLE_EVERY 10000 // Lines between each match for the find benchmark
+
+// Latencies of each sample of the operation being timed, in nanoseconds
+double *samples = NULL;
+int samples_count = 0;
+int samples_size = 0;
+struct timespec sample_start;
+
+void start_sample()
+{
+	clock_gettime(CLOCK_MONOTONIC, &sample_start);
+}
+
+void end_sample()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	if (samples_count == samples_size)
+	{
+		samples_size = samples_size ? samples_size * 2 : 1024;
+		samples = (double *) realloc(samples, sizeof(double) * samples_size);
+	}
+	samples[samples_count++] = (t.tv_sec - sample_start.tv_sec) * 1e9 + (t.tv_nsec - sample_start.tv_nsec);
+}
+
+int compare_samples(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+double percentile(double p)
+{
+	return samples[(int) (p * (samples_count - 1))] / 1000;
+}
+
+// Print the latency percentiles (in microseconds) and rate of the samples taken, then clear them.
+// Throughput in MB/s is only given for operations over a whole file (bytes is 0 for the rest)
+void report(int size_mb, char *op, long bytes)
+{
+	double total = 0;
+	for (int i = 0; i < samples_count; i++)
+		total += samples[i];
+	qsort(samples, samples_count, sizeof(double), compare_samples);
+
+	printf("%d\t%s\t%d\t%.2f\t%.2f\t%.2f\t%.2f\t%.1f\t", size_mb, op, samples_count,
+		percentile(0.5), percentile(0.9), percentile(0.99), percentile(1), samples_count / (total / 1e9));
+	if (bytes > 0)
+		printf("%.1f\n", bytes / (total / 1e9) / (1024 * 1024));
+	else
+		printf("-\n");
+	fflush(stdout);
+	samples_count = 0;
+}
+
+// Write a file of roughly size_mb megabytes of word-like text, unless it is already there
+char *make_input(int size_mb)
+{
+	static char filename[MAX_FILENAME_LENGTH];
+	snprintf(filename, MAX_FILENAME_LENGTH, "/tmp/write_bench_%dmb.txt", size_mb);
+
+	struct stat st;
+	long size = (long) size_mb * 1024 * 1024;
+	if (stat(filename, &st) == 0 && st.st_size >= size)
+		return filename;
+
+	FILE *fp = fopen(filename, "w");
+	if (!fp)
+		return NULL;
+
+	char *words[] = { "int", "return", "buffer", "line", "\tif", "(x)", "{", "}", "the", "quick", "value", "=", "0;", "for", "while", "//" };
+	srand(1);
+	long written = 0;
+	for (long y = 0; written < size; y++)
+	{
+		if (y % BENCH_NEEDLE_EVERY == BENCH_NEEDLE_EVERY - 1)
+			written += fprintf(fp, "needle ");
+		int count = rand() % 12;
+		for (int i = 0; i < count; i++)
+			written += fprintf(fp, "%s ", words[rand() % 16]);
+		written += fprintf(fp, "%ld\n", y);
+	}
+	fclose(fp);
+	return filename;
+}
+
+void bench(int size_mb)
+{
+	char *filename = make_input(size_mb);
+	if (filename == NULL)
+	{
+		fprintf(stderr, "Cannot write benchmark input for %d MB\n", size_mb);
+		return;
+	}
+	struct stat st;
+	stat(filename, &st);
+
+	start_sample();
+	open_file(filename);
+	end_sample();
+	report(size_mb, "open", st.st_size);
+	first_buffer = current_buffer;
+	move_file_home();
+
+	// Typing, as the main loop handles each key, with a new line every 60 keys
+	goto_line(current_buffer->lines < 1000 ? current_buffer->lines : 1000);
+	for (int i = 0; i < BENCH_TYPED_KEYS; i++)
+	{
+		start_sample();
+		if (i % 60 == 59)
+		{
+			enter();
+			push_undo(current_buffer->cx, current_buffer->cy + current_buffer->offsety, UNDO_ENTER, NULL, 0);
+		}
+		else
+		{
+			char c = 'a' + i % 26;
+			insert_char(current_buffer->current_line, current_buffer->cx, c);
+			current_buffer->cx++;
+			check_boundx();
+			push_undo(current_buffer->cx, current_buffer->cy + current_buffer->offsety, UNDO_INSERTCHAR, &c, 1);
+		}
+		end_sample();
+	}
+	report(size_mb, "type", 0);
+
+	while (undo_head != NULL)
+	{
+		start_sample();
+		pull_undo();
+		end_sample();
+	}
+	report(size_mb, "undo", 0);
+
+	move_file_home();
+	for (int i = 0; i < BENCH_PAGES; i++)
+	{
+		start_sample();
+		move_page_down();
+		end_sample();
+	}
+	report(size_mb, "pagedown", 0);
+
+	move_file_home();
+	for (int i = 0; i < BENCH_FINDS; i++)
+	{
+		start_sample();
+		find("needle", current_buffer->current_line, current_buffer->cx);
+		end_sample();
+	}
+	report(size_mb, "find", 0);
+
+	// Paste a hundred line block repeatedly
+	move_file_home();
+	mark(current_buffer);
+	move_lines_down(100);
+	copy();
+	clear_mark(current_buffer);
+	for (int i = 0; i < BENCH_PASTES; i++)
+	{
+		start_sample();
+		paste();
+		end_sample();
+	}
+	report(size_mb, "paste", 0);
+	clear_undo();
+
+	start_sample();
+	save_file("/tmp/write_bench_out.txt");
+	end_sample();
+	stat("/tmp/write_bench_out.txt", &st);
+	report(size_mb, "save", st.st_size);
+	remove("/tmp/write_bench_out.txt");
+
+	close_buffer(current_buffer);
+	delete_lines(paste_buffer->first_line);
+	paste_buffer->first_line = NULL;
+	paste_buffer->lines = 0;
+}
+
+// Time each key of a recorded session
+int bench_replay(char *trace_filename, char *filename)
+{
+	if (!start_replay(trace_filename, filename))
+	{
+		fprintf(stderr, "Cannot replay trace %s\n", trace_filename);
+		return 1;
+	}
+
+	bool running = true;
+	while (running && current_buffer != NULL && (ch = read_key()) != ERR)
+	{
+		start_sample();
+		running = handle_key();
+		end_sample();
+	}
+	if (samples_count > 0)
+		report(0, "replay", 0);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	load_options();
+	init_headless();
+
+	printf("size_mb\top\tsamples\tp50_us\tp90_us\tp99_us\tmax_us\tops_per_s\tmb_per_s\n");
+	if (argc >= 3 && strcmp(argv[1], "--replay") == 0)
+		return bench_replay(argv[2], argc >= 4 ? argv[3] : NULL);
+	if (argc < 2)
+	{
+		bench(1);
+		bench(100);
+	}
+	for (int i = 1; i < argc; i++)
+		bench(atoi(argv[i]));
+
+	free(samples);
+	return 0;
+}
@@ -27,3 +27,7 @@
 // Already defined in curses.h
 // #define KEY_SHOME	391
 // #define KEY_SEND	386
+
+// Bracketed paste markers, bound with define_key in init()
+#define KEY_PASTE_START	1000
+#define KEY_PASTE_END	1001
@@ -1,11 +1,41 @@
+#define _GNU_SOURCE
 #include <ncurses.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "write.h"
 #include "keymap.h"
 
+// Options
+int o_tabsize;
+int o_messagecooldown;
+bool o_show_linenumbers;
+bool o_soft_wrap;
+bool o_perf_hud;
+bool o_complete;
+int o_memory; // Memory budget in megabytes, or 0 for no limit
+
 // Window size
 int windowx, windowy;
 WINDOW *textscr;
@@ -19,322 +49,650 @@ bool end_shift_selecting = false;
 
 char *filename;
 
+// inotify instance watching the files being followed, or -1
+int follow_fd = -1;
+
+// Last generation given to a table's scan. It is shared, so that no table takes a line measured by another as its own
+unsigned char table_generations = 0;
+
+// Bytes of lines and their text held in memory, kept as text is allocated and freed, which the memory budget is held to
+long line_bytes = 0;
+
+// Line bytes to wait for before paging out again, after paging out could not get under the memory budget
+long page_retry = 0;
+
+// The last block read from a page file, as lines paged out together tend to be read back together
+char page_block[PAGE_BLOCK];
+int page_block_fd = -1;
+long page_block_pos;
+long page_block_length;
+
+// How lines are compared by sort
+bool sort_unique = false;
+bool sort_numeric = false;
+bool sort_reverse = false;
+
+// Words in every open buffer, in a trie whose nodes are kept in one array (node 0 is the root).
+// It is built when completion is first used, and kept up to date as lines change from then on
+bool words_indexed = false;
+int segment_words[1] = { -1 }; // The word_ids of a long line whose words are held by its segments
+Trie_node *trie = NULL;
+int trie_count = 0;
+int trie_size = 0;
+
+// The completion being cycled through by repeated CTRL-k
+bool completing = false;
+int complete_start; // Where the word being completed starts
+int complete_length;
+char complete_prefix[MAX_WORD_LENGTH];
+int complete_choice;
+
+// Lines being compared by diff, as numbers which are the same for equal lines
+int *diff_a = NULL;
+int *diff_b = NULL;
+bool *diff_changed_a = NULL;
+bool *diff_changed_b = NULL;
+int *diff_forward = NULL; // Furthest x reached on each diagonal, indexed by x - y
+int *diff_backward = NULL;
+int diff_cost_limit; // Edits to search before settling for a good rather than shortest script
+bool diff_stopped = false; // Whether ESC was pressed to abandon the diff
+long long diff_checked = 0; // When the keyboard was last checked for ESC
+
+// Background grep: a walker thread queues the files under a directory, workers search them
+// and add result lines to grep_results, writing to grep_pipe to wake the main loop
+pthread_mutex_t grep_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t grep_queued = PTHREAD_COND_INITIALIZER;
+pthread_t grep_walker;
+pthread_t grep_workers[GREP_THREADS];
+int grep_worker_count = 0;
+bool grep_walking = false; // Whether the walker thread was started
+bool grep_walked = false; // Whether every file has been queued
+int grep_running = 0; // Workers still searching
+bool grep_cancel = false;
+char **grep_queue = NULL;
+int grep_queue_head = 0;
+int grep_queue_count = 0;
+int grep_queue_size = 0;
+char *grep_results = NULL;
+size_t grep_results_length = 0;
+size_t grep_results_size = 0;
+int grep_matches = 0;
+int grep_files = 0;
+struct stat *grep_skip = NULL; // Files open in buffers, which are searched there rather than by the walker
+int grep_skip_count = 0;
+int grep_pipe[2] = { -1, -1 };
+char grep_pattern[MAX_COMMAND_LENGTH];
+buffer *grep_buffer = NULL; // Results buffer, until it is closed
+
 // Modes
 #define MODE_EDIT 1
 #define MODE_COMMAND 2
 
 int display_cx;
+int display_cy;
+
+// Running without a screen, for scripts and replaying traces
+bool headless = false;
+
+// Session trace being recorded or replayed
+FILE *trace_file = NULL;
+FILE *replay_file = NULL;
+long long trace_time = 0;
+int pushed_key = ERR;
+
+// Keyboard macro, recorded between presses of F5 and played back by F6 or the macro command
+int *macro_keys = NULL;
+int macro_length = 0;
+int macro_size = 0;
+bool macro_recording = false;
+int macro_pos = -1; // Next key to play back, or -1 when not playing
+
+// Performance figures for the status bar and histograms
+long long perf_draw_us = 0;
+long long perf_key_us = 0;
+long perf_frame_allocs = 0;
+long perf_frame_bytes = 0;
+long alloc_count = 0; // Made through counted_malloc and counted_realloc
+long alloc_bytes = 0;
+long perf_histogram[PERF_METRICS][PERF_BUCKETS];
+
 
 buffer *current_buffer = NULL;
 buffer *paste_buffer = NULL;
-buffer *message_buffer= NULL;
 buffer *first_buffer = NULL;
+buffer *last_buffer = NULL; // End of the buffer list, kept as buffers are linked in and out
 Undo_mark *undo_head = NULL;
+int undo_group = 0; // Group given to new undo marks, which are undone together (0 for none)
+int undo_groups = 0;
 int message_timer = 0;
 
+// Recent messages, the latest at message_head
+char message_ring[MESSAGE_HISTORY][MAX_MESSAGE_LENGTH];
+int message_head = 0;
+
 // Cut and paste buffer
 Line *pastebuffer;
 
 // Last pressed key
 int ch;
 
+// Syntax highlighting table
+char *c_filematch[] = { ".c", ".h", ".cpp", ".hpp", ".cc", NULL };
+Keyword c_keywords[] = {
+	{ "auto", HL_KEYWORD }, { "break", HL_KEYWORD }, { "case", HL_KEYWORD }, { "const", HL_KEYWORD },
+	{ "continue", HL_KEYWORD }, { "default", HL_KEYWORD }, { "do", HL_KEYWORD }, { "else", HL_KEYWORD },
+	{ "enum", HL_KEYWORD }, { "extern", HL_KEYWORD }, { "for", HL_KEYWORD }, { "goto", HL_KEYWORD },
+	{ "if", HL_KEYWORD }, { "inline", HL_KEYWORD }, { "register", HL_KEYWORD }, { "return", HL_KEYWORD },
+	{ "sizeof", HL_KEYWORD }, { "static", HL_KEYWORD }, { "struct", HL_KEYWORD }, { "switch", HL_KEYWORD },
+	{ "typedef", HL_KEYWORD }, { "union", HL_KEYWORD }, { "volatile", HL_KEYWORD }, { "while", HL_KEYWORD },
+	{ "NULL", HL_KEYWORD }, { "true", HL_KEYWORD }, { "false", HL_KEYWORD },
+	{ "#include", HL_KEYWORD }, { "#define", HL_KEYWORD }, { "#if", HL_KEYWORD }, { "#ifdef", HL_KEYWORD },
+	{ "#ifndef", HL_KEYWORD }, { "#else", HL_KEYWORD }, { "#endif", HL_KEYWORD },
+	{ "bool", HL_TYPE }, { "char", HL_TYPE }, { "double", HL_TYPE }, { "float", HL_TYPE },
+	{ "int", HL_TYPE }, { "long", HL_TYPE }, { "short", HL_TYPE }, { "signed", HL_TYPE },
+	{ "unsigned", HL_TYPE }, { "void", HL_TYPE }, { "size_t", HL_TYPE },
+	{ NULL, 0 }
+};
+
+char *sh_filematch[] = { ".sh", ".bash", ".zsh", NULL };
+Keyword sh_keywords[] = {
+	{ "if", HL_KEYWORD }, { "then", HL_KEYWORD }, { "else", HL_KEYWORD }, { "elif", HL_KEYWORD },
+	{ "fi", HL_KEYWORD }, { "for", HL_KEYWORD }, { "while", HL_KEYWORD }, { "until", HL_KEYWORD },
+	{ "do", HL_KEYWORD }, { "done", HL_KEYWORD }, { "case", HL_KEYWORD }, { "esac", HL_KEYWORD },
+	{ "in", HL_KEYWORD }, { "function", HL_KEYWORD }, { "return", HL_KEYWORD }, { "exit", HL_KEYWORD },
+	{ "break", HL_KEYWORD }, { "continue", HL_KEYWORD },
+	{ "echo", HL_TYPE }, { "cd", HL_TYPE }, { "export", HL_TYPE }, { "local", HL_TYPE },
+	{ "read", HL_TYPE }, { "set", HL_TYPE }, { "shift", HL_TYPE }, { "source", HL_TYPE },
+	{ "test", HL_TYPE }, { "unset", HL_TYPE },
+	{ NULL, 0 }
+};
+
+char *json_filematch[] = { ".json", NULL };
+Keyword json_keywords[] = {
+	{ "true", HL_KEYWORD }, { "false", HL_KEYWORD }, { "null", HL_KEYWORD },
+	{ NULL, 0 }
+};
+
+char *log_filematch[] = { ".log", NULL };
+Keyword log_keywords[] = {
+	{ "FATAL", HL_ERROR }, { "CRITICAL", HL_ERROR }, { "ERROR", HL_ERROR },
+	{ "WARN", HL_WARNING }, { "WARNING", HL_WARNING },
+	{ "INFO", HL_KEYWORD }, { "NOTICE", HL_KEYWORD }, { "DEBUG", HL_KEYWORD }, { "TRACE", HL_KEYWORD },
+	{ NULL, 0 }
+};
+
+Syntax syntax_table[] = {
+	{ "c", c_filematch, c_keywords, "//", "/*", "*/", "\"'", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+	{ "shell", sh_filematch, sh_keywords, "#", NULL, NULL, "\"'`", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_VARIABLES | HL_MULTILINE_STRINGS },
+	{ "json", json_filematch, json_keywords, NULL, NULL, NULL, "\"", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+	{ "log", log_filematch, log_keywords, NULL, NULL, NULL, "\"", HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+	{ NULL }
+};
+
+// Colour pair used for each highlight type
+int hl_colours[] = { 0, COL_CYANBLACK, COL_YELLOWBLACK, COL_GREENBLACK, COL_MAGENTABLACK, COL_REDBLACK, COL_GREENBLACK, COL_YELLOWBLACK, COL_REDBLACK };
+
+// Highlight types for the line being drawn
+unsigned char *hl_buffer = NULL;
+int hl_buffer_size = 0;
+
+#ifndef WRITE_LIBRARY
 int main(int argc, char *argv[])
 {
-	char s[MAX_COMMAND_LENGTH];
 	load_options();
 
-	if (argc >= 2)
+	if (argc >= 3 && strcmp(argv[1], "--script") == 0)
+		return run_script(argv[2], argc - 3, argv + 3);
+	if (argc >= 3 && strcmp(argv[1], "--replay") == 0)
+		return replay_trace(argv[2], argc >= 4 ? argv[3] : NULL);
+
+	int arg = 1;
+	if (argc >= 3 && strcmp(argv[1], "--trace") == 0)
 	{
-		if (!open_file(argv[1]))
-			new_file(argv[1]);
+		if (!start_trace(argv[2], argc >= 4 ? argv[3] : "blank.txt"))
+		{
+			fprintf(stderr, "Cannot write trace %s\n", argv[2]);
+			return 1;
+		}
+		arg = 3;
 	}
-	else
-	{
+
+	// Files are only read when their buffers are first shown
+	for (; arg < argc; arg++)
+		open_files(argv[arg]);
+	if (current_buffer == NULL)
 		new_file("blank.txt");
-	}
 
 	// Make sure the first buffer in the chain is the current buffer
 	first_buffer = current_buffer;
-
-	// Create message buffer
-	message_buffer = add_sbuffer();
-	message_buffer->first_line = NULL;
-	message_buffer->lines = 0;
+	while (first_buffer->prev != NULL)
+		first_buffer = first_buffer->prev;
+	switch_buffer(first_buffer);
 
 	message("");
 	init();
 	move_file_home();
-	
+
+	long long frame_start = 0;
 	while(current_buffer != NULL)
 	{
-		refresh_screen();
-		ch = getch();
-
-		if (ch == CTRL('q'))
-			break;
-
-		if (shifted_navigation_key(ch))
+		// Apply keys which are already waiting before redrawing, but still redraw every MAX_FRAME_TIME
+		if (!key_pending() || monotonic_us() - frame_start > MAX_FRAME_TIME * 1000)
 		{
-			if (!shift_selecting)
-			{
-				shift_selecting = true;
-				mark(current_buffer);
-			}
+			long long draw_start = monotonic_us();
+			perf_frame();
+			refresh_screen();
+			frame_start = monotonic_us();
+			perf_draw_us = frame_start - draw_start;
+			perf_record(PERF_DRAW, perf_draw_us);
+			trace_event(TRACE_DRAW, perf_draw_us);
 		}
-		else if (shift_selecting)
+		ch = read_key();
+
+		long long handle_start = monotonic_us();
+		bool running = handle_key();
+		perf_key_us = monotonic_us() - handle_start;
+		perf_record(PERF_KEY, perf_key_us);
+		trace_event(TRACE_HANDLE, perf_key_us);
+		if (!running)
+			break;
+		check_memory();
+	}
+
+	shutdown();
+	return 0;
+}
+#endif
+
+// Act on the key in ch, returning false when the editor should quit
+bool handle_key()
+{
+	char s[MAX_COMMAND_LENGTH];
+	char c;
+
+	if (ch == CTRL('q'))
+		return false;
+	if (ch != CTRL('k'))
+		completing = false;
+
+	// The buffer left current by closing another is read in before keys act on it
+	if (!current_buffer->loaded)
+		load_buffer(current_buffer);
+
+	// With several cursors or a block selected, typing and deleting act on every line
+	if ((current_buffer->cursor_count > 0 || current_buffer->block_select) && cursors_key(ch))
+		return true;
+
+	if (shifted_navigation_key(ch))
+	{
+		if (!shift_selecting)
 		{
-			end_shift_selecting = true;
+			shift_selecting = true;
+			mark(current_buffer);
 		}
+	}
+	else if (shift_selecting)
+	{
+		end_shift_selecting = true;
+	}
 
-		switch (ch)
-		{
-			// Movement keys
-			case KEY_RIGHT:
-			case KEY_SRIGHT:
-				move_right();
-				break;
-			case KEY_LEFT:
-			case KEY_SLEFT:
-				move_left();
-				break;
-			case KEY_UP:
-			case KEY_SUP:
-				move_up();
-				break;
-			case KEY_DOWN:
-			case KEY_SDOWN:
-				move_down();
-				break;
-			case CTRL_RIGHT: 
-			case KEY_CTRL_SRIGHT:
-				move_word_right();
-				break;
-			case CTRL_LEFT: 
-			case KEY_CTRL_SLEFT:
-				move_word_left();
-				break;
-			case KEY_NPAGE:
-			case KEY_SPGDOWN:
-				move_page_down();
-				break;
-			case KEY_PPAGE:
-			case KEY_SPGUP:
-				move_page_up();
-				break;
-			case KEY_END:
-			case KEY_SEND:
-				move_end();
-				break;
-			case KEY_HOME:
-			case KEY_SHOME:
-				move_home();
-				break;
-			case CTRL_HOME: // CTRL-HOME
-			case KEY_CTRLSHOME:
-				move_file_home();
-				break;
-			case CTRL_END: // CTRL-END
-			case KEY_CTRLSEND:
-				move_file_end();
-				break;
+	switch (ch)
+	{
+		// Movement keys
+		case KEY_RIGHT:
+		case KEY_SRIGHT:
+			move_right();
+			break;
+		case KEY_LEFT:
+		case KEY_SLEFT:
+			move_left();
+			break;
+		case KEY_UP:
+		case KEY_SUP:
+			move_up();
+			break;
+		case KEY_DOWN:
+		case KEY_SDOWN:
+			move_down();
+			break;
+		case CTRL_RIGHT: 
+		case KEY_CTRL_SRIGHT:
+			move_word_right();
+			break;
+		case CTRL_LEFT: 
+		case KEY_CTRL_SLEFT:
+			move_word_left();
+			break;
+		case KEY_NPAGE:
+		case KEY_SPGDOWN:
+			move_page_down();
+			break;
+		case KEY_PPAGE:
+		case KEY_SPGUP:
+			move_page_up();
+			break;
+		case KEY_END:
+		case KEY_SEND:
+			move_end();
+			break;
+		case KEY_HOME:
+		case KEY_SHOME:
+			move_home();
+			break;
+		case CTRL_HOME: // CTRL-HOME
+		case KEY_CTRLSHOME:
+			move_file_home();
+			break;
+		case CTRL_END: // CTRL-END
+		case KEY_CTRLSEND:
+			move_file_end();
+			break;
 
 
-			case CTRL_PGDOWN: // CTRL-PGDOWN
-				if (current_buffer->next != NULL) current_buffer = current_buffer->next;
-				else current_buffer = first_buffer;
-				break;
+		case CTRL_PGDOWN: // CTRL-PGDOWN
+			if (current_buffer->next != NULL) switch_buffer(current_buffer->next);
+			else switch_buffer(first_buffer);
+			break;
+		case CTRL_PGUP: // CTRL-PGUP
+			if (current_buffer->prev != NULL) switch_buffer(current_buffer->prev);
+			else switch_buffer(last_buffer);
+			break;
+		case CTRL('p'): // Pick a buffer
+			buffer_picker();
+			break;
+		case CTRL('k'): // Complete a word
+			complete();
+			break;
 
-			case CTRL('l'): // Line numbers
-				toggle_linenumbers();
-				break;
-			case CTRL('g'): // Goto line
-				if (get_input("Goto line ", "", s, 10))
-				{
-					if (atoi(s) > 0)
-						goto_line(atoi(s));
-				}
-				break;
-			case CTRL('f'): // Find
-				if (get_input("Search for ", "", s, MAX_COMMAND_LENGTH))
+		case CTRL('l'): // Line numbers
+			toggle_linenumbers();
+			break;
+		case CTRL('w'): // Soft wrap
+			toggle_soft_wrap();
+			break;
+		case CTRL('g'): // Goto line
+			if (get_input("Goto line ", "", s, 10))
+			{
+				if (atoi(s) > 0)
+					goto_line(atoi(s));
+			}
+			break;
+		case CTRL('f'): // Find
+			if (get_input("Search for ", "", s, MAX_COMMAND_LENGTH))
+			{
+				if (find(s, current_buffer->current_line, current_buffer->cx))
 				{
-					if (find(s, current_buffer->current_line, current_buffer->cx))
+					message("Press ENTER to search again");
+					refresh_screen();
+					ch = read_key();
+					while (ch == 10) // While ENTER is pressed, find again
 					{
+						find(s, current_buffer->current_line, current_buffer->cx);
 						message("Press ENTER to search again");
 						refresh_screen();
-						ch = getch();
-						while (ch == 10) // While ENTER is pressed, find again
-						{
-							find(s, current_buffer->current_line, current_buffer->cx);
-							message("Press ENTER to search again");
-							refresh_screen();
-							ch = getch();
-						}
-						message("");
-						ungetch(ch); // Push character back into input buffer if not ENTER
+						ch = read_key();
 					}
-
-					break;
+					message("");
+					unread_key(ch); // Push character back into input buffer if not ENTER
 				}
-				break;
 
-			// Saving and loading
-			case CTRL('s'): // Save
-				prompt_save();
-				break;
-			case CTRL('o'): // Open
-				if (get_input("Load ", "", s, MAX_FILENAME_LENGTH))
-				{
-					if (!open_file(s))
-						new_file(s);
-					move_file_home();				
-				}
-				break;
-			case KEY_F(4): // Close
-				if (current_buffer->modified) 
-					prompt_save();
-				close(current_buffer);
-				break;
-			case CTRL('n'): // New
-				new_file("new.txt");
-				move_file_home();
 				break;
+			}
+			break;
 
-			// Cut and paste
-			case CTRL('b'): // Mark
-				if (current_buffer->select_mark.line)
-				{
-					clear_mark(current_buffer);
-				}
-				else
-				{
-					mark(current_buffer);
-				}
-				break;
-			case CTRL('c'): // Copy
-				if (current_buffer->select_mark.line == NULL)
-					copy_line();
-				else
-					copy();
+		// Saving and loading
+		case CTRL('s'): // Save
+			prompt_save();
+			break;
+		case CTRL('o'): // Open
+			if (get_input("Load ", "", s, MAX_FILENAME_LENGTH))
+			{
+				open_files(s);
+				switch_buffer(current_buffer);
+				move_file_home();
+			}
+			break;
+		case KEY_F(7): // Previous diff hunk
+			next_hunk(-1);
+			break;
+		case KEY_F(8): // Next diff hunk
+			next_hunk(1);
+			break;
+		case KEY_F(5): // Record a macro
+			record_macro();
+			break;
+		case KEY_F(6): // Play the macro
+			play_macro(1);
+			break;
+		case KEY_F(4): // Close
+			if (current_buffer->modified) 
+				prompt_save();
+			close_buffer(current_buffer);
+			break;
+		case CTRL('n'): // New
+			new_file("new.txt");
+			move_file_home();
+			break;
 
+		// Cut and paste
+		case CTRL('b'): // Mark
+			if (current_buffer->select_mark.line)
+			{
 				clear_mark(current_buffer);
-				break;
-			case CTRL('x'): // Cut
-				if (current_buffer->select_mark.line == NULL)
-					cut_line();
-				else
-					cut();
-				current_buffer->modified = true;
+			}
+			else
+			{
+				mark(current_buffer);
+			}
+			break;
+		case CTRL('r'): // Block selection
+			if (current_buffer->select_mark.line)
+			{
 				clear_mark(current_buffer);
-				break;
-			case CTRL('v'): // Paste
-				paste();
-				current_buffer->modified = true;
-				break;
-			case CTRL('z'): // Undo
-				pull_undo();
-				current_buffer->modified = true;
-				break;
+			}
+			else
+			{
+				mark(current_buffer);
+				current_buffer->block_select = true;
+			}
+			break;
+		case CTRL('c'): // Copy
+			if (current_buffer->select_mark.line == NULL)
+				copy_line();
+			else
+				copy();
 
-			// Command mode
-			case 27: // ESC
-				if (get_input("? ", "", s, MAX_COMMAND_LENGTH)) run_command(s);
-				break;
-			case KEY_RESIZE:
-				resize_window();
-				break;
+			clear_mark(current_buffer);
+			break;
+		case CTRL('x'): // Cut
+			if (current_buffer->select_mark.line == NULL)
+				cut_line();
+			else
+				cut();
+			current_buffer->modified = true;
+			clear_mark(current_buffer);
+			break;
+		case CTRL('v'): // Paste
+			paste();
+			current_buffer->modified = true;
+			break;
+		case KEY_PASTE_START: // Paste from the terminal
+			if (current_buffer->select_mark.line != NULL)
+			{
+				delete_selection();
+				clear_mark(current_buffer);
+			}
+			terminal_paste();
+			current_buffer->modified = true;
+			break;
+		case CTRL('z'): // Undo
+			pull_undo();
+			current_buffer->modified = true;
+			break;
+
+		// Command mode
+		case 27: // ESC
+			if (get_input("? ", "", s, MAX_COMMAND_LENGTH)) run_command(s);
+			break;
+		case KEY_RESIZE:
+			resize_window();
+			break;
 
 /*
 #define UNDO_CUT 4
-#define UNDO_PASTE 5
 #define UNDO_DELETESELECTION 7
 */
 
-			// Editing
-			case 10: // ENTER
-				enter();
-				current_buffer->modified = true;
-				// Push the current position into the undo buffer
-				push_undo(current_buffer->cx, current_buffer->cy + current_buffer->offsety, UNDO_ENTER, NULL, 0);
+		// Editing
+		case 10: // ENTER
+			if (current_buffer->type == BUFFER_PICKER)
+			{
+				pick_buffer();
 				break;
-			case KEY_BACKSPACE:
-				// Delete selection if there is a select mark
-				if (current_buffer->select_mark.line != NULL)
-				{
-					delete_selection();
-				}
-				else
-				{
-					// Push the previous character into the undo buffer
-					push_undo(current_buffer->cx, current_buffer->cy + current_buffer->offsety, UNDO_BACKSPACE, current_buffer->current_line->text + current_buffer->cx - 1, 1);
-					backspace();
-				}
-				current_buffer->modified = true;
-				clear_mark(current_buffer);
+			}
+			if (current_buffer->type == BUFFER_GREP)
+			{
+				grep_jump();
 				break;
-			case KEY_DC:
-				// Delete selection if there is a select mark
+			}
+			if (current_buffer->type == BUFFER_DIFF)
+			{
+				diff_jump();
+				break;
+			}
+			enter();
+			current_buffer->modified = true;
+			// Push the current position into the undo buffer
+			push_undo(current_buffer->cx, current_buffer->cy + current_buffer->offsety, UNDO_ENTER, NULL, 0);
+			break;
+		case KEY_BACKSPACE:
+			// Delete selection if there is a select mark
+			if (current_buffer->select_mark.line != NULL)
+			{
+				delete_selection();
+			}
+			else
+			{
+				// Push the previous character into the undo buffer
+				c = line_char(current_buffer->current_line, current_buffer->cx - 1);
+				push_undo(current_buffer->cx, current_buffer->cy + current_buffer->offsety, UNDO_BACKSPACE, &c, 1);
+				backspace();
+			}
+			current_buffer->modified = true;
+			clear_mark(current_buffer);
+			break;
+		case KEY_DC:
+			// Delete selection if there is a select mark
+			if (current_buffer->select_mark.line != NULL)
+			{
+				delete_selection();
+			}
+			else
+			{
+				// Push the current character in the text buffer into the undo buffer
+				c = line_char(current_buffer->current_line, current_buffer->cx);
+				push_undo(current_buffer->cx + 1, current_buffer->cy + current_buffer->offsety, UNDO_DELETE, &c, 1);
+				delete();
+			}
+			current_buffer->modified = true;
+			clear_mark(current_buffer);
+			break;
+		default:
+			if ((ch > 27 && ch < 256) || (ch == '\t')) // Ignore control characters
+			{
 				if (current_buffer->select_mark.line != NULL)
 				{
 					delete_selection();
+					clear_mark(current_buffer);
 				}
-				else
-				{
-					// Push the current character in the text buffer into the undo buffer
-					push_undo(current_buffer->cx + 1, current_buffer->cy + current_buffer->offsety, UNDO_DELETE, current_buffer->current_line->text + current_buffer->cx, 1);
-					delete();
-				}
+				insert_char(current_buffer->current_line, current_buffer->cx, ch);
+				current_buffer->cx++;
+				check_boundx();
 				current_buffer->modified = true;
-				clear_mark(current_buffer);
-				break;
-			default:
-				if ((ch > 27 && ch < 256) || (ch == '\t')) // Ignore control characters
-				{
-					if (current_buffer->select_mark.line != NULL)
-					{
-						delete_selection();
-						clear_mark(current_buffer);
-					}
-					insert_char(current_buffer->current_line, current_buffer->cx, ch);
-					current_buffer->cx++;
-					check_boundx();
-					current_buffer->modified = true;
-					// Push the character just inserted into the undo buffer
-					push_undo(current_buffer->cx, current_buffer->cy + current_buffer->offsety, UNDO_INSERTCHAR, current_buffer->current_line->text + current_buffer->cx - 1, 1);
-				}
-				break;
-		}
+				// Push the character just inserted into the undo buffer
+				c = line_char(current_buffer->current_line, current_buffer->cx - 1);
+				push_undo(current_buffer->cx, current_buffer->cy + current_buffer->offsety, UNDO_INSERTCHAR, &c, 1);
 
-		if (end_shift_selecting)
-		{
-			shift_selecting = false;
-			end_shift_selecting = false;
-			clear_mark(current_buffer);
-		}
+				if (o_complete && is_word_char(c))
+					hint_completion();
+			}
+			break;
 	}
 
-	shutdown();
-	return 0;
-}
-
-bool shifted_navigation_key(int ch)
-{
-	switch (ch)
+	if (end_shift_selecting)
 	{
-		case KEY_SRIGHT:
-		case KEY_SLEFT:
-		case KEY_SUP:
-		case KEY_SDOWN:
-		case KEY_SPGUP:
-		case KEY_SPGDOWN:
-		case KEY_SHOME:
-		case KEY_SEND:
-		case KEY_CTRLSEND:
-		case KEY_CTRLSHOME:
-		case KEY_CTRL_SRIGHT:
-		case KEY_CTRL_SLEFT:
-			return true;
-		default:
-			return false;
+		shift_selecting = false;
+		end_shift_selecting = false;
+		clear_mark(current_buffer);
+	}
+	return true;
+}
+
+// Allocate memory for lines, their text, undo marks or the word index, counting it for the performance display
+void *counted_malloc(size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return malloc(size);
+}
+
+void *counted_realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return realloc(ptr, size);
+}
+
+// Check whether another key is waiting without blocking
+bool key_pending()
+{
+	nodelay(stdscr, TRUE);
+	int c = getch();
+	nodelay(stdscr, FALSE);
+	if (c == ERR)
+		return false;
+	ungetch(c);
+	return true;
+}
+
+// Take an ESC typed to stop a long running command, leaving any other key to be handled after it
+bool escape_pending()
+{
+	if (headless || !key_pending())
+		return false;
+	int c = getch();
+	if (c == 27)
+		return true;
+	ungetch(c);
+	return false;
+}
+
+long long monotonic_us()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long long) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+bool shifted_navigation_key(int ch)
+{
+	switch (ch)
+	{
+		case KEY_SRIGHT:
+		case KEY_SLEFT:
+		case KEY_SUP:
+		case KEY_SDOWN:
+		case KEY_SPGUP:
+		case KEY_SPGDOWN:
+		case KEY_SHOME:
+		case KEY_SEND:
+		case KEY_CTRLSEND:
+		case KEY_CTRLSHOME:
+		case KEY_CTRL_SRIGHT:
+		case KEY_CTRL_SLEFT:
+			return true;
+		default:
+			return false;
 	}
 }
 
@@ -361,6 +719,33 @@ bool navigation_key(int ch)
 	}
 }
 
+// Keys which move the cursor from where it is, so do nothing when there is nowhere to go
+bool moving_key(int ch)
+{
+	switch (ch)
+	{
+		case KEY_RIGHT:
+		case KEY_LEFT:
+		case KEY_UP:
+		case KEY_DOWN:
+		case KEY_NPAGE:
+		case KEY_PPAGE:
+		case CTRL_RIGHT:
+		case CTRL_LEFT:
+		case KEY_SRIGHT:
+		case KEY_SLEFT:
+		case KEY_SUP:
+		case KEY_SDOWN:
+		case KEY_SPGUP:
+		case KEY_SPGDOWN:
+		case KEY_CTRL_SRIGHT:
+		case KEY_CTRL_SLEFT:
+			return true;
+		default:
+			return false;
+	}
+}
+
 void init()
 {
 	// Initialise screen and get dimensions
@@ -372,6 +757,10 @@ void init()
 	init_pair(COL_GREENBLACK, COLOR_GREEN, COLOR_BLACK);
 	init_pair(COL_BLACKWHITE, COLOR_BLACK, COLOR_WHITE);
 	init_pair(COL_BLUEWHITE, COLOR_BLUE, COLOR_WHITE);
+	init_pair(COL_CYANBLACK, COLOR_CYAN, COLOR_BLACK);
+	init_pair(COL_YELLOWBLACK, COLOR_YELLOW, COLOR_BLACK);
+	init_pair(COL_MAGENTABLACK, COLOR_MAGENTA, COLOR_BLACK);
+	init_pair(COL_REDBLACK, COLOR_RED, COLOR_BLACK);
 
 	resize_window();
 
@@ -382,6 +771,12 @@ void init()
 	noecho();
 	keypad(stdscr, TRUE);
 
+	// Have the terminal mark pasted text so it can be inserted in one go
+	define_key("\033[200~", KEY_PASTE_START);
+	define_key("\033[201~", KEY_PASTE_END);
+	printf("\033[?2004h");
+	fflush(stdout);
+
 	// Start cursor at top left
 	current_buffer->cx = 0;
 	current_buffer->cy = 0;
@@ -401,9 +796,7 @@ void init()
 void shutdown()
 {
 	delete_lines(pastebuffer); // Clear the copy buffer
-	delete_lines(message_buffer->first_line); // Clear the message buffer
-
-	free(message_buffer);
+	free(hl_buffer);
 
 	// Close any open buffers
 	while (current_buffer != NULL)
@@ -415,31 +808,66 @@ void shutdown()
 			update_status();
 			prompt_save();
 		}
-		close(current_buffer);
+		close_buffer(current_buffer);
 	}
 
-	// Clear the undo marks
+	clear_undo();
+
+	end_trace();
+	set_escdelay(1000);
+	printf("\033[?2004l");
+	fflush(stdout);
+	endwin();
+	return;
+}
+
+// Free all of the undo marks
+void clear_undo()
+{
 	while (undo_head != NULL)
 	{
 		Undo_mark *u = undo_head;
 		undo_head = u->next;
+		delete_lines(u->removed);
 		free(u->text);
 		free(u);
 	}
+}
 
-	set_escdelay(1000);
-	endwin();
-	return;
+// Drop the undo marks made in one buffer, once the text they were made in is gone
+void drop_undo(buffer *b)
+{
+	Undo_mark **link = &undo_head;
+	while (*link != NULL)
+	{
+		Undo_mark *u = *link;
+		if (u->buffer != b)
+		{
+			link = &u->next;
+			continue;
+		}
+		*link = u->next;
+		delete_lines(u->removed);
+		free(u->text);
+		free(u);
+	}
 }
 
 void push_undo(int x, int y, int type, char *text, int length)
 {
-	Undo_mark *mark = (Undo_mark *) malloc(sizeof(Undo_mark));
+	Undo_mark *mark = (Undo_mark *) counted_malloc(sizeof(Undo_mark));
 	mark->x = x;
 	mark->y = y;
 	mark->type = type;
-	mark->text = (char *) malloc(sizeof(char) * length);
-	memcpy(mark->text, text, length);
+	mark->length = length;
+	mark->lines = 0;
+	mark->end_x = 0;
+	mark->removed = NULL;
+	mark->group = undo_group;
+	mark->buffer = current_buffer;
+	mark->text = (char *) counted_malloc(sizeof(char) * length);
+	if (length > 0)
+		memcpy(mark->text, text, length);
 
 	// Insert this mark at the head of the undo mark list
 	mark->next = undo_head;
@@ -448,34 +876,69 @@ void push_undo(int x, int y, int type, char *text, int length)
 
 /*
 #define UNDO_CUT 4
-#define UNDO_PASTE 5
 #define UNDO_DELETESELECTION 7
 */
 
+// Undo the last change, or the whole of the last group of changes
 void pull_undo()
+{
+	if (undo_head == NULL)
+		return;
+
+	// A macro undoing its own changes as it plays only undoes one at a time
+	int group = undo_head->group;
+	do
+		pull_undo_mark();
+	while (group != 0 && group != undo_group && undo_head != NULL && undo_head->group == group);
+}
+
+void pull_undo_mark()
 {
 	Undo_mark *mark = undo_head;
 
 	// Return immediately if nothing in the buffer
 	if (mark == NULL) return; 
 
-	// Goto where the mark needs to be undone
-	goto_line(mark->y + 1);
+	// Goto where the mark needs to be undone, which is usually near the last one
+	move_to_line(mark->y + 1);
 	current_buffer->cx = mark->x - 1;
 	check_boundx();
 
 	if (mark->type == UNDO_INSERTCHAR)
 		delete();
 	else if (mark->type == UNDO_DELETE)
-		insert_string(current_buffer->current_line, current_buffer->cx, mark->text, 1);
+		insert_string(current_buffer->current_line, current_buffer->cx, mark->text, mark->length);
 	else if (mark->type == UNDO_BACKSPACE)
-		insert_string(current_buffer->current_line, current_buffer->cx, mark->text, 1);
+		insert_string(current_buffer->current_line, current_buffer->cx, mark->text, mark->length);
 	else if (mark->type == UNDO_ENTER)
 		backspace();
+	else if (mark->type == UNDO_REPLACE)
+	{
+		text_replace(current_buffer->current_line, current_buffer->cx, mark->end_x, mark->text, mark->length);
+		line_changed(current_buffer->current_line);
+	}
+	else if (mark->type == UNDO_PASTE)
+		delete_range(mark->lines, mark->end_x);
+	else if (mark->type == UNDO_SORT)
+	{
+		unsort_lines(mark);
+		mark->removed = NULL;
+	}
+	else if (mark->type == UNDO_FILTER)
+	{
+		// Swap the filtered lines back out for the originals
+		int lines = 0;
+		for (Line *l = mark->removed; l != NULL; l = l->next)
+			lines++;
+		delete_lines(replace_lines(current_buffer->current_line, mark->lines, mark->removed, lines));
+		mark->removed = NULL;
+		goto_line(mark->y + 1);
+	}
 
 	// Move the head to the next item in the list
 	undo_head = mark->next;
 	// Delete the undo mark
+	delete_lines(mark->removed);
 	free(mark->text);
 	free(mark);
 }
@@ -531,9 +994,9 @@ void move_down()
 void move_word_right()
 {
 	// Go through spaces, non-spaces, then spaces
-	while (current_buffer->cx != current_buffer->current_line->length && isspace(current_buffer->current_line->text[current_buffer->cx])) current_buffer->cx++;
-	while (current_buffer->cx != current_buffer->current_line->length && !isspace(current_buffer->current_line->text[current_buffer->cx])) current_buffer->cx++;
-	while (current_buffer->cx != current_buffer->current_line->length && isspace(current_buffer->current_line->text[current_buffer->cx])) current_buffer->cx++;
+	while (current_buffer->cx != current_buffer->current_line->length && isspace(line_char(current_buffer->current_line, current_buffer->cx))) current_buffer->cx++;
+	while (current_buffer->cx != current_buffer->current_line->length && !isspace(line_char(current_buffer->current_line, current_buffer->cx))) current_buffer->cx++;
+	while (current_buffer->cx != current_buffer->current_line->length && isspace(line_char(current_buffer->current_line, current_buffer->cx))) current_buffer->cx++;
 	check_boundx();
 }
 
@@ -547,24 +1010,24 @@ void move_word_left()
 	}
 
 	// If in space, go to start of previous word
-	if (isspace(current_buffer->current_line->text[current_buffer->cx]))
+	if (isspace(line_char(current_buffer->current_line, current_buffer->cx)))
 	{
-		while (current_buffer->cx > 0 && isspace(current_buffer->current_line->text[current_buffer->cx])) current_buffer->cx--;
-		while (current_buffer->cx > 0 && !isspace(current_buffer->current_line->text[current_buffer->cx - 1])) current_buffer->cx--;
+		while (current_buffer->cx > 0 && isspace(line_char(current_buffer->current_line, current_buffer->cx))) current_buffer->cx--;
+		while (current_buffer->cx > 0 && !isspace(line_char(current_buffer->current_line, current_buffer->cx - 1))) current_buffer->cx--;
 	}
 
 	// If at start of word, go to start of previous word
-	else if (isspace(current_buffer->current_line->text[current_buffer->cx - 1]))
+	else if (isspace(line_char(current_buffer->current_line, current_buffer->cx - 1)))
 	{
 		current_buffer->cx--;
-		while (current_buffer->cx > 0 && isspace(current_buffer->current_line->text[current_buffer->cx])) current_buffer->cx--;
-		while (current_buffer->cx > 0 && !isspace(current_buffer->current_line->text[current_buffer->cx - 1])) current_buffer->cx--;
+		while (current_buffer->cx > 0 && isspace(line_char(current_buffer->current_line, current_buffer->cx))) current_buffer->cx--;
+		while (current_buffer->cx > 0 && !isspace(line_char(current_buffer->current_line, current_buffer->cx - 1))) current_buffer->cx--;
 	}
 
 	// If not at start of word, go to start of the current word
 	else
 	{
-		while (current_buffer->cx > 0 && !isspace(current_buffer->current_line->text[current_buffer->cx - 1])) current_buffer->cx--;
+		while (current_buffer->cx > 0 && !isspace(line_char(current_buffer->current_line, current_buffer->cx - 1))) current_buffer->cx--;
 	}
 
 	check_boundx();
@@ -572,14 +1035,20 @@ void move_word_left()
 
 void move_page_down()
 {
-	move_lines_down(windowy);
+	if (o_soft_wrap)
+		move_rows(windowy);
+	else
+		move_lines_down(windowy);
 	check_boundx();
 	return;
 }
 
 void move_page_up()
 {
-	move_lines_up(windowy);
+	if (o_soft_wrap)
+		move_rows(-windowy);
+	else
+		move_lines_up(windowy);
 	check_boundx();
 	return;
 }
@@ -605,6 +1074,7 @@ void move_file_home()
 	current_buffer->first_screen_line = current_buffer->first_line;
 	current_buffer->offsetx = 0;
 	current_buffer->offsety = 0;
+	current_buffer->top_row = 0;
 	current_buffer->cx = 0;
 	current_buffer->cy = 0;
 	return;
@@ -612,7 +1082,10 @@ void move_file_home()
 
 void move_file_end()
 {
-	move_lines_down(current_buffer->lines - current_buffer->cy - current_buffer->offsety);
+	if (o_soft_wrap)
+		goto_line(current_buffer->lines);
+	else
+		move_lines_down(current_buffer->lines - current_buffer->cy - current_buffer->offsety);
 	move_end();
 	return;
 }
@@ -632,12 +1105,28 @@ void check_boundx()
 		current_buffer->offsetx = 0;
 		current_buffer->cx = 0;
 	}
+
+	// Aligned columns are scrolled by display column rather than by byte
+	if (table_line(current_buffer, current_buffer->current_line))
+	{
+		int dx = cxtodx(current_buffer->current_line, current_buffer->cx);
+		int width = windowx - current_buffer->margin_left;
+		if (dx - current_buffer->offsetx > width - 1)
+			current_buffer->offsetx = dx - width + 1;
+		if (dx < current_buffer->offsetx)
+			current_buffer->offsetx = dx;
+		return;
+	}
 	if (cxtodx(current_buffer->current_line, current_buffer->cx) - current_buffer->offsetx > windowx - current_buffer->margin_left - 1)
 		current_buffer->offsetx = current_buffer->cx - windowx - current_buffer->margin_left + 1;
 
 	if (cxtodx(current_buffer->current_line, current_buffer->cx) - current_buffer->offsetx < 0)
 		current_buffer->offsetx = current_buffer->cx;
 
+	// Wrapped lines are never scrolled horizontally
+	if (o_soft_wrap)
+		current_buffer->offsetx = 0;
+
 	return;
 }
 
@@ -645,10 +1134,44 @@ void goto_line(int line)
 {
 	if (line > current_buffer->lines) return;
 	move_file_home();
+	if (o_soft_wrap)
+	{
+		// Look the line up in the index rather than walking the list
+		check_index();
+		current_buffer->current_line = line_at(line - 1);
+		current_buffer->cy = line - 1;
+		scroll_wrapped();
+		return;
+	}
 	move_lines_down(line - 1);
 	return;
 }
 
+// Go to a line by moving from the current one, which is quicker than goto_line() when it is close by
+void move_to_line(int line)
+{
+	int y = current_buffer->cy + current_buffer->offsety + 1;
+	if (line > current_buffer->lines || abs(line - y) >= line)
+		goto_line(line);
+	else if (o_soft_wrap)
+	{
+		// Walk the lines, then let the row index scroll only as far as the cursor needs
+		Line *l = current_buffer->current_line;
+		int d = cxtodx(l, current_buffer->cx);
+		for (; y < line; y++)
+			l = l->next;
+		for (; y > line; y--)
+			l = l->prev;
+		current_buffer->current_line = l;
+		current_buffer->cx = dxtocx(l, d);
+		scroll_wrapped();
+	}
+	else if (line > y)
+		move_lines_down(line - y);
+	else
+		move_lines_up(y - line);
+}
+
 void move_lines_up(int count)
 {
 	int d = cxtodx(current_buffer->current_line, current_buffer->cx);
@@ -660,6 +1183,7 @@ void move_lines_up(int count)
 		{
 			current_buffer->first_screen_line = current_buffer->first_screen_line->prev;
 			current_buffer->offsety -= 1;
+			current_buffer->top_row = 0;
 		}
 		current_buffer->current_line = current_buffer->current_line->prev;
 	}
@@ -678,6 +1202,7 @@ void move_lines_down(int count)
 		{
 			current_buffer->first_screen_line = current_buffer->first_screen_line->next;
 			current_buffer->offsety += 1;
+			current_buffer->top_row = 0;
 		}
 		current_buffer->current_line = current_buffer->current_line->next;
 	}
@@ -685,18 +1210,414 @@ void move_lines_down(int count)
 	return;
 }
 
+// Move the cursor up or down a number of screen rows when soft wrapping
+void move_rows(int count)
+{
+	int width = windowx - current_buffer->margin_left;
+	check_index();
+
+	long top = row_of(current_buffer->first_screen_line) + current_buffer->top_row;
+	int d = cxtodx(current_buffer->current_line, current_buffer->cx) % width;
+	long target = row_of(current_buffer->current_line) + cursor_wrapped_row() + count;
+
+	if (target < 0)
+		target = 0;
+	if (target >= current_buffer->index->total_rows)
+		target = current_buffer->index->total_rows - 1;
+
+	// Scroll the screen by the same number of rows
+	top += count;
+	if (top > current_buffer->index->total_rows - windowy)
+		top = current_buffer->index->total_rows - windowy;
+	if (top < 0)
+		top = 0;
+
+	int line_row;
+	current_buffer->current_line = line_at_row(target, &line_row);
+	current_buffer->cx = dxtocx(current_buffer->current_line, line_row * width + d);
+	current_buffer->first_screen_line = line_at_row(top, &current_buffer->top_row);
+	current_buffer->offsety = index_of(current_buffer->first_screen_line);
+	current_buffer->cy = index_of(current_buffer->current_line) - current_buffer->offsety;
+	scroll_wrapped();
+}
+
+// Scroll so that the cursor row is on screen when soft wrapping
+void scroll_wrapped()
+{
+	check_index();
+
+	long top = row_of(current_buffer->first_screen_line) + current_buffer->top_row;
+	long cursor = row_of(current_buffer->current_line) + cursor_wrapped_row();
+
+	if (cursor < top)
+		top = cursor;
+	else if (cursor >= top + windowy)
+		top = cursor - windowy + 1;
+
+	current_buffer->first_screen_line = line_at_row(top, &current_buffer->top_row);
+	current_buffer->offsety = index_of(current_buffer->first_screen_line);
+	current_buffer->cy = index_of(current_buffer->current_line) - current_buffer->offsety;
+}
+
+// Get the screen row of the cursor within a wrapped line
+int cursor_wrapped_row()
+{
+	int width = windowx - current_buffer->margin_left;
+	int row = cxtodx(current_buffer->current_line, current_buffer->cx) / width;
+	if (current_buffer->current_line->node != NULL && row >= current_buffer->current_line->node->rows)
+		row = current_buffer->current_line->node->rows - 1;
+	return row;
+}
+
+// Number of screen rows needed to show a line of the given display width
+int wrapped_rows(int width)
+{
+	int row_width = windowx - current_buffer->margin_left;
+	if (width <= 0)
+		return 1;
+	return (width + row_width - 1) / row_width;
+}
+
+void toggle_soft_wrap()
+{
+	o_soft_wrap = !o_soft_wrap;
+	current_buffer->offsetx = 0;
+	current_buffer->top_row = 0;
+
+	// Drop the line indexes, which are only kept up to date while wrapping
+	if (!o_soft_wrap)
+	{
+		for (buffer *b = first_buffer; b != NULL; b = b->next)
+			free_index(b);
+	}
+	return;
+}
+
+int node_count(Line_node *node)
+{
+	return node ? node->count : 0;
+}
+
+long node_rows(Line_node *node)
+{
+	return node ? node->total_rows : 0;
+}
+
+// Recalculate a node's subtree totals from its children
+void node_update(Line_node *node)
+{
+	node->count = 1 + node_count(node->left) + node_count(node->right);
+	node->total_rows = node->rows + node_rows(node->left) + node_rows(node->right);
+	if (node->left != NULL) node->left->parent = node;
+	if (node->right != NULL) node->right->parent = node;
+}
+
+Line_node *node_merge(Line_node *a, Line_node *b)
+{
+	if (a == NULL) return b;
+	if (b == NULL) return a;
+	if (a->priority > b->priority)
+	{
+		a->right = node_merge(a->right, b);
+		node_update(a);
+		return a;
+	}
+	b->left = node_merge(a, b->left);
+	node_update(b);
+	return b;
+}
+
+// Split a subtree into its first count lines (a) and the rest (b)
+void node_split(Line_node *node, int count, Line_node **a, Line_node **b)
+{
+	if (node == NULL)
+	{
+		*a = NULL;
+		*b = NULL;
+		return;
+	}
+	if (node_count(node->left) < count)
+	{
+		node_split(node->right, count - node_count(node->left) - 1, &node->right, b);
+		node_update(node);
+		*a = node;
+	}
+	else
+	{
+		node_split(node->left, count, a, &node->left);
+		node_update(node);
+		*b = node;
+	}
+}
+
+void node_refresh(Line_node *node, bool measure)
+{
+	if (node == NULL) return;
+	node_refresh(node->left, measure);
+	node_refresh(node->right, measure);
+	if (measure)
+		node->width = line_width(node->line);
+	node->rows = wrapped_rows(node->width);
+	node_update(node);
+}
+
+void node_free(Line_node *node)
+{
+	if (node == NULL) return;
+	node_free(node->left);
+	node_free(node->right);
+	node->line->node = NULL;
+	free(node);
+}
+
+Line_node *new_node(Line *line)
+{
+	Line_node *node = (Line_node *) counted_malloc(sizeof(Line_node));
+	node->line = line;
+	node->left = NULL;
+	node->right = NULL;
+	node->parent = NULL;
+	node->priority = rand();
+	node->width = line_width(line);
+	node->rows = wrapped_rows(node->width);
+	node->count = 1;
+	node->total_rows = node->rows;
+	line->node = node;
+	return node;
+}
+
+// Build the line index for a buffer in one pass down the line list
+void build_index(buffer *b)
+{
+	b->index = build_nodes(b->first_line, NULL);
+	b->index_width = windowx - b->margin_left;
+}
+
+// Build a tree over the lines from first up to and including last (or the end of the list)
+Line_node *build_nodes(Line *first, Line *last)
+{
+	int size = 64;
+	int top = -1;
+	Line_node **stack = (Line_node **) malloc(sizeof(Line_node *) * size);
+
+	for (Line *line = first; line != NULL; line = line == last ? NULL : line->next)
+	{
+		Line_node *node = new_node(line);
+		Line_node *last = NULL;
+
+		// Keep the right spine of the tree on a stack, ordered by priority
+		while (top >= 0 && stack[top]->priority < node->priority)
+			last = stack[top--];
+		node->left = last;
+		if (top >= 0)
+			stack[top]->right = node;
+
+		if (top + 1 == size)
+		{
+			size *= 2;
+			stack = (Line_node **) realloc(stack, sizeof(Line_node *) * size);
+		}
+		stack[++top] = node;
+	}
+
+	Line_node *root = top >= 0 ? stack[0] : NULL;
+	free(stack);
+
+	// Widths have already been measured by new_node
+	node_refresh(root, false);
+	if (root != NULL)
+		root->parent = NULL;
+	return root;
+}
+
+void free_index(buffer *b)
+{
+	node_free(b->index);
+	b->index = NULL;
+}
+
+// Make sure the current buffer has a line index with row counts for the current screen width
+void check_index()
+{
+	if (current_buffer->index == NULL)
+		build_index(current_buffer);
+	else if (current_buffer->index_width != windowx - current_buffer->margin_left)
+	{
+		// Re-wrap from the cached display widths without rescanning any text
+		node_refresh(current_buffer->index, false);
+		current_buffer->index_width = windowx - current_buffer->margin_left;
+	}
+}
+
+// Add a line which has just been linked into the current buffer to the index
+void index_insert(Line *line)
+{
+	index_insert_lines(line, line);
+}
+
+// Add a chain of lines which has just been linked into the current buffer to the index
+void index_insert_lines(Line *first, Line *last)
+{
+	if (last->next == NULL)
+		current_buffer->last_line = last;
+	if (current_buffer->index == NULL) return;
+
+	int position = first->prev ? index_of(first->prev) + 1 : 0;
+	Line_node *a;
+	Line_node *b;
+	node_split(current_buffer->index, position, &a, &b);
+	current_buffer->index = node_merge(node_merge(a, build_nodes(first, last)), b);
+	current_buffer->index->parent = NULL;
+}
+
+// Remove a line from the current buffer's index
+void index_remove(Line *line)
+{
+	index_remove_lines(line, 1);
+}
+
+// Remove count lines starting at first from the current buffer's index
+void index_remove_lines(Line *first, int count)
+{
+	// The lines are still linked in, so if they run to the end the line before them becomes the last
+	// Nor can paging out carry on from one of them
+	Line *end = first;
+	for (int i = 1; i < count; i++)
+	{
+		if (end == current_buffer->page_line)
+			current_buffer->page_line = NULL;
+		end = end->next;
+	}
+	if (end == current_buffer->page_line)
+		current_buffer->page_line = NULL;
+	if (end->next == NULL)
+		current_buffer->last_line = first->prev;
+
+	if (first->node == NULL) return;
+
+	Line_node *a;
+	Line_node *b;
+	Line_node *c;
+	node_split(current_buffer->index, index_of(first), &a, &b);
+	node_split(b, count, &b, &c);
+	node_free(b);
+	current_buffer->index = node_merge(a, c);
+	if (current_buffer->index != NULL)
+		current_buffer->index->parent = NULL;
+}
+
+// Re-measure a line after its text has changed
+void index_update(Line *line)
+{
+	Line_node *node = line->node;
+	if (node == NULL) return;
+
+	node->width = cxtodx(line, line->length);
+	node->rows = wrapped_rows(node->width);
+	for (; node != NULL; node = node->parent)
+		node->total_rows = node->rows + node_rows(node->left) + node_rows(node->right);
+}
+
+// Get the last line of a buffer, which is only looked for again after lines have been moved around wholesale
+Line *get_last_line(buffer *b)
+{
+	if (b->last_line == NULL)
+	{
+		Line *line = b->current_line;
+		while (line->next != NULL)
+			line = line->next;
+		b->last_line = line;
+	}
+	return b->last_line;
+}
+
+// Get the position of a line in the current buffer
+int index_of(Line *line)
+{
+	Line_node *node = line->node;
+	int index = node_count(node->left);
+	for (; node->parent != NULL; node = node->parent)
+	{
+		if (node == node->parent->right)
+			index += node_count(node->parent->left) + 1;
+	}
+	return index;
+}
+
+// Get the first screen row of a line in the current buffer
+long row_of(Line *line)
+{
+	Line_node *node = line->node;
+	long row = node_rows(node->left);
+	for (; node->parent != NULL; node = node->parent)
+	{
+		if (node == node->parent->right)
+			row += node_rows(node->parent->left) + node->parent->rows;
+	}
+	return row;
+}
+
+Line *line_at(int index)
+{
+	Line_node *node = current_buffer->index;
+	while (node != NULL)
+	{
+		if (index < node_count(node->left))
+			node = node->left;
+		else if (index == node_count(node->left))
+			return node->line;
+		else
+		{
+			index -= node_count(node->left) + 1;
+			node = node->right;
+		}
+	}
+	return NULL;
+}
+
+// Find the line containing a screen row, and the row within that line
+Line *line_at_row(long row, int *line_row)
+{
+	Line_node *node = current_buffer->index;
+	if (row >= node->total_rows)
+		row = node->total_rows - 1;
+	if (row < 0)
+		row = 0;
+
+	while (node != NULL)
+	{
+		if (row < node_rows(node->left))
+			node = node->left;
+		else if (row < node_rows(node->left) + node->rows)
+		{
+			*line_row = row - node_rows(node->left);
+			return node->line;
+		}
+		else
+		{
+			row -= node_rows(node->left) + node->rows;
+			node = node->right;
+		}
+	}
+	return NULL;
+}
+
 void update_status()
 {
 	char modified_indicator = ' ';
 	if (current_buffer->modified) modified_indicator = '*';
 
-	mvwprintw(statusscr, 0, 0, "%s%c CX%d CY%d OX%d OY%d LL%d %d", current_buffer->filename, modified_indicator, current_buffer->cx, current_buffer->cy, current_buffer->offsetx, current_buffer->offsety, current_buffer->current_line->length, ch);
+	// Resident memory is one read of statm, cheap enough for every frame unlike walking the heap
+	if (o_perf_hud)
+		mvwprintw(statusscr, 0, 0, "%s%c draw %lldus key %lldus allocs %ld (%ldB) mem %ldK", current_buffer->filename, modified_indicator, perf_draw_us, perf_key_us, perf_frame_allocs, perf_frame_bytes, resident_memory() / 1024);
+	else
+		mvwprintw(statusscr, 0, 0, "%s%c CX%d CY%d OX%d OY%d LL%d W%ld %d", current_buffer->filename, modified_indicator, current_buffer->cx, current_buffer->cy, current_buffer->offsetx, current_buffer->offsety, current_buffer->current_line->length, current_buffer->words, ch);
 	wclrtoeol(statusscr);
 
 	if (message_timer > 0)
 	{
 		message_timer--;
-		mvwprintw(statusscr, 0, 30, "%s", message_buffer->first_line->text);
+		mvwprintw(statusscr, 0, 30, "%s", message_ring[message_head]);
 	}
 
 	wrefresh(statusscr);
@@ -705,7 +1626,8 @@ void update_status()
 
 void message(char *msg)
 {
-	message_buffer->first_line = insert_line(NULL, message_buffer->first_line, msg, strlen(msg) + 1);
+	message_head = (message_head + 1) % MESSAGE_HISTORY;
+	snprintf(message_ring[message_head], MAX_MESSAGE_LENGTH, "%s", msg);
 	message_timer = o_messagecooldown;
 	return;
 }
@@ -718,6 +1640,9 @@ void toggle_linenumbers()
 
 void draw_screen()
 {
+	// A buffer opened lazily is read in when it is first shown
+	if (!current_buffer->loaded)
+		load_buffer(current_buffer);
 	werase(textscr);
 
 	// Calculate current_buffer->margin_left
@@ -733,13 +1658,17 @@ void draw_screen()
 		current_buffer->margin_left = 0;
 	}
 
-	int y = 0;
+	if (o_soft_wrap)
+		scroll_wrapped();
+
+	int y = o_soft_wrap ? -current_buffer->top_row : 0;
+	int line_y = current_buffer->offsety;
 	Line *line = current_buffer->first_screen_line;
 	while (y < windowy && line != NULL)
 	{
-		draw_line(y, line);
+		y += draw_line(y, line_y, line);
 		line = line->next;
-		y++;
+		line_y++;
 	}
 
 	return;
@@ -747,27 +1676,50 @@ void draw_screen()
 
 void refresh_screen()
 {
+	// A macro being played is only drawn once it has finished
+	if (headless || macro_pos >= 0)
+		return;
+
 	draw_screen();
 	// wmove(stdscr, current_buffer->cy, current_buffer->cx - current_buffer->offsetx + current_buffer->margin_left); // Move cursor to position
-	wmove(stdscr, current_buffer->cy, display_cx); // Move cursor to position
+	wmove(stdscr, display_cy, display_cx); // Move cursor to position
 	wrefresh(textscr);
 	update_status();
 	return;
 }
 
-void draw_line(int y, Line *line)
+// Draw a line from screen row y, which is negative when the top of a wrapped line is scrolled off
+// Returns the number of screen rows used
+int draw_line(int y, int line_y, Line *line)
 {
+	if (table_line(current_buffer, line))
+		return draw_table_line(y, line_y, line);
+
+	int width = windowx - current_buffer->margin_left;
+	int row = y;
+
 	// Draw line number
-	if (o_show_linenumbers)
+	if (o_show_linenumbers && y >= 0)
 	{
 		wmove(textscr, y, 0);
-		mvwprintw(textscr, y, 0, "%d", y + current_buffer->offsety + 1);
+		mvwprintw(textscr, y, 0, "%d", line_y + 1);
 	}
 
-	wmove(textscr, y, current_buffer->margin_left);
-	int x = 0;
+	if (row >= 0)
+		wmove(textscr, row, current_buffer->margin_left);
+	int x = o_soft_wrap ? 0 : current_buffer->offsetx;
 	int dx = 0;
 
+	// Skip straight to the first visible row of a wrapped line
+	if (o_soft_wrap && y < 0)
+	{
+		x = dxtocx(line, -y * width);
+		while (x > 0 && cxtodx(line, x) > -y * width)
+			x--;
+		dx = cxtodx(line, x);
+		row = dx > 0 ? y + (dx - 1) / width : y;
+	}
+
 	bool active_selection = false;
 	if (current_buffer->select_mark.line != NULL)
 		active_selection = true;
@@ -776,56 +1728,248 @@ void draw_line(int y, Line *line)
 	Select_mark select_end;
 	get_select_extents(current_buffer, &select_start, &select_end);
 
-	while ((x + current_buffer->offsetx < line->length) && x < windowx - current_buffer->margin_left)
+	// A block selection covers the same display columns on each of its lines
+	bool block = active_selection && current_buffer->block_select;
+	int block_left = 0;
+	int block_right = 0;
+	int column = 0;
+	if (block)
+	{
+		int mark_dx = cxtodx(current_buffer->select_mark.line, current_buffer->select_mark.x);
+		int cursor_dx = cxtodx(current_buffer->current_line, current_buffer->cx);
+		block_left = mark_dx < cursor_dx ? mark_dx : cursor_dx;
+		block_right = mark_dx < cursor_dx ? cursor_dx : mark_dx;
+		column = cxtodx(line, x);
+	}
+
+	// The other cursors on this line, in order, skipping any scrolled off to the left
+	Cursor *cursors = current_buffer->cursors;
+	int cursor = current_buffer->cursor_count > 0 ? cursor_at(current_buffer, line_y) : 0;
+	while (cursor < current_buffer->cursor_count && cursors[cursor].y == line_y && cursors[cursor].x < x)
+		cursor++;
+
+	// Lex the line as far as the bottom right of the screen
+	Syntax *syntax = current_buffer->syntax;
+	if (syntax != NULL)
+	{
+		int limit = line->length;
+		if (o_soft_wrap && limit > (windowy - y) * width)
+			limit = (windowy - y) * width;
+		else if (!o_soft_wrap && limit > current_buffer->offsetx + windowx)
+			limit = current_buffer->offsetx + windowx;
+		if (limit > hl_buffer_size)
+		{
+			hl_buffer_size = limit;
+			hl_buffer = (unsigned char *)realloc(hl_buffer, sizeof(unsigned char) * hl_buffer_size);
+		}
+		syntax_lex(syntax, line, syntax_start_state(line), hl_buffer, limit);
+	}
+
+	while (x < line->length && row < windowy && (o_soft_wrap || x - current_buffer->offsetx < width))
 	{
-		if (active_selection && (
-								(y + current_buffer->offsety > select_start.y && y + current_buffer->offsety < select_end.y) ||
-								(select_start.y == select_end.y && y + current_buffer->offsety == select_start.y && (x + current_buffer->offsetx >= select_start.x && x + current_buffer->offsetx < select_end.x)) ||
-								(y + current_buffer->offsety == select_start.y && y + current_buffer->offsety < select_end.y && x + current_buffer->offsetx >= select_start.x) ||
-								(y + current_buffer->offsety == select_end.y && y + current_buffer->offsety > select_start.y && x + current_buffer->offsetx < select_end.x)
-								))
-			wattron(textscr, COLOR_PAIR(COL_BLACKWHITE));
+		if (cursor < current_buffer->cursor_count && cursors[cursor].y == line_y && cursors[cursor].x == x)
+		{
+			wattrset(textscr, A_REVERSE);
+			cursor++;
+		}
+		else if (block && line_y >= select_start.y && line_y <= select_end.y && column >= block_left && column < block_right)
+			wattrset(textscr, COLOR_PAIR(COL_BLACKWHITE));
+		else if (!block && active_selection && selected(&select_start, &select_end, line_y, x))
+			wattrset(textscr, COLOR_PAIR(COL_BLACKWHITE));
+		else if (syntax != NULL)
+			wattrset(textscr, COLOR_PAIR(hl_colours[hl_buffer[x]]));
 		else
-			wattroff(textscr, COLOR_PAIR(COL_BLACKWHITE));
+			wattrset(textscr, A_NORMAL);
 		// Turn off inversion if on cursor
-		// if ((current_buffer->cx == x + current_buffer->offsetx) && (current_buffer->cy == y + current_buffer->offsety))
+		// if ((current_buffer->cx == x) && (current_buffer->cy == y + current_buffer->offsety))
 		// 	wattroff(textscr, COLOR_PAIR(COL_BLACKWHITE));
 
-		// if (isdigit(line->text[x + current_buffer->offsetx]))
-		// {
-		// 	wattron(textscr, COLOR_PAIR(2));
-		// 	waddch(textscr, line->text[x + current_buffer->offsetx]);
-		// 	wattroff(textscr, COLOR_PAIR(2));
-		// 	dx++;
-		// }
-		if (line->text[x + current_buffer->offsetx] == '\t')
+		char c = line_char(line, x);
+		int cells = 1;
+		if (c == '\t')
+			cells = o_tabsize - (o_soft_wrap ? dx : dx + current_buffer->offsetx) % o_tabsize;
+
+		for (int i = 0; i < cells; i++)
+		{
+			// Continue on the next screen row when wrapping
+			if (o_soft_wrap && dx > 0 && dx % width == 0)
+			{
+				row++;
+				if (row >= windowy)
+					break;
+				if (row >= 0)
+					wmove(textscr, row, current_buffer->margin_left);
+			}
+			if (row >= 0)
+				waddch(textscr, c == '\t' ? ' ' : c);
+			dx++;
+		}
+		column += cells;
+		x++;
+	}
+
+	// A cursor at the end of the line is shown on the space after it
+	if (cursor < current_buffer->cursor_count && cursors[cursor].y == line_y && cursors[cursor].x == line->length &&
+		x == line->length && row >= 0 && row < windowy && (o_soft_wrap || x - current_buffer->offsetx < width))
+	{
+		wattrset(textscr, A_REVERSE);
+		waddch(textscr, ' ');
+	}
+	wattrset(textscr, A_NORMAL);
+	if (row >= 0 && row < windowy)
+		wclrtoeol(textscr);
+
+	if (line == current_buffer->current_line)
+	{
+		if (o_soft_wrap)
 		{
-			int tabcount = o_tabsize - (dx + current_buffer->offsetx) % o_tabsize;
-			for (int i = 0; i < tabcount; i++) waddch(textscr, ' ');
-			dx += tabcount;
+			int cursor_row = cursor_wrapped_row();
+			display_cy = y + cursor_row;
+			display_cx = cxtodx(line, current_buffer->cx) - cursor_row * width + current_buffer->margin_left;
+			if (display_cx >= windowx)
+				display_cx = windowx - 1;
 		}
 		else
 		{
-			waddch(textscr, line->text[x + current_buffer->offsetx]);
-			dx++;
+			display_cy = y;
+			display_cx = cxtodx(line, current_buffer->cx) - current_buffer->offsetx + current_buffer->margin_left;
 		}
-		x++;
 	}
+
+	return row - y + 1;
+}
+
+// Whether a position is inside the (linear) selection between start and end
+bool selected(Select_mark *start, Select_mark *end, int line_y, int x)
+{
+	return (line_y > start->y && line_y < end->y) ||
+		(start->y == end->y && line_y == start->y && (x >= start->x && x < end->x)) ||
+		(line_y == start->y && line_y < end->y && x >= start->x) ||
+		(line_y == end->y && line_y > start->y && x < end->x);
+}
+
+// Draw a delimited line in aligned columns, each field padded to the width of its column.
+// A field wider than its column (before the scan has got to it) pushes the rest of the line along
+int draw_table_line(int y, int line_y, Line *line)
+{
+	Table *t = current_buffer->table;
+	int left = current_buffer->offsetx;
+	int right = left + windowx - current_buffer->margin_left;
+
+	if (o_show_linenumbers)
+		mvwprintw(textscr, y, 0, "%d", line_y + 1);
+	wmove(textscr, y, current_buffer->margin_left);
+
+	bool active_selection = current_buffer->select_mark.line != NULL;
+	Select_mark select_start;
+	Select_mark select_end;
+	get_select_extents(current_buffer, &select_start, &select_end);
+	bool block = active_selection && current_buffer->block_select;
+	int block_left = 0;
+	int block_right = 0;
+	if (block)
+	{
+		int mark_dx = cxtodx(current_buffer->select_mark.line, current_buffer->select_mark.x);
+		int cursor_dx = cxtodx(current_buffer->current_line, current_buffer->cx);
+		block_left = mark_dx < cursor_dx ? mark_dx : cursor_dx;
+		block_right = mark_dx < cursor_dx ? cursor_dx : mark_dx;
+	}
+	Cursor *cursors = current_buffer->cursors;
+	int cursor = current_buffer->cursor_count > 0 ? cursor_at(current_buffer, line_y) : 0;
+
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	char *text = LINE_TEXT(line);
+	int column = 0;
+	int x = 0;
+	for (int k = 0; column < right; k++)
+	{
+		int end = field_end(text, line->length, x, t->delimiter);
+		int width = k < t->shown.count && t->shown.widths[k] > end - x ? t->shown.widths[k] : end - x;
+		int field_start = column;
+
+		// The field's text, its padding and a space, the delimiter (shown as a bar), then another space.
+		// The last field has no delimiter, just a space for a cursor at the end of the line
+		for (int i = x; i <= end + 1 && column < right; i++)
+		{
+			int x_at = i <= end ? i : -1;
+			while (cursor < current_buffer->cursor_count && cursors[cursor].y == line_y && cursors[cursor].x < x_at)
+				cursor++;
+
+			int cells = 1;
+			char c = ' ';
+			int attr = A_NORMAL;
+			if (i < end)
+				c = text[i] == '\t' ? ' ' : text[i];
+			else if (i == end && end < line->length)
+			{
+				cells = field_start + width - column + 2;
+				attr = COLOR_PAIR(COL_CYANBLACK);
+				c = '|';
+			}
+			else if (end >= line->length && (i > end || cursor >= current_buffer->cursor_count ||
+				cursors[cursor].y != line_y || cursors[cursor].x != end))
+				break;
+
+			if (x_at >= 0 && cursor < current_buffer->cursor_count && cursors[cursor].y == line_y && cursors[cursor].x == x_at)
+				attr = A_REVERSE;
+			else if (x_at >= 0 && block && line_y >= select_start.y && line_y <= select_end.y && column + cells - 1 >= block_left && column + cells - 1 < block_right)
+				attr = COLOR_PAIR(COL_BLACKWHITE);
+			else if (x_at >= 0 && !block && active_selection && selected(&select_start, &select_end, line_y, x_at))
+				attr = COLOR_PAIR(COL_BLACKWHITE);
+
+			// Padding comes before the delimiter, so only the last cell of it gets the delimiter
+			for (int cell = 0; cell < cells; cell++)
+			{
+				if (column >= left && column < right)
+				{
+					wattrset(textscr, cell == cells - 1 ? attr : (int) A_NORMAL);
+					waddch(textscr, cell == cells - 1 ? c : ' ');
+				}
+				column++;
+			}
+		}
+		if (end >= line->length)
+			break;
+		x = end + 1;
+	}
+	wattrset(textscr, A_NORMAL);
 	wclrtoeol(textscr);
 
 	if (line == current_buffer->current_line)
+	{
+		display_cy = y;
 		display_cx = cxtodx(line, current_buffer->cx) - current_buffer->offsetx + current_buffer->margin_left;
-
-	return;
+	}
+	return 1;
 }
 
 // Convert current position in line to corresponding display position on screen
 int cxtodx(Line *line, int cx)
 {
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	if (table_line(current_buffer, line))
+		return table_cxtodx(current_buffer->table, line, cx);
 	int dx = 0;
+	char *text = LINE_TEXT(line);
+
+	// For long lines, start from the segment containing cx using the width of the text before it
+	if (line->storage == TEXT_SEGMENTS)
+	{
+		int offset;
+		Span before;
+		if (cx >= line->length)
+			return span_width(line->long_text->tree[1], 0);
+		int i = find_segment(line->long_text, cx, &offset, &before);
+		dx = span_width(before, 0);
+		text = line->long_text->segments[i].text;
+		cx = offset;
+	}
+
 	for (int c = 0; c < cx; c++)
 	{
-		if (line->text[c] == '\t') dx += o_tabsize - c % o_tabsize;
+		if (text[c] == '\t') dx += o_tabsize - dx % o_tabsize;
 		else dx += 1;
 	}
 	return dx;
@@ -834,17 +1978,250 @@ int cxtodx(Line *line, int cx)
 // Convert current display position to corresponding position in line
 int dxtocx(Line *line, int dx)
 {
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	if (table_line(current_buffer, line))
+		return table_dxtocx(current_buffer->table, line, dx);
 	int cx = 0;
 	int c = 0;
-	while (c < dx)
+	int start = 0;
+	int length = line->length;
+	char *text = LINE_TEXT(line);
+
+	// For long lines, descend the tree to the segment where the display position is reached
+	if (line->storage == TEXT_SEGMENTS)
+	{
+		Long_text *t = line->long_text;
+		Span before = { 0 };
+		int k = 1;
+		while (k < t->size)
+		{
+			Span left = join_spans(before, t->tree[2 * k]);
+			if (span_width(left, 0) >= dx)
+				k = 2 * k;
+			else
+			{
+				before = left;
+				k = 2 * k + 1;
+			}
+		}
+		if (k - t->size >= t->count)
+			return line->length;
+		start = before.bytes;
+		c = span_width(before, 0);
+		text = t->segments[k - t->size].text;
+		length = t->segments[k - t->size].length;
+	}
+
+	while (c < dx && cx < length)
 	{
-		if (line->text[c] == '\t')
+		if (text[cx] == '\t')
 			c += o_tabsize - c % o_tabsize;
 		else
 			c += 1;
 		cx++;
 	}
-	return cx;
+	return start + cx;
+}
+
+// Choose the syntax definition for a buffer from its filename
+void select_syntax(buffer *b)
+{
+	b->syntax = NULL;
+	char *extension = strrchr(b->filename, '.');
+	if (extension != NULL)
+	{
+		for (Syntax *syntax = syntax_table; syntax->name != NULL && b->syntax == NULL; syntax++)
+		{
+			for (char **match = syntax->filematch; *match != NULL; match++)
+			{
+				if (strcmp(extension, *match) == 0)
+				{
+					b->syntax = syntax;
+					break;
+				}
+			}
+		}
+	}
+
+	// Cached lexer states are for the old syntax
+	for (Line *line = b->first_line; line != NULL; line = line->next)
+		line->hl_valid = false;
+}
+
+bool is_separator(char c)
+{
+	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];:{}&|!?^\"'`", c) != NULL;
+}
+
+// Check whether text of the given length starts with prefix (which may be NULL)
+bool starts_with(char *text, int length, char *prefix)
+{
+	if (prefix == NULL)
+		return false;
+	int prefix_length = strlen(prefix);
+	return prefix_length <= length && strncmp(text, prefix, prefix_length) == 0;
+}
+
+// Lex a line from the given start state, filling hl (if not NULL) with highlight types up to limit
+// Returns the lexer state at limit, which is the end of line state when limit is the line length
+int syntax_lex(Syntax *syntax, Line *line, int state, unsigned char *hl, int limit)
+{
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	char *text = LINE_TEXT(line);
+	int length = line->length;
+	bool separator = true;
+	int i = 0;
+
+	// Lines held in segments are too long to lex on every draw, so are left plain
+	if (line->storage == TEXT_SEGMENTS)
+	{
+		if (hl != NULL)
+			memset(hl, HL_NORMAL, limit);
+		return state;
+	}
+
+	while (i < limit)
+	{
+		int type = HL_NORMAL;
+		int n = 1; // Length of the token
+
+		if (state == HLS_COMMENT)
+		{
+			type = HL_COMMENT;
+			if (starts_with(text + i, length - i, syntax->block_comment_end))
+			{
+				n = strlen(syntax->block_comment_end);
+				state = HLS_NORMAL;
+			}
+		}
+		else if (state != HLS_NORMAL) // Inside a string
+		{
+			type = HL_STRING;
+			if (text[i] == '\\' && i + 1 < length)
+				n = 2;
+			else if (text[i] == state)
+				state = HLS_NORMAL;
+		}
+		else if (separator && starts_with(text + i, length - i, syntax->line_comment))
+		{
+			type = HL_COMMENT;
+			n = length - i;
+		}
+		else if (starts_with(text + i, length - i, syntax->block_comment_start))
+		{
+			type = HL_COMMENT;
+			n = strlen(syntax->block_comment_start);
+			state = HLS_COMMENT;
+		}
+		else if ((syntax->flags & HL_HIGHLIGHT_STRINGS) && strchr(syntax->quotes, text[i]) != NULL)
+		{
+			type = HL_STRING;
+			state = (unsigned char)text[i];
+		}
+		else if ((syntax->flags & HL_HIGHLIGHT_NUMBERS) && separator && isdigit(text[i]))
+		{
+			type = HL_NUMBER;
+			while (i + n < length && (isalnum(text[i + n]) || text[i + n] == '.')) n++;
+		}
+		else if ((syntax->flags & HL_HIGHLIGHT_VARIABLES) && text[i] == '$')
+		{
+			type = HL_VARIABLE;
+			if (i + 1 < length && text[i + 1] == '{')
+				while (i + n < length && text[i + n - 1] != '}') n++;
+			else
+				while (i + n < length && (isalnum(text[i + n]) || text[i + n] == '_')) n++;
+		}
+		else if (separator)
+		{
+			for (Keyword *k = syntax->keywords; k->word != NULL; k++)
+			{
+				int word_length = strlen(k->word);
+				if (i + word_length <= length && strncmp(text + i, k->word, word_length) == 0 &&
+					(i + word_length == length || is_separator(text[i + word_length])))
+				{
+					type = k->type;
+					n = word_length;
+					break;
+				}
+			}
+		}
+
+		if (hl != NULL)
+			memset(hl + i, type, (i + n > limit ? limit - i : n));
+		separator = is_separator(text[i + n - 1]);
+		i += n;
+	}
+
+	// Only some languages allow strings to run on to the next line
+	if (limit >= length && state != HLS_COMMENT && !(syntax->flags & HL_MULTILINE_STRINGS))
+		state = HLS_NORMAL;
+
+	return state;
+}
+
+// Get the lexer state at the start of a line, lexing forward from the last line with a known state
+int syntax_start_state(Line *line)
+{
+	Line *l = line->prev;
+	while (l != NULL && !l->hl_valid)
+		l = l->prev;
+
+	int state = HLS_NORMAL;
+	if (l == NULL)
+		l = current_buffer->first_line;
+	else
+	{
+		state = l->hl_state;
+		l = l->next;
+	}
+
+	while (l != line)
+	{
+		state = syntax_lex(current_buffer->syntax, l, state, NULL, l->length);
+		l->hl_state = state;
+		l->hl_valid = true;
+		l = l->next;
+	}
+
+	return state;
+}
+
+// Re-lex from a changed line until the end of line state converges with the cached one
+void update_syntax(Line *line)
+{
+	if (current_buffer->syntax == NULL)
+		return;
+
+	// Lines after one with an unknown state are lexed lazily when drawn
+	if (line->prev != NULL && !line->prev->hl_valid)
+	{
+		line->hl_valid = false;
+		return;
+	}
+
+	while (line != NULL)
+	{
+		int old_state = line->hl_state;
+		bool was_valid = line->hl_valid;
+		line->hl_state = syntax_lex(current_buffer->syntax, line, line->prev ? line->prev->hl_state : HLS_NORMAL, NULL, line->length);
+		line->hl_valid = true;
+		if (was_valid && line->hl_state == old_state)
+			return;
+
+		line = line->next;
+		if (line != NULL && !line->hl_valid)
+			return;
+	}
+}
+
+// Update anything cached against a line after its text has changed
+void line_changed(Line *line)
+{
+	update_syntax(line);
+	index_update(line);
+	update_stats(current_buffer, line);
 }
 
 bool get_input(char *prompt, char *placeholder, char *response, size_t max_length)
@@ -856,13 +2233,16 @@ bool get_input(char *prompt, char *placeholder, char *response, size_t max_lengt
 
 	while (1)
 	{
-		mvwprintw(commandscr, 0, 0, "%s", prompt);
-		wprintw(commandscr, "%s", response);
-		wclrtoeol(commandscr);
-		wmove(commandscr, 0, icx + strlen(prompt));
-		wrefresh(commandscr);
+		if (macro_pos < 0)
+		{
+			mvwprintw(commandscr, 0, 0, "%s", prompt);
+			wprintw(commandscr, "%s", response);
+			wclrtoeol(commandscr);
+			wmove(commandscr, 0, icx + strlen(prompt));
+			wrefresh(commandscr);
+		}
 
-		int c = getch();
+		int c = read_key();
 		switch (c)
 		{
 			case KEY_RIGHT:
@@ -877,6 +2257,7 @@ bool get_input(char *prompt, char *placeholder, char *response, size_t max_lengt
 			case KEY_HOME:
 				icx = 0;
 				break;
+			case ERR: // No more keys when replaying a trace
 			case 27: // ESCAPE
 				werase(commandscr);
 				wrefresh(commandscr);
@@ -916,119 +2297,685 @@ void insert_char(Line *line, int pos, char c)
 
 void insert_string(Line *line, int pos, char *src, int length)
 {
-	allocate_string(line, line->length + length);
-	memmove(line->text + pos + length, line->text + pos, line->length - pos);
-	memcpy(line->text + pos, src, length);
-	line->length += length;
+	text_insert(line, pos, src, length);
+	line_changed(line);
 	return;
 }
 
-void allocate_string(Line *line, int length)
+void delete_string(Line *line, int pos, int length)
 {
-	char *new_ptr = (char *)realloc(line->text, sizeof(char) * length);
-	line->text = new_ptr;
+	text_delete(line, pos, length);
+	line_changed(line);
 	return;
 }
 
-Line *insert_line(Line *prev, Line *next, char *src, size_t length)
+// Make room for length bytes of a line held in one piece, moving the text between the line itself and the heap
+void allocate_string(Line *line, int length)
 {
-	Line *line = (Line *) malloc(sizeof(Line));
-	line->text = NULL;
-	allocate_string(line, length);
-	line->length = length;
-	memcpy(line->text, src, length);
-
-	line->prev = prev;
-	line->next = next;
-	if (prev != NULL)
-		prev->next = line;
-	if (next != NULL)
-		next->prev = line;
-	return line;
+	if (length <= SHORT_LINE_LENGTH)
+	{
+		if (line->storage == TEXT_HEAP)
+		{
+			char *text = line->text;
+			memcpy(line->short_text, text, length);
+			free(text);
+			line->storage = TEXT_INLINE;
+		}
+		return;
+	}
+	if (line->storage == TEXT_INLINE)
+	{
+		char *text = (char *)counted_malloc(sizeof(char) * length);
+		memcpy(text, line->short_text, line->length);
+		line->text = text;
+		line->refs = NULL;
+		line->storage = TEXT_HEAP;
+		return;
+	}
+	char *new_ptr = (char *)counted_realloc(line->text, sizeof(char) * length);
+	line->text = new_ptr;
+	return;
 }
 
-void enter()
+// Get the character at a position in a line (or 0 if beyond the end)
+char line_char(Line *line, int pos)
 {
-	insert_line(current_buffer->current_line, current_buffer->current_line->next, current_buffer->current_line->text + current_buffer->cx, current_buffer->current_line->length - current_buffer->cx);
-	// Increment select mark row if it is after the new row inserted
-	if (current_buffer->select_mark.y > current_buffer->cy)
-		current_buffer->select_mark.y++;
-	current_buffer->lines++;
-	current_buffer->current_line->length = current_buffer->cx;
-	allocate_string(current_buffer->current_line, current_buffer->current_line->length + 1);
-
-	move_lines_down(1);
-	move_home();
-
-	return;
+	if (pos < 0 || pos >= line->length)
+		return 0;
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	if (line->storage != TEXT_SEGMENTS)
+		return LINE_TEXT(line)[pos];
+
+	int offset;
+	Span before;
+	int i = find_segment(line->long_text, pos, &offset, &before);
+	return line->long_text->segments[i].text[offset];
 }
 
-void backspace()
+// Get a pointer to the text at a position in a line, and how many bytes run on contiguously from there
+char *line_chunk(Line *line, int pos, int *length)
 {
-	if (current_buffer->cx > 0)
-	{
-		memmove(current_buffer->current_line->text + current_buffer->cx - 1, current_buffer->current_line->text + current_buffer->cx, current_buffer->current_line->length - current_buffer->cx + 1);
-		current_buffer->current_line->length--;
-		allocate_string(current_buffer->current_line, current_buffer->current_line->length);
-		current_buffer->cx--;
-		check_boundx();
-	}
-	else if (current_buffer->current_line != current_buffer->first_line)
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	if (line->storage != TEXT_SEGMENTS)
 	{
-		move_lines_up(1);
-		move_end();
-		insert_string(current_buffer->current_line, current_buffer->current_line->length, current_buffer->current_line->next->text, current_buffer->current_line->next->length);
-		delete_line(current_buffer->current_line->next);
+		*length = line->length - pos;
+		return LINE_TEXT(line) + pos;
 	}
-	return;
+
+	int offset;
+	Span before;
+	int i = find_segment(line->long_text, pos, &offset, &before);
+	*length = line->long_text->segments[i].length - offset;
+	return line->long_text->segments[i].text + offset;
 }
 
-void delete()
+// Insert text into a line without updating anything cached against it
+void text_insert(Line *line, int pos, char *src, int length)
 {
-	if (current_buffer->cx < current_buffer->current_line->length)
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	line->page_fd = -1; // The copy in the file no longer matches
+	unshare_text(line);
+	long held = held_text(line);
+	if (line->storage != TEXT_SEGMENTS)
 	{
-		memmove(current_buffer->current_line->text + current_buffer->cx, current_buffer->current_line->text + current_buffer->cx + 1, current_buffer->current_line->length - current_buffer->cx + 1);
-		current_buffer->current_line->length--;
-		allocate_string(current_buffer->current_line, current_buffer->current_line->length);
+		allocate_string(line, line->length + length);
+		char *text = LINE_TEXT(line);
+		memmove(text + pos + length, text + pos, line->length - pos);
+		memcpy(text + pos, src, length);
+		line->length += length;
+
+		if (line->length > LONG_LINE_LENGTH)
+		{
+			segment_line(line, text, line->length);
+			free(text);
+		}
+		line_bytes += held_text(line) - held;
+		return;
 	}
-	else if (current_buffer->current_line->next != NULL)
+
+	Long_text *t = line->long_text;
+	int offset;
+	Span before;
+	int i;
+	if (pos >= line->length)
 	{
-		insert_string(current_buffer->current_line, current_buffer->current_line->length, current_buffer->current_line->next->text, current_buffer->current_line->next->length);
-		delete_line(current_buffer->current_line->next);
+		i = t->count - 1;
+		offset = t->segments[i].length;
 	}
-	return;
+	else
+		i = find_segment(t, pos, &offset, &before);
+
+	Segment *segment = &t->segments[i];
+	segment->text = (char *)counted_realloc(segment->text, sizeof(char) * (segment->length + length));
+	memmove(segment->text + offset + length, segment->text + offset, segment->length - offset);
+	memcpy(segment->text + offset, src, length);
+	segment->length += length;
+	line->length += length;
+
+	if (segment->length > MAX_SEGMENT_LENGTH)
+		split_segment(t, i);
+	else
+		update_segment(t, i);
+	line_bytes += length;
 }
 
-void delete_selection()
+// Delete text from a line without updating anything cached against it
+void text_delete(Line *line, int pos, int length)
 {
-	Select_mark select_start;
-	Select_mark select_end;
+	if (length <= 0)
+		return;
 
-	get_select_extents(current_buffer, &select_start, &select_end);
-	// Line *select_end_next_line = select_end.line->next;
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	line->page_fd = -1;
+	unshare_text(line);
+	long held = held_text(line);
+	if (line->storage != TEXT_SEGMENTS)
+	{
+		char *text = LINE_TEXT(line);
+		memmove(text + pos, text + pos + length, line->length - pos - length);
+		line->length -= length;
+		allocate_string(line, line->length);
+		line_bytes += held_text(line) - held;
+		return;
+	}
 
-	goto_line(select_start.y + 1);
-	current_buffer->cx = select_start.x;
-	
-	if (select_start.line == select_end.line)
+	Long_text *t = line->long_text;
+	int offset;
+	Span before;
+	int i = find_segment(t, pos, &offset, &before);
+	int first = i;
+	bool emptied = false;
+
+	line->length -= length;
+	while (length > 0)
 	{
-		memmove(select_start.line->text + select_start.x, select_start.line->text + select_end.x + 1, select_start.line->length - select_end.x);
-		select_start.line->length -= (select_end.x - select_start.x) + 1;
-		allocate_string(select_start.line, select_start.line->length);
+		Segment *segment = &t->segments[i];
+		int n = segment->length - offset;
+		if (n > length)
+			n = length;
+		memmove(segment->text + offset, segment->text + offset + n, segment->length - offset - n);
+		segment->length -= n;
+		length -= n;
+
+		if (segment->length == 0)
+			emptied = true;
+		else
+		{
+			segment->text = (char *)counted_realloc(segment->text, sizeof(char) * segment->length);
+			update_segment(t, i);
+		}
+		offset = 0;
+		i++;
 	}
 
-	else
-	{	
-		while (select_start.line->next != select_end.line)
-			delete_line(select_start.line->next);
-		select_start.line->length = select_start.x;
-		allocate_string(select_start.line, select_start.line->length);
-		if (select_start.line->next->length > 0)
-			insert_string(select_start.line, select_start.line->length, select_start.line->next->text + select_end.x + 1, select_start.line->next->length - select_end.x - 1);
-		delete_line(select_start.line->next);
+	// Drop any segments which are now empty and rebuild the tree once
+	if (emptied)
+	{
+		int count = 0;
+		for (i = 0; i < t->count; i++)
+		{
+			if (t->segments[i].length > 0)
+				t->segments[count++] = t->segments[i];
+			else
+			{
+				drop_segment_words(t, i);
+				free(t->segments[i].text);
+			}
+		}
+		t->count = count;
+		build_segment_tree(t);
+
+		// The segments either side of those dropped now meet
+		if (first < count)
+			mark_words_stale(t, first);
+		else if (count > 0)
+			mark_words_stale(t, count - 1);
 	}
 
-	check_boundx();
+	if (line->length < LONG_LINE_LENGTH / 2)
+		flatten_line(line);
+	line_bytes += held_text(line) - held;
+}
+
+// Replace part of a line with other text without updating anything cached against it, moving the rest of the line once
+void text_replace(Line *line, int pos, int length, char *src, int src_length)
+{
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	if (line->storage == TEXT_SEGMENTS || line->length - length + src_length > LONG_LINE_LENGTH)
+	{
+		text_delete(line, pos, length);
+		text_insert(line, pos, src, src_length);
+		return;
+	}
+
+	line->page_fd = -1;
+	unshare_text(line);
+	long held = held_text(line);
+	int new_length = line->length - length + src_length;
+	if (new_length > line->length)
+		allocate_string(line, new_length);
+	char *text = LINE_TEXT(line);
+	memmove(text + pos + src_length, text + pos + length, line->length - pos - length);
+	memcpy(text + pos, src, src_length);
+	if (new_length < line->length)
+		allocate_string(line, new_length);
+	line->length = new_length;
+	line_bytes += held_text(line) - held;
+}
+
+// Copy part of one line into another without updating anything cached against it
+void text_copy(Line *dest, int dest_pos, Line *source, int pos, int length)
+{
+	// Copying a whole line into an empty one just shares the text, unless it is short enough to be held in the line
+	if (dest->length == 0 && pos == 0 && length == source->length && length > SHORT_LINE_LENGTH && dest != source)
+	{
+		if (source->storage == TEXT_PAGED)
+			page_in(source);
+		free_text(dest);
+		dest->page_fd = -1;
+		if (source->refs == NULL)
+		{
+			source->refs = (int *) counted_malloc(sizeof(int));
+			*source->refs = 1;
+		}
+		(*source->refs)++;
+		dest->refs = source->refs;
+		dest->text = source->text; // Or long_text, which is held in the same place
+		dest->storage = source->storage;
+		dest->length = source->length;
+		line_bytes += dest->length; // Counted for each line sharing it, as each may be paged out on its own
+		return;
+	}
+
+	while (length > 0)
+	{
+		int n;
+		char *chunk = line_chunk(source, pos, &n);
+		if (n > length)
+			n = length;
+		text_insert(dest, dest_pos, chunk, n);
+		dest_pos += n;
+		pos += n;
+		length -= n;
+	}
+}
+
+// Bytes of a line's text held on the heap rather than in the line itself
+long held_text(Line *line)
+{
+	return line->storage >= TEXT_HEAP ? line->length : 0;
+}
+
+// Free a line's text, ready for it to be given new text or freed itself
+void free_text(Line *line)
+{
+	// Words counted through the segments are kept with the line, to be taken out when it is next indexed
+	if (line->word_ids == segment_words && line->storage == TEXT_SEGMENTS)
+	{
+		line->word_ids = collect_segment_words(line->long_text);
+		line->long_text->words_counted--;
+	}
+
+	if (line->storage < TEXT_HEAP)
+	{
+		line->storage = TEXT_INLINE;
+		return;
+	}
+	line_bytes -= line->length;
+
+	// Leave shared text to the lines still using it
+	if (line->refs != NULL)
+	{
+		if (--(*line->refs) > 0)
+		{
+			line->storage = TEXT_INLINE;
+			return;
+		}
+		free(line->refs);
+	}
+
+	if (line->storage == TEXT_SEGMENTS)
+	{
+		for (int i = 0; i < line->long_text->count; i++)
+		{
+			free(line->long_text->segments[i].text);
+			free(line->long_text->segments[i].word_ids);
+		}
+		free(line->long_text->segments);
+		free(line->long_text->tree);
+		free(line->long_text);
+	}
+	else
+		free(line->text);
+	line->storage = TEXT_INLINE;
+}
+
+// Give a line its own copy of text it shares with other lines, before it is changed
+void unshare_text(Line *line)
+{
+	if (line->storage < TEXT_HEAP || line->refs == NULL)
+		return;
+	if (--(*line->refs) == 0)
+	{
+		free(line->refs);
+		line->refs = NULL;
+		return;
+	}
+	line->refs = NULL;
+
+	if (line->storage == TEXT_HEAP)
+	{
+		char *text = line->text;
+		line->text = (char *)counted_malloc(sizeof(char) * line->length);
+		memcpy(line->text, text, line->length);
+		return;
+	}
+
+	Long_text *t = line->long_text;
+	Long_text *copy = (Long_text *) counted_malloc(sizeof(Long_text));
+	*copy = *t;
+	copy->segments = (Segment *) counted_malloc(sizeof(Segment) * t->size);
+	copy->tree = (Span *) counted_malloc(sizeof(Span) * t->size * 2);
+	memcpy(copy->tree, t->tree, sizeof(Span) * t->size * 2);
+	for (int i = 0; i < t->count; i++)
+	{
+		copy->segments[i] = t->segments[i];
+		copy->segments[i].text = (char *) counted_malloc(sizeof(char) * t->segments[i].length);
+		memcpy(copy->segments[i].text, t->segments[i].text, t->segments[i].length);
+		int *ids = t->segments[i].word_ids;
+		if (ids != NULL)
+		{
+			int n = 0;
+			while (ids[n] >= 0)
+				n++;
+			copy->segments[i].word_ids = (int *) counted_malloc(sizeof(int) * (n + 1));
+			memcpy(copy->segments[i].word_ids, ids, sizeof(int) * (n + 1));
+		}
+	}
+
+	// The line's words in the completion index are now counted through its own copy
+	bool counted = line->word_ids == segment_words;
+	t->words_counted -= counted;
+	copy->words_counted = counted;
+	line->long_text = copy;
+}
+
+// Measure the byte count and display width of some text
+Span measure_span(char *text, int length)
+{
+	Span span = { .bytes = length };
+	for (int c = 0; c < length; c++)
+	{
+		if (span.tab)
+		{
+			if (text[c] == '\t') span.rest += o_tabsize - span.rest % o_tabsize;
+			else span.rest += 1;
+		}
+		else if (text[c] == '\t')
+			span.tab = true;
+		else
+			span.pre += 1;
+	}
+
+	// Counts for the line, so that a long line can be recounted from the tree after an edit
+	bool space = true;
+	span.words = count_words(text, length, &space);
+	span.lead = length > 0 && !isspace((unsigned char) text[0]);
+	span.trail = length > 0 && !isspace((unsigned char) text[length - 1]);
+	int c = 0;
+	while (c < length && isspace((unsigned char) text[c]))
+		c++;
+	span.code = c < length;
+	span.comment = c < length && text[c] == '#';
+	return span;
+}
+
+// Combine the spans of two runs of text, a followed by b
+Span join_spans(Span a, Span b)
+{
+	Span span = a;
+	span.bytes = a.bytes + b.bytes;
+	if (!a.tab)
+	{
+		span.tab = b.tab;
+		span.pre = a.pre + b.pre;
+		span.rest = b.rest;
+	}
+	else if (!b.tab)
+		span.rest = a.rest + b.pre;
+	else
+		span.rest = span_width(b, a.rest);
+
+	// A word running on from a into b was counted in both
+	span.words = a.words + b.words - (a.trail && b.lead);
+	span.lead = a.bytes > 0 ? a.lead : b.lead;
+	span.trail = b.bytes > 0 ? b.trail : a.trail;
+	span.code = a.code || b.code;
+	span.comment = a.code ? a.comment : b.comment;
+	return span;
+}
+
+// Get the display position reached after a span which starts at display position dx
+int span_width(Span span, int dx)
+{
+	if (!span.tab)
+		return dx + span.pre;
+	return ((dx + span.pre) / o_tabsize + 1) * o_tabsize + span.rest;
+}
+
+// Hold a line's text in segments
+void segment_line(Line *line, char *src, int length)
+{
+	Long_text *t = (Long_text *) counted_malloc(sizeof(Long_text));
+	t->count = 0;
+	t->size = 0;
+	t->segments = NULL;
+	t->tree = NULL;
+	t->words_counted = 0;
+	t->words_stale = true;
+	reserve_segments(t, (length + SEGMENT_LENGTH - 1) / SEGMENT_LENGTH);
+
+	t->count = (length + SEGMENT_LENGTH - 1) / SEGMENT_LENGTH;
+	for (int i = 0; i < t->count; i++)
+	{
+		Segment *segment = &t->segments[i];
+		segment->length = length - i * SEGMENT_LENGTH < SEGMENT_LENGTH ? length - i * SEGMENT_LENGTH : SEGMENT_LENGTH;
+		segment->text = (char *)counted_malloc(sizeof(char) * segment->length);
+		memcpy(segment->text, src + i * SEGMENT_LENGTH, segment->length);
+		segment->span = measure_span(segment->text, segment->length);
+		segment->word_ids = NULL;
+		segment->words_stale = true;
+	}
+	build_segment_tree(t);
+
+	line->long_text = t;
+	line->refs = NULL;
+	line->storage = TEXT_SEGMENTS;
+	line->length = length;
+}
+
+// Go back to holding a line's text in one string
+void flatten_line(Line *line)
+{
+	Long_text *t = line->long_text;
+	char *text = (char *)counted_malloc(sizeof(char) * line->length);
+	int pos = 0;
+	for (int i = 0; i < t->count; i++)
+	{
+		memcpy(text + pos, t->segments[i].text, t->segments[i].length);
+		pos += t->segments[i].length;
+	}
+	free_text(line);
+	line_bytes += line->length; // The text is only moved, which the caller counts
+	line->text = text;
+	line->refs = NULL;
+	line->storage = TEXT_HEAP;
+	allocate_string(line, line->length);
+}
+
+// Make room for a number of segments
+void reserve_segments(Long_text *t, int count)
+{
+	if (t->size >= count && t->size > 0)
+		return;
+	if (t->size == 0)
+		t->size = 1;
+	while (t->size < count)
+		t->size *= 2;
+	t->segments = (Segment *) counted_realloc(t->segments, sizeof(Segment) * t->size);
+	t->tree = (Span *) counted_realloc(t->tree, sizeof(Span) * t->size * 2);
+}
+
+// Recalculate the tree from the segment spans
+void build_segment_tree(Long_text *t)
+{
+	Span empty = { 0 };
+	for (int i = 0; i < t->size; i++)
+		t->tree[t->size + i] = i < t->count ? t->segments[i].span : empty;
+	for (int k = t->size - 1; k > 0; k--)
+		t->tree[k] = join_spans(t->tree[2 * k], t->tree[2 * k + 1]);
+}
+
+// Re-measure a segment after its text has changed and update the tree above it
+void update_segment(Long_text *t, int i)
+{
+	t->segments[i].span = measure_span(t->segments[i].text, t->segments[i].length);
+	mark_words_stale(t, i);
+	int k = t->size + i;
+	t->tree[k] = t->segments[i].span;
+	for (k /= 2; k > 0; k /= 2)
+		t->tree[k] = join_spans(t->tree[2 * k], t->tree[2 * k + 1]);
+}
+
+// Break up a segment which has grown too long
+void split_segment(Long_text *t, int i)
+{
+	drop_segment_words(t, i);
+	Segment segment = t->segments[i];
+	int pieces = (segment.length + SEGMENT_LENGTH - 1) / SEGMENT_LENGTH;
+
+	reserve_segments(t, t->count + pieces - 1);
+	memmove(&t->segments[i + pieces], &t->segments[i + 1], sizeof(Segment) * (t->count - i - 1));
+	t->count += pieces - 1;
+
+	for (int p = 0; p < pieces; p++)
+	{
+		Segment *piece = &t->segments[i + p];
+		piece->length = segment.length - p * SEGMENT_LENGTH < SEGMENT_LENGTH ? segment.length - p * SEGMENT_LENGTH : SEGMENT_LENGTH;
+		piece->text = (char *)counted_malloc(sizeof(char) * piece->length);
+		memcpy(piece->text, segment.text + p * SEGMENT_LENGTH, piece->length);
+		piece->span = measure_span(piece->text, piece->length);
+		piece->word_ids = NULL;
+	}
+	free(segment.text);
+	build_segment_tree(t);
+	for (int p = 0; p < pieces; p++)
+		mark_words_stale(t, i + p);
+}
+
+// Find the segment containing a byte position, the offset within it, and the span of all text before it
+int find_segment(Long_text *t, int pos, int *offset, Span *before)
+{
+	Span span = { 0 };
+	int k = 1;
+	while (k < t->size)
+	{
+		if (pos < t->tree[2 * k].bytes)
+			k = 2 * k;
+		else
+		{
+			pos -= t->tree[2 * k].bytes;
+			span = join_spans(span, t->tree[2 * k]);
+			k = 2 * k + 1;
+		}
+	}
+	*offset = pos;
+	*before = span;
+	return k - t->size;
+}
+
+Line *insert_line(Line *prev, Line *next, char *src, size_t length)
+{
+	Line *line = (Line *) counted_malloc(sizeof(Line));
+	line->storage = TEXT_INLINE;
+	line->length = 0;
+	line->hl_state = HLS_NORMAL;
+	line->hl_valid = false;
+	line->words = 0;
+	line->counted_length = 0;
+	line->loc = false;
+	line->word_ids = NULL;
+	line->node = NULL;
+	line->page_fd = -1;
+	line->table_widest = 0;
+	line->page_pos = 0;
+	if (length > LONG_LINE_LENGTH)
+		segment_line(line, src, length);
+	else
+	{
+		allocate_string(line, length);
+		line->length = length;
+		if (length > 0)
+			memcpy(LINE_TEXT(line), src, length);
+	}
+	line_bytes += sizeof(Line) + held_text(line);
+
+	line->prev = prev;
+	line->next = next;
+	if (prev != NULL)
+		prev->next = line;
+	if (next != NULL)
+		next->prev = line;
+	return line;
+}
+
+void enter()
+{
+	Line *line = current_buffer->current_line;
+	text_copy(insert_line(line, line->next, NULL, 0), 0, line, current_buffer->cx, line->length - current_buffer->cx);
+	index_insert(current_buffer->current_line->next);
+	// Increment select mark row if it is after the new row inserted
+	if (current_buffer->select_mark.y > current_buffer->cy)
+		current_buffer->select_mark.y++;
+	current_buffer->lines++;
+	text_delete(line, current_buffer->cx, line->length - current_buffer->cx);
+	line_changed(current_buffer->current_line);
+	line_changed(current_buffer->current_line->next);
+
+	move_lines_down(1);
+	move_home();
+
+	return;
+}
+
+void backspace()
+{
+	if (current_buffer->cx > 0)
+	{
+		delete_string(current_buffer->current_line, current_buffer->cx - 1, 1);
+		current_buffer->cx--;
+		check_boundx();
+	}
+	else if (current_buffer->current_line != current_buffer->first_line)
+	{
+		move_lines_up(1);
+		move_end();
+		text_copy(current_buffer->current_line, current_buffer->current_line->length, current_buffer->current_line->next, 0, current_buffer->current_line->next->length);
+		line_changed(current_buffer->current_line);
+		delete_line(current_buffer->current_line->next);
+	}
+	return;
+}
+
+void delete()
+{
+	if (current_buffer->cx < current_buffer->current_line->length)
+	{
+		delete_string(current_buffer->current_line, current_buffer->cx, 1);
+	}
+	else if (current_buffer->current_line->next != NULL)
+	{
+		text_copy(current_buffer->current_line, current_buffer->current_line->length, current_buffer->current_line->next, 0, current_buffer->current_line->next->length);
+		line_changed(current_buffer->current_line);
+		delete_line(current_buffer->current_line->next);
+	}
+	return;
+}
+
+void delete_selection()
+{
+	Select_mark select_start;
+	Select_mark select_end;
+
+	get_select_extents(current_buffer, &select_start, &select_end);
+	// Line *select_end_next_line = select_end.line->next;
+
+	goto_line(select_start.y + 1);
+	current_buffer->cx = select_start.x;
+	
+	if (select_start.line == select_end.line)
+	{
+		int end = select_end.x < select_start.line->length ? select_end.x + 1 : select_start.line->length;
+		text_delete(select_start.line, select_start.x, end - select_start.x);
+	}
+
+	else
+	{	
+		while (select_start.line->next != select_end.line)
+			delete_line(select_start.line->next);
+		text_delete(select_start.line, select_start.x, select_start.line->length - select_start.x);
+		if (select_start.line->next->length > select_end.x + 1)
+			text_copy(select_start.line, select_start.line->length, select_start.line->next, select_end.x + 1, select_start.line->next->length - select_end.x - 1);
+		delete_line(select_start.line->next);
+	}
+	line_changed(select_start.line);
+
+	check_boundx();
 }
 
 void mark(buffer *b)
@@ -1038,458 +2985,4760 @@ void mark(buffer *b)
 	b->select_mark.y = current_buffer->cy + current_buffer->offsety;
 }
 
-void clear_mark(buffer *b)
+void clear_mark(buffer *b)
+{
+	b->select_mark.line = NULL;
+	b->select_mark.x = 0;
+	b->select_mark.y = 0;
+	b->block_select = false;
+}
+
+void get_select_extents(buffer *b, Select_mark *start, Select_mark *end)
+{
+	if ((b->cy + b->offsety < b->select_mark.y) || ((b->cy + b->offsety == b->select_mark.y) && (b->cx < b->select_mark.x)))
+	{
+		start->x = b->cx;
+		start->y = b->cy + b->offsety ;
+		start->line = b->current_line;
+		end->x = b->select_mark.x;
+		end->y = b->select_mark.y;
+		end->line = b->select_mark.line;
+	}
+	else
+	{
+		start->x = b->select_mark.x;
+		start->y = b->select_mark.y;
+		start->line = b->select_mark.line;
+		end->x = b->cx;
+		end->y = b->cy + b->offsety ;
+		end->line = b->current_line;
+	}
+}
+
+// Act on a key with several cursors or a block selected, returning false if it is left to handle_key()
+bool cursors_key(int key)
+{
+	buffer *b = current_buffer;
+	bool edit = (key > 27 && key < 256) || key == '\t' || key == KEY_BACKSPACE || key == KEY_DC;
+
+	// A block grows as the cursor moves, and becomes a cursor on each of its lines once it is typed in
+	if (b->block_select)
+	{
+		if (!edit)
+		{
+			if (!moving_key(key) && key != KEY_HOME && key != KEY_END && key != CTRL('r'))
+				clear_mark(b);
+			return false;
+		}
+
+		// The text of the block and what is typed in its place are undone together
+		int group = undo_group;
+		if (group == 0)
+			undo_group = ++undo_groups;
+		bool deleted = block_cursors();
+		bool typed = b->cursor_count > 0 && !(deleted && (key == KEY_BACKSPACE || key == KEY_DC));
+		if (typed)
+			cursors_edit(key);
+		undo_group = group;
+		if (!typed)
+			return b->cursor_count > 0;
+	}
+	else if (edit)
+		cursors_edit(key);
+	else if (key == KEY_LEFT || key == KEY_RIGHT || key == KEY_HOME || key == KEY_END)
+		cursors_move(key);
+	else
+	{
+		clear_cursors(b);
+		return false;
+	}
+
+	b->cx = b->cursors[b->cursor_main].x;
+	check_boundx();
+	merge_cursors(b);
+	return true;
+}
+
+// Find a line from its position, walking from the current line
+Line *line_near(int y)
+{
+	Line *line = current_buffer->current_line;
+	int line_y = current_buffer->cy + current_buffer->offsety;
+	while (line_y < y && line->next != NULL)
+	{
+		line = line->next;
+		line_y++;
+	}
+	while (line_y > y && line->prev != NULL)
+	{
+		line = line->prev;
+		line_y--;
+	}
+	return line;
+}
+
+// Turn the block selection into a cursor on each of its lines at its left edge, deleting the text inside it.
+// Returns whether there was any text to delete
+bool block_cursors()
+{
+	buffer *b = current_buffer;
+	Select_mark start, end;
+	get_select_extents(b, &start, &end);
+	int mark_dx = cxtodx(b->select_mark.line, b->select_mark.x);
+	int cursor_dx = cxtodx(b->current_line, b->cx);
+	int left = mark_dx < cursor_dx ? mark_dx : cursor_dx;
+	int right = mark_dx < cursor_dx ? cursor_dx : mark_dx;
+	int y = b->cy + b->offsety;
+	clear_mark(b);
+	clear_cursors(b);
+	if (start.y == end.y && left == right)
+		return false;
+
+	b->cursor_count = end.y - start.y + 1;
+	b->cursors = (Cursor *) malloc(sizeof(Cursor) * b->cursor_count);
+	b->cursor_main = y - start.y;
+
+	// Each line's part of the block is undone along with the rest (and with anything else in the group it is part of)
+	bool deleted = false;
+	int group = undo_group;
+	if (group == 0)
+		undo_group = ++undo_groups;
+	Line *line = start.line;
+	for (int i = 0; i < b->cursor_count; i++, line = line->next)
+	{
+		int x = dxtocx(line, left);
+		int end_x = dxtocx(line, right);
+		if (x > line->length)
+			x = line->length;
+		if (end_x > line->length)
+			end_x = line->length;
+		if (end_x > x)
+		{
+			char *text = (char *) malloc(sizeof(char) * (end_x - x));
+			text_copy_out(line, x, text, end_x - x);
+			push_undo(x + 1, start.y + i, UNDO_DELETE, text, end_x - x);
+			free(text);
+			delete_string(line, x, end_x - x);
+			deleted = true;
+		}
+		b->cursors[i].y = start.y + i;
+		b->cursors[i].x = x;
+	}
+	undo_group = group;
+
+	b->cx = b->cursors[b->cursor_main].x;
+	check_boundx();
+	if (deleted)
+		b->modified = true;
+	return deleted;
+}
+
+// Type or delete a character at every cursor in one batch, working up from the bottom so that the
+// positions of the cursors still to be done are unchanged. It is undone in one step
+void cursors_edit(int key)
+{
+	buffer *b = current_buffer;
+	char c = key;
+	int group = undo_group;
+	if (group == 0)
+		undo_group = ++undo_groups;
+	int i = b->cursor_count - 1;
+	Line *line = line_near(b->cursors[i].y);
+	int line_y = b->cursors[i].y;
+	while (i >= 0)
+	{
+		while (line_y > b->cursors[i].y)
+		{
+			line = line->prev;
+			line_y--;
+		}
+		int first = i;
+		while (first > 0 && b->cursors[first - 1].y == line_y)
+			first--;
+
+		// The line's text from the first cursor to the last is built again in one pass, and replaced (and undone) as one piece
+		int length = line->length;
+		int lo = b->cursors[first].x;
+		int hi = b->cursors[i].x;
+		if (key == KEY_BACKSPACE && lo > 0)
+			lo--;
+		if (key == KEY_DC && hi < length)
+			hi++;
+		char *text = (char *) counted_malloc(sizeof(char) * ((hi - lo) * 2 + i - first + 1));
+		char *new_text = text + (hi - lo);
+		text_copy_out(line, lo, text, hi - lo);
+		int new_length = 0;
+		int from = lo;
+		for (int k = first; k <= i; k++)
+		{
+			int x = b->cursors[k].x;
+			if (key == KEY_BACKSPACE && x == 0)
+				continue;
+			if (key == KEY_DC && x >= length)
+				continue;
+			int to = key == KEY_BACKSPACE ? x - 1 : x;
+			memcpy(new_text + new_length, text + from - lo, to - from);
+			new_length += to - from;
+			if (key == KEY_BACKSPACE || key == KEY_DC)
+				from = to + 1;
+			else
+			{
+				new_text[new_length++] = c;
+				from = to;
+			}
+		}
+		memcpy(new_text + new_length, text + from - lo, hi - from);
+		new_length += hi - from;
+		if (new_length != hi - lo) // Typing always adds, and deleting only does nothing when every cursor is at an edge
+		{
+			push_undo(lo + 1, line_y, UNDO_REPLACE, text, hi - lo);
+			undo_head->end_x = new_length;
+			text_replace(line, lo, hi - lo, new_text, new_length);
+			line_changed(line);
+		}
+		free(text);
+
+		// Then move each cursor along by the characters added or taken away to its left
+		int shift = 0;
+		for (int k = first; k <= i; k++)
+		{
+			int x = b->cursors[k].x;
+			if (key == KEY_BACKSPACE)
+			{
+				if (x > 0)
+					shift++;
+				b->cursors[k].x = x - shift;
+			}
+			else if (key == KEY_DC)
+			{
+				b->cursors[k].x = x - shift;
+				if (x < length)
+					shift++;
+			}
+			else
+				b->cursors[k].x = x + ++shift;
+		}
+		i = first - 1;
+	}
+	undo_group = group;
+	b->modified = true;
+}
+
+// Move every cursor within its line
+void cursors_move(int key)
+{
+	buffer *b = current_buffer;
+	Line *line = line_near(b->cursors[0].y);
+	int line_y = b->cursors[0].y;
+	for (int i = 0; i < b->cursor_count; i++)
+	{
+		Cursor *cursor = &b->cursors[i];
+		while (line_y < cursor->y)
+		{
+			line = line->next;
+			line_y++;
+		}
+		if (key == KEY_LEFT && cursor->x > 0)
+			cursor->x--;
+		else if (key == KEY_RIGHT && cursor->x < line->length)
+			cursor->x++;
+		else if (key == KEY_HOME)
+			cursor->x = 0;
+		else if (key == KEY_END)
+			cursor->x = line->length;
+	}
+}
+
+// Put cursors which have come together back into one, and go back to a single cursor if that is all there is left
+void merge_cursors(buffer *b)
+{
+	int count = 0;
+	for (int i = 0; i < b->cursor_count; i++)
+	{
+		if (count > 0 && b->cursors[count - 1].y == b->cursors[i].y && b->cursors[count - 1].x == b->cursors[i].x)
+		{
+			if (i == b->cursor_main)
+				b->cursor_main = count - 1;
+			continue;
+		}
+		if (i == b->cursor_main)
+			b->cursor_main = count;
+		b->cursors[count++] = b->cursors[i];
+	}
+	b->cursor_count = count;
+	if (count <= 1)
+		clear_cursors(b);
+}
+
+void clear_cursors(buffer *b)
+{
+	free(b->cursors);
+	b->cursors = NULL;
+	b->cursor_count = 0;
+	b->cursor_main = 0;
+}
+
+// Put a cursor at the start of each match of some text, in the selected lines or the whole buffer
+int add_cursors(char *find_string)
+{
+	buffer *b = current_buffer;
+	Line *line = b->first_line;
+	int y = 0;
+	int last = b->lines - 1;
+	if (b->select_mark.line != NULL)
+	{
+		Select_mark start, end;
+		get_select_extents(b, &start, &end);
+		line = start.line;
+		y = start.y;
+		last = end.y;
+	}
+	clear_mark(b);
+	clear_cursors(b);
+
+	int size = 0;
+	int find_length = strlen(find_string);
+	for (; line != NULL && y <= last; line = line->next, y++)
+	{
+		bool paged = line->storage == TEXT_PAGED;
+		int x = line_find(line, 0, find_string);
+		while (x >= 0)
+		{
+			if (b->cursor_count == size)
+			{
+				size = size ? size * 2 : 64;
+				b->cursors = (Cursor *) realloc(b->cursors, sizeof(Cursor) * size);
+			}
+			b->cursors[b->cursor_count].y = y;
+			b->cursors[b->cursor_count].x = x;
+			b->cursor_count++;
+			x = line_find(line, x + find_length, find_string);
+		}
+		if (paged)
+			drop_text(line);
+	}
+
+	int count = b->cursor_count;
+	if (count == 0)
+		return 0;
+	goto_line(b->cursors[0].y + 1);
+	b->cx = b->cursors[0].x;
+	check_boundx();
+	merge_cursors(b);
+	return count;
+}
+
+// Index of the first cursor on or after line y
+int cursor_at(buffer *b, int y)
+{
+	int low = 0;
+	int high = b->cursor_count;
+	while (low < high)
+	{
+		int mid = (low + high) / 2;
+		if (b->cursors[mid].y < y)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+void copy_line()
+{
+	// Clear the paste buffer
+	delete_lines(paste_buffer->first_line); 
+
+	// Copy current line into paste buffer	
+	Line *dest_line = NULL;
+	dest_line = insert_line(dest_line, NULL, NULL, 0);
+	text_copy(dest_line, 0, current_buffer->current_line, 0, current_buffer->current_line->length);
+	paste_buffer->first_line = dest_line;
+
+	// Insert a blank line for carriage return
+	dest_line = insert_line(dest_line, NULL, NULL, 0);
+	paste_buffer->lines = 2;
+}
+
+void copy()
+{
+	Line *dest_line = NULL;
+	Line *source_line;
+	Select_mark select_start;
+	Select_mark select_end;
+	int startx = 0;
+	int endx = 0;
+
+	get_select_extents(current_buffer, &select_start, &select_end);
+
+	// Clear the paste buffer
+	delete_lines(paste_buffer->first_line); 
+	paste_buffer->first_line = NULL;
+	paste_buffer->lines = 0;
+
+	source_line = select_start.line;
+
+	// Loop until current line is the end line
+	while (source_line != select_end.line->next)
+	{
+		if (source_line == select_start.line)
+			startx = select_start.x;
+		else
+			startx = 0;
+		if (source_line == select_end.line)
+		{
+			endx = select_end.x + 1;
+			if (endx - startx > source_line->length)
+				endx--;
+		}
+		else
+			endx = source_line->length;
+
+		dest_line = insert_line(dest_line, NULL, NULL, 0);
+		text_copy(dest_line, 0, source_line, startx, endx - startx);
+
+		paste_buffer->lines += 1;
+		if (paste_buffer->first_line == NULL)
+			paste_buffer->first_line = dest_line;
+		source_line = source_line->next;
+	}
+}
+
+void cut()
+{
+	copy();
+	delete_selection();
+}
+
+void cut_line()
+{
+	copy_line();
+	delete_line(current_buffer->current_line);
+	check_boundx();
+}
+
+void paste()
+{
+	paste_lines(paste_buffer->first_line);
+}
+
+// Read text pasted into the terminal up to the end marker and insert it
+void terminal_paste()
+{
+	Line *first_line = insert_line(NULL, NULL, NULL, 0);
+	Line *line = first_line;
+	int size = 256;
+	int length = 0;
+	char *text = (char *) malloc(size);
+
+	int c;
+	int last = 0;
+	while ((c = read_key()) != KEY_PASTE_END && c != ERR)
+	{
+		if (c == '\r' || c == '\n')
+		{
+			// Terminals send CR for each new line, but allow for CR LF as well
+			if (!(c == '\n' && last == '\r'))
+			{
+				text_insert(line, 0, text, length);
+				line = insert_line(line, NULL, NULL, 0);
+				length = 0;
+			}
+		}
+		else if (c < 256)
+		{
+			if (length == size)
+			{
+				size *= 2;
+				text = (char *) realloc(text, size);
+			}
+			text[length++] = c;
+		}
+		last = c;
+	}
+	text_insert(line, 0, text, length);
+	free(text);
+
+	paste_lines(first_line);
+	delete_lines(first_line);
+}
+
+// Insert a chain of lines at the cursor
+void paste_lines(Line *source_line)
+{
+	// If nothing in paste buffer then return
+	if (!source_line)
+		return;
+
+	Line *line = current_buffer->current_line;
+	int start_x = current_buffer->cx;
+	int start_y = current_buffer->cy + current_buffer->offsety;
+
+	// Build the pasted lines as a separate chain, with the rest of the current line on the end
+	Line *first = NULL;
+	Line *last = NULL;
+	int count = 0;
+	for (Line *source = source_line->next; source != NULL; source = source->next)
+	{
+		last = insert_line(last, NULL, NULL, 0);
+		text_copy(last, 0, source, 0, source->length);
+		if (first == NULL)
+			first = last;
+		count++;
+	}
+
+	int end_x = start_x + source_line->length;
+	if (last != NULL)
+	{
+		end_x = last->length;
+		text_copy(last, last->length, line, start_x, line->length - start_x);
+		text_delete(line, start_x, line->length - start_x);
+	}
+
+	// Paste first line into current line
+	text_copy(line, start_x, source_line, 0, source_line->length);
+	line_changed(line);
+
+	// Splice the chain in after the current line
+	if (last != NULL)
+	{
+		last->next = line->next;
+		if (line->next != NULL)
+			line->next->prev = last;
+		line->next = first;
+		first->prev = line;
+
+		current_buffer->lines += count;
+		if (current_buffer->select_mark.y > start_y)
+			current_buffer->select_mark.y += count;
+		index_insert_lines(first, last);
+		for (Line *l = first; l != last->next; l = l->next)
+		{
+			update_syntax(l);
+			update_stats(current_buffer, l);
+		}
+
+		move_lines_down(count);
+	}
+	current_buffer->cx = end_x;
+	check_boundx();
+
+	// Undo the whole paste at once
+	push_undo(start_x + 1, start_y, UNDO_PASTE, NULL, 0);
+	undo_head->lines = count;
+	undo_head->end_x = end_x;
+}
+
+// Delete from the cursor to end_x in the line that many lines further on
+void delete_range(int lines, int end_x)
+{
+	Line *line = current_buffer->current_line;
+	int x = current_buffer->cx;
+	int y = current_buffer->cy + current_buffer->offsety;
+
+	if (lines == 0)
+	{
+		delete_string(line, x, end_x - x);
+		return;
+	}
+
+	Line *first = line->next;
+	Line *last = line;
+	for (int i = 0; i < lines; i++)
+		last = last->next;
+
+	// Keep the text after the range and unlink the whole chain in one go
+	text_delete(line, x, line->length - x);
+	text_copy(line, line->length, last, end_x, last->length - end_x);
+
+	if (current_buffer->select_mark.y > y + lines)
+		current_buffer->select_mark.y -= lines;
+	else if (current_buffer->select_mark.y > y)
+		clear_mark(current_buffer);
+	index_remove_lines(first, lines);
+	for (Line *l = first; l != last->next; l = l->next)
+		remove_stats(current_buffer, l);
+
+	line->next = last->next;
+	if (last->next != NULL)
+		last->next->prev = line;
+	last->next = NULL;
+	delete_lines(first);
+	current_buffer->lines -= lines;
+
+	line_changed(line);
+}
+
+void delete_line(Line *line)
+{
+	// Delete selection mark if the line with the mark is deleted
+	if (current_buffer->select_mark.line == line) clear_mark(current_buffer);
+	// Adjust the mark cy if it is after the deleted line
+	else if (current_buffer->cy < current_buffer->select_mark.y) current_buffer->select_mark.y--;
+
+	if (line == current_buffer->first_line) current_buffer->first_line = line->next;
+	if (line == current_buffer->first_screen_line)
+	{
+		current_buffer->first_screen_line = line->next;
+		current_buffer->top_row = 0;
+	}
+	index_remove(line);
+
+	if (line->prev != NULL) line->prev->next = line->next;
+	if (line->next != NULL) line->next->prev = line->prev;
+
+	// The following line now starts in the state the deleted line started in
+	if (line->next != NULL) line_changed(line->next);
+
+	if (line == current_buffer->current_line) 
+	{
+		if (line->next != NULL) current_buffer->current_line = line->next;
+		else current_buffer->current_line = line->prev;
+	}
+
+	remove_stats(current_buffer, line);
+	free_text(line);
+	free(line);
+	line_bytes -= sizeof(Line);
+	current_buffer->lines--;
+}
+
+void delete_lines(Line *start_line)
+{
+	Line *l;
+	while (start_line != NULL)
+	{
+		l = start_line;
+		start_line = start_line->next;
+		forget_words(l);
+		free_text(l);
+		free(l);
+		line_bytes -= sizeof(Line);
+	}
+	return;
+}
+
+void save_file(char *save_filename)
+{
+	// Replaying a trace goes through the motions of saving without changing any files
+	if (replay_file != NULL)
+		save_filename = "/dev/null";
+
+	// Paged out lines still to be read back from the file are moved out of the way of it being overwritten
+	buffer *b = current_buffer;
+	struct stat st, page_st;
+	unpage_undo(b);
+	if (b->page_fd >= 0 && stat(save_filename, &st) == 0 && fstat(b->page_fd, &page_st) == 0 &&
+		st.st_ino == page_st.st_ino && st.st_dev == page_st.st_dev)
+		unpage_file(b);
+
+	FILE *fp = fopen(save_filename, "w");
+	if (!fp)
+		return;
+
+	Line *line = current_buffer->first_line;
+	while (line != NULL)
+	{
+		bool paged = line->storage == TEXT_PAGED;
+		int length;
+		for (int x = 0; x < line->length; x += length)
+		{
+			char *chunk = line_chunk(line, x, &length);
+			fwrite(chunk, sizeof(char), length, fp);
+		}
+		fputc('\n', fp);
+		if (paged)
+			drop_text(line);
+		line = line->next;
+	}
+	bool saved = !ferror(fp);
+	if (fclose(fp) != 0)
+		saved = false;
+	current_buffer->modified = false;
+
+	if (saved && strcmp(save_filename, b->filename) == 0)
+		repoint_lines(b, save_filename);
+
+	return;
+}
+
+bool open_file(char *open_filename)
+{
+	FILE *fp = fopen(open_filename, "r");
+	if (!fp)
+		return false;
+
+	current_buffer = add_buffer();
+	current_buffer->filename = (char *)realloc(current_buffer->filename, sizeof(char) * strlen(open_filename) + 1);
+	strcpy(current_buffer->filename, open_filename);
+	select_syntax(current_buffer);
+
+	read_lines(fp, NULL);
+	fclose(fp);
+	current_buffer->modified = false;
+
+	return true;
+}
+
+// Read the rest of a file onto the end of the current buffer, after last, and return the new last line
+Line *read_lines(FILE *fp, Line *last)
+{
+	char *read_line = NULL;
+	Line *line = last;
+	long length = 0;
+	size_t max_length = 0;
+	buffer *b = current_buffer;
+
+	// Keep the file open to read lines back from once they have been paged out
+	struct stat st, page_st;
+	if (fstat(fileno(fp), &st) == 0)
+	{
+		b->file_inode = st.st_ino;
+		if (b->page_fd >= 0 && (fstat(b->page_fd, &page_st) != 0 || page_st.st_ino != st.st_ino || page_st.st_dev != st.st_dev))
+		{
+			close(b->page_fd);
+			b->page_fd = -1;
+			page_block_fd = -1;
+		}
+		if (b->page_fd < 0)
+			b->page_fd = fcntl(fileno(fp), F_DUPFD_CLOEXEC, 0);
+	}
+	long offset = ftell(fp);
+	int page_fd = offset >= 0 ? b->page_fd : -1;
+	bool dropping = false; // Once over the memory budget, lines are paged out again as they are read
+
+	while ((length = getline(&read_line, &max_length, fp)) != -1)
+	{
+		bool newline = read_line[length - 1] == '\n';
+		long start = offset;
+		offset += length;
+
+		// Trim trailing newlines
+		while (length > 0 && (read_line[length - 1] == '\n' || read_line[length - 1] == '\r'))
+			length--;
+
+		// Finish a line which the last read stopped part way through
+		if (current_buffer->file_partial && line != NULL)
+		{
+			text_insert(line, line->length, read_line, length);
+			line_changed(line);
+		}
+		else
+		{
+			current_buffer->lines += 1;
+			line = insert_line(line, NULL, read_line, length);
+			line->page_fd = page_fd;
+			line->page_pos = start;
+			update_stats(b, line);
+			if (current_buffer->first_line == NULL)
+				current_buffer->first_line = line;
+			if (dropping && b->lines > b->cy + b->offsety + PAGE_KEEP_LINES)
+				page_out_line(b, line);
+		}
+		current_buffer->file_partial = !newline;
+		if (!dropping)
+			dropping = check_memory();
+	}
+	current_buffer->file_offset = ftell(fp);
+	free(read_line);
+
+	// An empty file still has one (empty) line, which anything appended later goes onto
+	if (current_buffer->first_line == NULL)
+	{
+		current_buffer->first_line = line = insert_line(NULL, NULL, NULL, 0);
+		current_buffer->lines = 1;
+		current_buffer->file_partial = true;
+	}
+	current_buffer->last_line = line;
+	return line;
+}
+
+// Start or stop reading what other programs append to the current buffer's file
+bool follow(bool on)
+{
+	buffer *b = current_buffer;
+	if (!on)
+	{
+		if (b->follow)
+		{
+			b->follow = false;
+			unwatch(b->follow_watch);
+			unwatch(b->follow_dir_watch);
+		}
+		return true;
+	}
+	if (b->follow)
+		return true;
+
+	if (follow_fd < 0)
+		follow_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (follow_fd < 0)
+		return false;
+
+	// Watch the directory too, to see the file being replaced when logs are rotated
+	char dir[MAX_FILENAME_LENGTH];
+	char *slash = strrchr(b->filename, '/');
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int) (slash - b->filename) + (slash == b->filename), b->filename);
+
+	b->follow_watch = inotify_add_watch(follow_fd, b->filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+	if (b->follow_watch < 0)
+		return false;
+	b->follow_dir_watch = inotify_add_watch(follow_fd, dir, IN_CREATE | IN_MOVED_TO);
+	b->follow = true;
+
+	follow_check(b);
+	move_file_end();
+	return true;
+}
+
+// Remove an inotify watch unless another followed buffer shares it
+void unwatch(int watch)
+{
+	for (buffer *b = first_buffer; b != NULL; b = b->next)
+		if (b->follow && (b->follow_watch == watch || b->follow_dir_watch == watch))
+			return;
+	inotify_rm_watch(follow_fd, watch);
+}
+
+// Read any changes to the files being followed after inotify has reported something
+void follow_files()
+{
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while (read(follow_fd, events, sizeof(events)) > 0)
+		;
+
+	// Events only say that something may have changed, so check each file
+	buffer *current = current_buffer;
+	for (buffer *b = first_buffer; b != NULL; b = b->next)
+	{
+		if (b->follow)
+		{
+			current_buffer = b;
+			follow_check(b);
+		}
+	}
+	current_buffer = current;
+}
+
+// Bring a followed buffer up to date with its file, which has to be the current buffer
+void follow_check(buffer *b)
+{
+	struct stat st;
+	if (!b->loaded)
+		return; // Reloading, so the whole file is read when the buffer is shown
+	if (stat(b->filename, &st) != 0)
+		return; // Rotated away and not created again yet
+
+	// A different file or a shorter one has been rotated or truncated, so start again
+	if (st.st_ino != b->file_inode || st.st_size < b->file_offset)
+	{
+		if (b->modified)
+		{
+			char msg[MAX_MESSAGE_LENGTH];
+			snprintf(msg, sizeof(msg), "%s truncated or replaced, stopped following to keep unsaved changes", b->filename);
+			message(msg);
+			follow(false);
+			return;
+		}
+		if (st.st_ino != b->file_inode)
+		{
+			b->follow = false;
+			unwatch(b->follow_watch);
+			b->follow = true;
+			b->follow_watch = inotify_add_watch(follow_fd, b->filename, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+		}
+		reload_file(b);
+		return;
+	}
+	if (st.st_size == b->file_offset)
+		return;
+
+	FILE *fp = fopen(b->filename, "r");
+	if (!fp)
+		return;
+	fseek(fp, b->file_offset, SEEK_SET);
+
+	Line *last = get_last_line(b);
+	bool at_end = b->current_line == last;
+	int lines = b->lines;
+
+	Line *new_last = read_lines(fp, last);
+	fclose(fp);
+	if (new_last != last)
+		index_insert_lines(last->next, new_last);
+
+	if (at_end)
+		move_file_end();
+	if (b->lines != lines)
+	{
+		char msg[MAX_MESSAGE_LENGTH];
+		snprintf(msg, sizeof(msg), "%d lines added to %s", b->lines - lines, b->filename);
+		message(msg);
+	}
+}
+
+// Empty a followed buffer whose file has been truncated or replaced, to be read again when it is next shown
+void reload_file(buffer *b)
+{
+	struct stat st;
+	if (stat(b->filename, &st) != 0)
+		return;
+
+	drop_undo(b); // Undo marks only make sense for the text they were made in
+	free_index(b);
+	if (b->table != NULL)
+		b->table->rescan = true;
+	delete_lines(b->first_line);
+	close_pages(b);
+	b->first_line = NULL;
+	b->current_line = NULL;
+	b->first_screen_line = NULL;
+	b->last_line = NULL;
+	b->page_line = NULL;
+	b->lines = 0;
+	b->words = 0;
+	b->chars = 0;
+	b->loc = 0;
+	b->file_offset = 0;
+	b->file_partial = false;
+	clear_mark(b);
+
+	b->loaded = false;
+	b->file_size = st.st_size;
+	b->file_mtime = st.st_mtime;
+	char msg[MAX_MESSAGE_LENGTH];
+	snprintf(msg, sizeof(msg), "%s truncated or replaced, reloading", b->filename);
+	message(msg);
+}
+
+// Add a buffer for a file without reading it yet, returning false if there is no such file
+bool open_lazy(char *open_filename)
+{
+	struct stat st;
+	if (stat(open_filename, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+
+	current_buffer = add_buffer();
+	current_buffer->filename = strdup(open_filename);
+	current_buffer->loaded = false;
+	current_buffer->file_size = st.st_size;
+	current_buffer->file_mtime = st.st_mtime;
+	return true;
+}
+
+// Add buffers for each file matching a pattern, or a new file if the name matches nothing
+void open_files(char *pattern)
+{
+	glob_t matches;
+	if (strpbrk(pattern, "*?[") != NULL && glob(pattern, 0, NULL, &matches) == 0)
+	{
+		for (size_t i = 0; i < matches.gl_pathc; i++)
+			open_lazy(matches.gl_pathv[i]);
+		globfree(&matches);
+		return;
+	}
+	if (!open_lazy(pattern))
+		new_file(pattern);
+}
+
+// Read in a buffer's file the first time it is shown
+void load_buffer(buffer *b)
+{
+	current_buffer = b;
+	b->loaded = true;
+	select_syntax(b);
+
+	FILE *fp = fopen(b->filename, "r");
+	if (fp)
+	{
+		read_lines(fp, NULL);
+		fclose(fp);
+	}
+	else
+	{
+		b->first_line = insert_line(NULL, NULL, NULL, 0);
+		b->lines = 1;
+	}
+	b->modified = false;
+	move_file_home();
+	if (b->follow)
+		move_file_end();
+}
+
+// Make a buffer current, reading its file if it has not been shown before
+void switch_buffer(buffer *b)
+{
+	current_buffer = b;
+	if (!b->loaded)
+		load_buffer(b);
+}
+
+// Open a buffer listing the others, where ENTER switches to the one on the cursor line
+void buffer_picker()
+{
+	char text[MAX_FILENAME_LENGTH + 64];
+	buffer *from = current_buffer;
+	buffer *picker = report_buffer("buffers");
+	picker->type = BUFFER_PICKER;
+
+	int line = 0;
+	int from_line = 0;
+	for (buffer *b = first_buffer; b != NULL; b = b->next)
+	{
+		if (b->type == BUFFER_PICKER)
+			continue;
+		if (b == from)
+			from_line = line;
+		if (b->loaded)
+			snprintf(text, sizeof(text), "%c %-40s %d lines", b->modified ? '*' : ' ', b->filename, b->lines);
+		else
+			snprintf(text, sizeof(text), "  %-40s %ld bytes", b->filename, b->file_size);
+		append_line(picker, text);
+		line++;
+	}
+	goto_line(from_line + 1);
+}
+
+// Switch to the buffer on the cursor line of the picker, and close the picker
+void pick_buffer()
+{
+	buffer *picker = current_buffer;
+	int n = 0;
+	for (Line *l = picker->first_line; l != picker->current_line; l = l->next)
+		n++;
+
+	buffer *b = first_buffer;
+	for (; b != NULL; b = b->next)
+	{
+		if (b->type == BUFFER_PICKER)
+			continue;
+		if (n-- == 0)
+			break;
+	}
+	close_buffer(picker);
+	if (b != NULL)
+		switch_buffer(b);
+}
+
+void new_file(char *new_filename)
+{
+	current_buffer = add_buffer();
+	current_buffer->filename = (char *)realloc(current_buffer->filename, sizeof(char) * strlen(new_filename) + 1);
+	strcpy(current_buffer->filename, new_filename);
+	current_buffer->first_line = insert_line(NULL, NULL, NULL, 0);
+	current_buffer->lines = 1;
+	select_syntax(current_buffer);
+	current_buffer->modified = false;
+}
+
+void load_options()
+{
+    char *read_line = NULL;
+	char *p;
+	char *o;
+	size_t max_length = 0;
+
+    // Set default options
+    o_tabsize = 4;
+    o_messagecooldown = 2;
+	o_show_linenumbers = false;
+	o_soft_wrap = false;
+	o_perf_hud = false;
+	o_complete = false;
+	o_memory = 0;
+
+    char filename[256];
+    strcat(strcpy(filename, getenv("HOME")), "/.write");
+
+	FILE *fp = fopen(filename, "r");
+	if (!fp) return;
+
+	while (getline(&read_line, &max_length, fp) != -1)
+	{
+        // Skip blank lines and comments prefaced with '#'
+        if (strlen(read_line) == 1) continue;
+        if (read_line[0] == '#') continue;
+
+		while ((p = strtok(read_line, " ")))
+		{
+			if (strcmp(p, "set") == 0)
+			{
+				// Need two more 
+				if (!(p = strtok(NULL, " "))) break;
+				if (!(o = strtok(NULL, " "))) break;
+				if (strcmp(p, "tabsize") == 0) o_tabsize = atoi(o);
+				else if (strcmp(p, "message_cooldown") == 0) o_messagecooldown = atoi(o);
+				else if (strcmp(p, "show_linenumbers") == 0) o_show_linenumbers = atoi(o);
+				else if (strcmp(p, "soft_wrap") == 0) o_soft_wrap = atoi(o);
+				else if (strcmp(p, "perf_hud") == 0) o_perf_hud = atoi(o);
+				else if (strcmp(p, "complete") == 0) words_indexed = o_complete = atoi(o);
+				else if (strcmp(p, "memory") == 0) o_memory = atoi(o);
+				break;
+			}
+		}
+	}
+
+ 	free(read_line);
+	fclose(fp);
+    return;
+}
+
+buffer *add_buffer()
+{
+	buffer *new_buffer;
+	new_buffer = add_sbuffer();
+	new_buffer->prev = current_buffer;
+	if (current_buffer == NULL)
+		new_buffer->next = NULL;
+	else
+	{
+		new_buffer->next = current_buffer->next;
+		if (current_buffer->next != NULL)
+			current_buffer->next->prev = new_buffer;
+		current_buffer->next = new_buffer;
+	}
+	if (new_buffer->next == NULL)
+		last_buffer = new_buffer;
+	return new_buffer;
+}
+
+buffer *add_sbuffer()
+{
+	buffer *new_buffer;
+	new_buffer = (buffer *) malloc(sizeof(buffer));
+	new_buffer->first_line = NULL;
+	new_buffer->current_line = NULL;
+	new_buffer->first_screen_line = NULL;
+	new_buffer->last_line = NULL;
+	new_buffer->lines = 0;
+	new_buffer->filename = NULL;
+	new_buffer->syntax = NULL;
+	new_buffer->index = NULL;
+	new_buffer->top_row = 0;
+	new_buffer->words = 0;
+	new_buffer->chars = 0;
+	new_buffer->loc = 0;
+	new_buffer->prev = NULL;
+	new_buffer->type = BUFFER_FILE;
+	new_buffer->loaded = true;
+	new_buffer->file_size = 0;
+	new_buffer->file_mtime = 0;
+	new_buffer->follow = false;
+	new_buffer->file_offset = 0;
+	new_buffer->file_partial = false;
+	new_buffer->file_inode = 0;
+	new_buffer->page_fd = -1;
+	new_buffer->swap_fd = -1;
+	new_buffer->page_line = NULL;
+	new_buffer->swap = NULL;
+	new_buffer->swap_size = 0;
+	new_buffer->swap_length = 0;
+	new_buffer->cx = 0;
+	new_buffer->cy = 0;
+	new_buffer->offsetx = 0;
+	new_buffer->offsety = 0;
+	new_buffer->margin_left = 0;
+	new_buffer->modified = false;
+	new_buffer->table = NULL;
+	new_buffer->cursors = NULL;
+	new_buffer->cursor_count = 0;
+	new_buffer->cursor_main = 0;
+	clear_mark(new_buffer);
+	return new_buffer;
+}
+
+void close_buffer(buffer *b)
+{
+	current_buffer = b;
+	follow(false);
+	if (b == grep_buffer)
+	{
+		grep_buffer = NULL;
+		stop_grep();
+	}
+
+	// Unlink the buffer and show the one before it, or the new first buffer
+	if (b->prev != NULL)
+		b->prev->next = b->next;
+	else
+		first_buffer = b->next;
+	if (b->next != NULL)
+		b->next->prev = b->prev;
+	else
+		last_buffer = b->prev;
+	current_buffer = b->prev != NULL ? b->prev : b->next;
+
+	drop_undo(b);
+	free_index(b);
+	delete_lines(b->first_line); // Clear the text buffer starting at the first line
+	close_pages(b);
+	free_table(b);
+	free(b->cursors);
+	free(b->filename);
+	free(b);
+	return;
+}
+
+void prompt_save()
+{
+	char s[MAX_FILENAME_LENGTH];
+	if (get_input("Save as ", current_buffer->filename, s, MAX_FILENAME_LENGTH))
+	{
+		current_buffer->filename = (char *)realloc(current_buffer->filename, sizeof(char) * strlen(s) + 1);
+		strcpy(current_buffer->filename, s);
+		select_syntax(current_buffer);
+		save_file(current_buffer->filename);
+
+		message("Saved");
+	}
+}
+
+bool find(char *find_string, Line *start_line, int start_x)
+{
+	Line *l = start_line;
+	int find_y = current_buffer->cy + current_buffer->offsety;
+	int find_x = start_x + 1;
+
+	while (l != start_line->prev)
+	{
+		bool paged = l->storage == TEXT_PAGED;
+		int match = line_find(l, find_x, find_string);
+		if (match >= 0)
+		{
+			goto_line(find_y + 1);
+			current_buffer->cx = match;
+			check_boundx();
+			return true;
+		}
+		// Lines searched through are not kept in memory if they had been paged out
+		if (paged)
+			drop_text(l);
+
+		l = l->next;
+		find_y += 1;
+		find_x = 0;
+
+		// If last line then jump back to first
+		if ((l == NULL) && (start_line != current_buffer->first_line))
+		{
+			l = current_buffer->first_line;
+			find_y = 0;
+		}
+	}
+	return false;
+}
+
+// Return the position of find_string in a line at or after start, or -1
+int line_find(Line *line, int start, char *find_string)
+{
+	int find_length = strlen(find_string);
+	if (find_length == 0 || start > line->length - find_length)
+		return -1;
+
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	if (line->storage != TEXT_SEGMENTS)
+	{
+		char *text = LINE_TEXT(line);
+		char *match = memmem(text + start, line->length - start, find_string, find_length);
+		return match ? match - text : -1;
+	}
+
+	// Search each segment, then across the join with the next one
+	char *join = malloc(find_length * 2);
+	int length;
+	int found = -1;
+	for (int x = start; found < 0 && x < line->length; x += length)
+	{
+		char *chunk = line_chunk(line, x, &length);
+		char *match = memmem(chunk, length, find_string, find_length);
+		if (match)
+		{
+			found = x + (match - chunk);
+			break;
+		}
+
+		int join_start = length >= find_length ? x + length - find_length + 1 : x;
+		int join_end = x + length + find_length - 1;
+		if (join_end > line->length)
+			join_end = line->length;
+		for (int i = join_start; i < join_end; i++)
+			join[i - join_start] = line_char(line, i);
+		match = memmem(join, join_end - join_start, find_string, find_length);
+		if (match)
+			found = join_start + (match - join);
+	}
+	free(join);
+	return found;
+}
+
+void resize_window()
+{
+	if (headless)
+		return;
+
+	getmaxyx(stdscr, windowy, windowx);
+	windowy -= 2; // Reduce for status bar and message buffer
+	trace_event(TRACE_RESIZE, windowx << 16 | windowy);
+
+	// Resize all windows
+	textscr = subwin(stdscr, windowy, windowx, 0, 0);
+	statusscr = subwin(stdscr, 1, windowx, windowy, 0);
+	commandscr = subwin(stdscr, 1, windowx, windowy + 1, 0);
+
+	// Set background for status line
+	wbkgd(statusscr, COLOR_PAIR(COL_WHITEBLUE));
+
+	// Clear command line
+	werase(commandscr);
+	wrefresh(commandscr);
+}
+
+bool run_command(char *s)
+{
+	char *token;
+	char msg[255];
+	token = strtok(s, " ");
+	if (token == NULL) return false;
+
+	if (strcmp(token, "count") == 0)
+	{
+		// Counts are kept up to date as lines change
+		token = strtok(NULL, " ");
+		if (token == NULL) // default count words
+			sprintf(msg, "Words: %ld", current_buffer->words);
+		else if (strcmp(token, "loc") == 0) // count lines of code
+			sprintf(msg, "LOC: %d", current_buffer->loc);
+		else if (strcmp(token, "chars") == 0)
+			sprintf(msg, "Characters: %ld", current_buffer->chars);
+		else
+			return false;
+		message(msg);
+	}
+
+	else if (strcmp(token, "mem") == 0) // report memory use
+		memory_report();
+
+	else if (strcmp(token, "hud") == 0)
+		o_perf_hud = !o_perf_hud;
+
+	else if (strcmp(token, "buffers") == 0)
+		buffer_picker();
+
+	else if (strcmp(token, "sort") == 0) // sort the selected lines, or the whole buffer
+	{
+		sort_unique = false;
+		sort_numeric = false;
+		sort_reverse = false;
+		while ((token = strtok(NULL, " ")) != NULL)
+		{
+			if (token[0] != '-')
+				return false;
+			for (char *c = token + 1; *c; c++)
+			{
+				if (*c == 'u') sort_unique = true;
+				else if (*c == 'n') sort_numeric = true;
+				else if (*c == 'r') sort_reverse = true;
+				else return false;
+			}
+		}
+		int removed = sort_lines();
+		if (removed > 0)
+		{
+			snprintf(msg, sizeof(msg), "%d duplicate lines removed", removed);
+			message(msg);
+		}
+	}
+
+	else if (strcmp(token, "filter") == 0) // replace the selected lines with the output of a command
+	{
+		char *command = strtok(NULL, "");
+		if (command == NULL)
+			return false;
+		filter_lines(command);
+	}
+
+	else if (strcmp(token, "diff") == 0) // compare with another buffer or a file
+	{
+		char *name = strtok(NULL, " ");
+		if (!diff(name ? name : current_buffer->filename))
+		{
+			snprintf(msg, sizeof(msg), "Cannot read %s", name ? name : current_buffer->filename);
+			message(msg);
+		}
+	}
+
+	else if (strcmp(token, "grep") == 0) // search open buffers and the files under a directory
+	{
+		char *pattern = strtok(NULL, " ");
+		if (pattern == NULL)
+			return false;
+		grep(pattern, strtok(NULL, " "));
+	}
+
+	else if (strcmp(token, "follow") == 0) // read what is appended to the file
+	{
+		bool on = !current_buffer->follow;
+		if (!follow(on))
+			snprintf(msg, sizeof(msg), "Cannot follow %s", current_buffer->filename);
+		else
+			snprintf(msg, sizeof(msg), on ? "Following %s" : "Stopped following %s", current_buffer->filename);
+		message(msg);
+	}
+
+	else if (strcmp(token, "cursors") == 0) // put a cursor at each match
+	{
+		char *text = strtok(NULL, "");
+		if (text == NULL)
+			return false;
+		int count = add_cursors(text);
+		snprintf(msg, sizeof(msg), count ? "%d cursors" : "No matches", count);
+		message(msg);
+	}
+
+	else if (strcmp(token, "columns") == 0) // show delimited lines in aligned columns
+	{
+		token = strtok(NULL, " ");
+		char delimiter = 0;
+		if (token != NULL)
+			delimiter = strcmp(token, "tab") == 0 ? '\t' : token[0];
+		toggle_table(delimiter);
+	}
+
+	else if (strcmp(token, "column") == 0) // go to a field of the current line
+	{
+		token = strtok(NULL, " ");
+		if (token == NULL || atoi(token) <= 0)
+			return false;
+		if (!goto_column(atoi(token)))
+		{
+			snprintf(msg, sizeof(msg), "This line has fewer than %d columns", atoi(token));
+			message(msg);
+		}
+	}
+
+	else if (strcmp(token, "macro") == 0) // play the macro a number of times
+	{
+		token = strtok(NULL, " ");
+		int count = token ? atoi(token) : 1;
+		if (count <= 0)
+			return false;
+		play_macro(count);
+	}
+
+	else if (strcmp(token, "perf") == 0) // dump performance histograms
+	{
+		token = strtok(NULL, " ");
+		if (token == NULL) token = "write_perf.txt";
+		if (perf_dump(token))
+			snprintf(msg, sizeof(msg), "Histograms saved to %s", token);
+		else
+			snprintf(msg, sizeof(msg), "Cannot write %s", token);
+		message(msg);
+	}
+
+	// Return true if executed command
+	return true;
+}
+
+
+
+// Set up the buffers the editing functions need, for running without a screen
+void init_headless()
+{
+	// Cursor movement still works in terms of a screen size
+	windowx = 80;
+	windowy = 24;
+	o_soft_wrap = false;
+	headless = true;
+
+	if (paste_buffer == NULL)
+		paste_buffer = add_sbuffer();
+}
+
+// Apply a script of editing commands to each file in turn and save them, without using curses
+// Returns the exit status for the program
+int run_script(char *script_filename, int count, char **filenames)
+{
+	FILE *fp = fopen(script_filename, "r");
+	if (!fp)
+	{
+		fprintf(stderr, "Cannot open script %s\n", script_filename);
+		return 1;
+	}
+
+	// Read the whole script once, trimming line endings
+	char **commands = NULL;
+	int commands_count = 0;
+	char *read_line = NULL;
+	size_t max_length = 0;
+	long length;
+	while ((length = getline(&read_line, &max_length, fp)) != -1)
+	{
+		while (length > 0 && (read_line[length - 1] == '\n' || read_line[length - 1] == '\r'))
+			read_line[--length] = 0;
+		commands = (char **) realloc(commands, sizeof(char *) * (commands_count + 1));
+		commands[commands_count++] = strdup(read_line);
+	}
+	free(read_line);
+	fclose(fp);
+
+	init_headless();
+
+	int status = 0;
+	for (int f = 0; f < count; f++)
+	{
+		if (!open_file(filenames[f]))
+			new_file(filenames[f]);
+		first_buffer = current_buffer;
+		move_file_home();
+
+		for (int i = 0; i < commands_count; i++)
+		{
+			int result = script_command(commands[i]);
+			if (result == SCRIPT_ERROR)
+			{
+				fprintf(stderr, "%s:%d: cannot run '%s' on %s\n", script_filename, i + 1, commands[i], filenames[f]);
+				status = 1;
+			}
+			if (result != SCRIPT_CONTINUE)
+				break;
+		}
+
+		if (current_buffer->modified)
+			save_file(current_buffer->filename);
+		close_buffer(current_buffer);
+		clear_undo();
+		delete_lines(paste_buffer->first_line);
+		paste_buffer->first_line = NULL;
+		paste_buffer->lines = 0;
+	}
+
+	for (int i = 0; i < commands_count; i++)
+		free(commands[i]);
+	free(commands);
+	return status;
+}
+
+// Run one script command against the current buffer
+// Each command is a name, optionally followed by a space and an argument which runs to the end of the line
+int script_command(char *command)
+{
+	char name[MAX_COMMAND_LENGTH];
+	char *argument = strchr(command, ' ');
+	int length = argument ? (int) (argument - command) : (int) strlen(command);
+	if (length >= MAX_COMMAND_LENGTH)
+		return SCRIPT_ERROR;
+	memcpy(name, command, length);
+	name[length] = 0;
+	argument = argument ? argument + 1 : "";
+	int n = atoi(argument) > 0 ? atoi(argument) : 1;
+
+	// Skip blank lines and comments
+	if (length == 0 || name[0] == '#')
+		return SCRIPT_CONTINUE;
+
+	if (strcmp(name, "top") == 0)
+		move_file_home();
+	else if (strcmp(name, "bottom") == 0)
+		move_file_end();
+	else if (strcmp(name, "goto") == 0)
+	{
+		if (atoi(argument) < 1 || atoi(argument) > current_buffer->lines)
+			return SCRIPT_ERROR;
+		goto_line(atoi(argument));
+	}
+	else if (strcmp(name, "up") == 0)
+	{
+		move_lines_up(n);
+		check_boundx();
+	}
+	else if (strcmp(name, "down") == 0)
+	{
+		move_lines_down(n);
+		check_boundx();
+	}
+	else if (strcmp(name, "left") == 0)
+	{
+		for (int i = 0; i < n; i++)
+			move_left();
+	}
+	else if (strcmp(name, "right") == 0)
+	{
+		for (int i = 0; i < n; i++)
+			move_right();
+	}
+	else if (strcmp(name, "home") == 0)
+		move_home();
+	else if (strcmp(name, "end") == 0)
+		move_end();
+	else if (strcmp(name, "find") == 0)
+	{
+		// Matches can start at the cursor; stop working on this file when there are none left
+		if (*argument == 0)
+			return SCRIPT_ERROR;
+		if (!find(argument, current_buffer->current_line, current_buffer->cx - 1))
+			return SCRIPT_STOP;
+	}
+	else if (strcmp(name, "insert") == 0)
+	{
+		if (current_buffer->select_mark.line != NULL)
+		{
+			delete_selection();
+			clear_mark(current_buffer);
+		}
+		insert_string(current_buffer->current_line, current_buffer->cx, argument, strlen(argument));
+		current_buffer->cx += strlen(argument);
+		current_buffer->modified = true;
+	}
+	else if (strcmp(name, "enter") == 0)
+	{
+		for (int i = 0; i < n; i++)
+			enter();
+		current_buffer->modified = true;
+	}
+	else if (strcmp(name, "backspace") == 0 || strcmp(name, "delete") == 0)
+	{
+		if (current_buffer->select_mark.line != NULL)
+		{
+			delete_selection();
+			clear_mark(current_buffer);
+		}
+		else
+		{
+			for (int i = 0; i < n; i++)
+			{
+				if (strcmp(name, "backspace") == 0)
+					backspace();
+				else
+					delete();
+			}
+		}
+		current_buffer->modified = true;
+	}
+	else if (strcmp(name, "mark") == 0)
+		mark(current_buffer);
+	else if (strcmp(name, "copy") == 0)
+	{
+		if (current_buffer->select_mark.line == NULL)
+			copy_line();
+		else
+			copy();
+		clear_mark(current_buffer);
+	}
+	else if (strcmp(name, "cut") == 0)
+	{
+		if (current_buffer->select_mark.line == NULL)
+			cut_line();
+		else
+			cut();
+		clear_mark(current_buffer);
+		current_buffer->modified = true;
+	}
+	else if (strcmp(name, "paste") == 0)
+	{
+		paste();
+		current_buffer->modified = true;
+	}
+	else if (strcmp(name, "save") == 0)
+		save_file(*argument ? argument : current_buffer->filename);
+	else
+		return SCRIPT_ERROR;
+
+	return SCRIPT_CONTINUE;
+}
+
+// Read the next key, from the keyboard or the trace being replayed
+int read_key()
+{
+	if (pushed_key != ERR)
+	{
+		int key = pushed_key;
+		pushed_key = ERR;
+		return key;
+	}
+
+	if (macro_pos >= 0)
+		return macro_pos < macro_length ? macro_keys[macro_pos++] : ERR;
+
+	if (replay_file != NULL)
+	{
+		Trace_record record;
+		while (fread(&record, sizeof(Trace_record), 1, replay_file) == 1)
+		{
+			if (record.type == TRACE_KEY)
+				return record_key(record.value);
+			if (record.type == TRACE_RESIZE)
+			{
+				windowx = record.value >> 16;
+				windowy = record.value & 0xffff;
+			}
+		}
+		return ERR;
+	}
+
+	// While following files, grepping or measuring columns, wait for either a key or something to show
+	while ((follow_fd >= 0 || grep_buffer != NULL || scanning_table()) && !headless && !key_pending())
+	{
+		struct pollfd fds[3] = { { STDIN_FILENO, POLLIN, 0 }, { follow_fd, POLLIN, 0 }, { grep_pipe[0], POLLIN, 0 } };
+		bool scanning = scanning_table();
+		if (poll(fds, 3, scanning ? 0 : -1) > 0 && (fds[1].revents & POLLIN || fds[2].revents & POLLIN))
+		{
+			if (fds[1].revents & POLLIN)
+				follow_files();
+			if (fds[2].revents & POLLIN)
+				grep_drain();
+			refresh_screen();
+		}
+
+		// Column widths are measured a chunk of lines at a time between keys
+		if (scanning && scan_table(current_buffer))
+			refresh_screen();
+	}
+
+	int key = getch();
+	trace_event(TRACE_KEY, key);
+	return record_key(key);
+}
+
+// Have the next read_key() return a key again
+void unread_key(int key)
+{
+	pushed_key = key;
+}
+
+// Add a key to the macro if one is being recorded, and return it
+int record_key(int key)
+{
+	if (!macro_recording || key == ERR)
+		return key;
+	if (macro_length == macro_size)
+	{
+		macro_size = macro_size ? macro_size * 2 : 256;
+		macro_keys = (int *) realloc(macro_keys, sizeof(int) * macro_size);
+	}
+	macro_keys[macro_length++] = key;
+	return key;
+}
+
+// Start recording a macro, or stop and keep the keys recorded
+void record_macro()
+{
+	char msg[MAX_MESSAGE_LENGTH];
+	if (macro_pos >= 0)
+		return;
+	if (!macro_recording)
+	{
+		macro_recording = true;
+		macro_length = 0;
+		message("Recording a macro, F5 to stop");
+		return;
+	}
+
+	macro_recording = false;
+	macro_length--; // Leave out the F5 which stopped recording
+	snprintf(msg, sizeof(msg), "Recorded %d keys, F6 to play them", macro_length);
+	message(msg);
+}
+
+// Play the macro count times, stopping early if a movement in it has nowhere to go (such as past the end of the file).
+// Nothing is drawn until it has finished, and CTRL-z undoes all of it in one step
+void play_macro(int count)
+{
+	char msg[MAX_MESSAGE_LENGTH];
+	if (macro_pos >= 0)
+		return;
+	if (macro_recording)
+	{
+		if (macro_length > 0 && macro_keys[macro_length - 1] == KEY_F(6))
+			macro_length--;
+		message("Stop recording with F5 before playing the macro");
+		return;
+	}
+	if (macro_length == 0)
+	{
+		message("No macro recorded, F5 to start recording one");
+		return;
+	}
+
+	undo_group = ++undo_groups;
+	int played = 0;
+	bool stuck = false;
+	while (played < count && !stuck && current_buffer != NULL)
+	{
+		macro_pos = 0;
+		while ((macro_pos < macro_length || pushed_key != ERR) && current_buffer != NULL)
+		{
+			int key = ch = read_key();
+			Line *line = current_buffer->current_line;
+			int cx = current_buffer->cx;
+			handle_key();
+			if (current_buffer != NULL && moving_key(key) && current_buffer->current_line == line && current_buffer->cx == cx)
+			{
+				stuck = true;
+				break;
+			}
+		}
+		played++;
+	}
+	macro_pos = -1;
+	pushed_key = ERR;
+	undo_group = 0;
+
+	snprintf(msg, sizeof(msg), "Played the macro %d time%s", played, played == 1 ? "" : "s");
+	message(msg);
+}
+
+// Start recording keys and timings to a trace file
+bool start_trace(char *trace_filename, char *filename)
+{
+	trace_file = fopen(trace_filename, "wb");
+	if (!trace_file)
+		return false;
+
+	// Buffer plenty of records so that tracing rarely has to write
+	setvbuf(trace_file, NULL, _IOFBF, 1 << 16);
+	int length = strlen(filename);
+	fwrite(TRACE_MAGIC, sizeof(char), sizeof(TRACE_MAGIC), trace_file);
+	fwrite(&length, sizeof(int), 1, trace_file);
+	fwrite(filename, sizeof(char), length, trace_file);
+	trace_time = monotonic_us();
+	return true;
+}
+
+void trace_event(int type, long long value)
+{
+	if (trace_file == NULL)
+		return;
+
+	long long now = monotonic_us();
+	Trace_record record = { now - trace_time, type, 0, value };
+	trace_time = now;
+	fwrite(&record, sizeof(Trace_record), 1, trace_file);
+}
+
+void end_trace()
+{
+	if (trace_file != NULL)
+		fclose(trace_file);
+	trace_file = NULL;
+}
+
+// Open a trace to replay without a screen, editing filename or else the file it was recorded against
+bool start_replay(char *trace_filename, char *filename)
+{
+	char magic[sizeof(TRACE_MAGIC)];
+	int length;
+	char recorded[MAX_FILENAME_LENGTH];
+
+	replay_file = fopen(trace_filename, "rb");
+	if (!replay_file)
+		return false;
+	if (fread(magic, sizeof(char), sizeof(TRACE_MAGIC), replay_file) != sizeof(TRACE_MAGIC) ||
+		memcmp(magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+		fread(&length, sizeof(int), 1, replay_file) != 1 ||
+		length < 0 || length >= MAX_FILENAME_LENGTH ||
+		fread(recorded, sizeof(char), length, replay_file) != (size_t) length)
+	{
+		fclose(replay_file);
+		replay_file = NULL;
+		return false;
+	}
+	recorded[length] = 0;
+
+	init_headless();
+	if (filename == NULL)
+		filename = recorded;
+	if (!open_file(filename))
+		new_file(filename);
+	first_buffer = current_buffer;
+	move_file_home();
+	return true;
+}
+
+// Replay a trace and print how long the keys took against the times that were recorded
+int replay_trace(char *trace_filename, char *filename)
+{
+	if (!start_replay(trace_filename, filename))
+	{
+		fprintf(stderr, "Cannot replay trace %s\n", trace_filename);
+		return 1;
+	}
+
+	int keys = 0;
+	long long total = 0;
+	long long longest = 0;
+	while (current_buffer != NULL && (ch = read_key()) != ERR)
+	{
+		long long start = monotonic_us();
+		bool running = handle_key();
+		long long time = monotonic_us() - start;
+
+		keys++;
+		total += time;
+		if (time > longest)
+			longest = time;
+		if (!running)
+			break;
+	}
+
+	// Sum the times recorded in the trace for comparison
+	long long recorded_handle = 0;
+	long long recorded_draw = 0;
+	Trace_record record;
+	fseek(replay_file, sizeof(TRACE_MAGIC), SEEK_SET);
+	int length;
+	if (fread(&length, sizeof(int), 1, replay_file) == 1)
+		fseek(replay_file, length, SEEK_CUR);
+	while (fread(&record, sizeof(Trace_record), 1, replay_file) == 1)
+	{
+		if (record.type == TRACE_HANDLE)
+			recorded_handle += record.value;
+		else if (record.type == TRACE_DRAW)
+			recorded_draw += record.value;
+	}
+	fclose(replay_file);
+	replay_file = NULL;
+
+	printf("keys\t%d\nreplay_us\t%lld\nreplay_max_us\t%lld\nrecorded_handle_us\t%lld\nrecorded_draw_us\t%lld\n", keys, total, longest, recorded_handle, recorded_draw);
+	return 0;
+}
+
+// Note the allocations made since the last frame, before drawing the next one
+void perf_frame()
+{
+	static long last_count = 0;
+	static long last_bytes = 0;
+	perf_frame_allocs = alloc_count - last_count;
+	perf_frame_bytes = alloc_bytes - last_bytes;
+	last_count = alloc_count;
+	last_bytes = alloc_bytes;
+	perf_record(PERF_ALLOCS, perf_frame_allocs);
+	perf_record(PERF_BYTES, perf_frame_bytes);
+}
+
+// Count a value in its metric's histogram, in buckets of powers of two
+void perf_record(int metric, long long value)
+{
+	int bucket = 0;
+	while (value > 0 && bucket < PERF_BUCKETS - 1)
+	{
+		value >>= 1;
+		bucket++;
+	}
+	perf_histogram[metric][bucket]++;
+}
+
+long heap_in_use()
+{
+#ifdef __GLIBC__
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+bool perf_dump(char *dump_filename)
+{
+	char *names[] = { "draw_us", "key_us", "frame_allocs", "frame_bytes" };
+	FILE *fp = fopen(dump_filename, "w");
+	if (!fp)
+		return false;
+
+	fprintf(fp, "heap_bytes %ld\n", heap_in_use());
+	for (int metric = 0; metric < PERF_METRICS; metric++)
+	{
+		fprintf(fp, "\n%s\n", names[metric]);
+		for (int bucket = 0; bucket < PERF_BUCKETS; bucket++)
+		{
+			if (perf_histogram[metric][bucket] == 0)
+				continue;
+			long low = bucket == 0 ? 0 : 1L << (bucket - 1);
+			long high = bucket == 0 ? 0 : (1L << bucket) - 1;
+			fprintf(fp, "%ld-%ld\t%ld\n", low, high, perf_histogram[metric][bucket]);
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+// Bytes used by a line and its text, adding any text shared with other lines to shared instead
+long line_memory(Line *line, long *shared)
+{
+	long text = 0;
+	if (line->storage == TEXT_SEGMENTS)
+	{
+		Long_text *t = line->long_text;
+		text = sizeof(Long_text) + t->size * (sizeof(Segment) + 2 * sizeof(Span));
+		for (int i = 0; i < t->count; i++)
+			text += t->segments[i].length;
+	}
+	else if (line->storage == TEXT_HEAP)
+		text = line->length;
+
+	if (line->node != NULL)
+		text += sizeof(Line_node);
+	// Split shared text between the lines sharing it, so it is only counted once
+	if (line->storage >= TEXT_HEAP && line->refs != NULL)
+	{
+		*shared += text / *line->refs;
+		text = 0;
+	}
+	return sizeof(Line) + text;
+}
+
+// Bytes used by a chain of lines
+long lines_memory(Line *line, long *shared)
+{
+	long bytes = 0;
+	for (; line != NULL; line = line->next)
+		bytes += line_memory(line, shared);
+	return bytes;
+}
+
+// Add a line of text to the end of a buffer being filled
+void append_line(buffer *b, char *text)
+{
+	Line *line = insert_line(b->current_line, NULL, text, strlen(text));
+	if (b->first_line == NULL)
+		b->first_line = line;
+	b->current_line = line;
+	b->last_line = line;
+	b->lines++;
+}
+
+// Start a new buffer to show the results of a command
+buffer *report_buffer(char *name)
+{
+	current_buffer = add_buffer();
+	current_buffer->filename = strdup(name);
+	return current_buffer;
+}
+
+// Open a buffer listing the memory used by each buffer, the undo marks, the paste buffer and messages
+void memory_report()
+{
+	char text[MAX_FILENAME_LENGTH + 64];
+	long shared = 0;
+	long total = 0;
+
+	// Measure before the report buffer exists
+	int count = 0;
+	for (buffer *b = first_buffer; b != NULL; b = b->next)
+		count++;
+	long *buffer_bytes = (long *) malloc(sizeof(long) * (count + 1));
+	count = 0;
+	for (buffer *b = first_buffer; b != NULL; b = b->next)
+		buffer_bytes[count++] = sizeof(buffer) + lines_memory(b->first_line, &shared);
+
+	long undo_bytes = 0;
+	int undo_marks = 0;
+	for (Undo_mark *u = undo_head; u != NULL; u = u->next)
+	{
+		undo_bytes += sizeof(Undo_mark) + u->length;
+		undo_marks++;
+	}
+	long paste_bytes = lines_memory(paste_buffer->first_line, &shared);
+
+	buffer *first = first_buffer;
+	buffer *report = report_buffer("memory.txt");
+	count = 0;
+	for (buffer *b = first; b != NULL; b = b->next)
+	{
+		if (b == report)
+			continue;
+		snprintf(text, sizeof(text), "%-40s %12ld bytes in %d lines", b->filename, buffer_bytes[count], b->lines);
+		append_line(report, text);
+		total += buffer_bytes[count++];
+	}
+	free(buffer_bytes);
+
+	snprintf(text, sizeof(text), "%-40s %12ld bytes in %d marks", "undo", undo_bytes, undo_marks);
+	append_line(report, text);
+	snprintf(text, sizeof(text), "%-40s %12ld bytes in %d lines", "paste buffer", paste_bytes, paste_buffer->lines);
+	append_line(report, text);
+	snprintf(text, sizeof(text), "%-40s %12ld bytes", "shared line text", shared);
+	append_line(report, text);
+	snprintf(text, sizeof(text), "%-40s %12ld bytes", "messages", (long) sizeof(message_ring));
+	append_line(report, text);
+	total += undo_bytes + paste_bytes + shared + sizeof(message_ring);
+	snprintf(text, sizeof(text), "%-40s %12ld bytes", "total", total);
+	append_line(report, text);
+	snprintf(text, sizeof(text), "%-40s %12ld bytes", "heap in use", heap_in_use());
+	append_line(report, text);
+
+	move_file_home();
+}
+
+// Count the words starting in some text, where space says whether the text before it ended in whitespace
+int count_words(char *text, int length, bool *space)
+{
+	int words = 0;
+	int c = 0;
+
+#ifdef __SSE2__
+	// Classify 16 bytes at a time: whitespace is ' ' or '\t' to '\r'
+	const __m128i blank = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i range = _mm_set1_epi8('\r' - '\t');
+	unsigned int carry = *space ? 1 : 0;
+	for (; c + 16 <= length; c += 16)
+	{
+		__m128i chunk = _mm_loadu_si128((__m128i *) (text + c));
+		__m128i offset = _mm_sub_epi8(chunk, tab);
+		__m128i control = _mm_cmpeq_epi8(_mm_min_epu8(offset, range), offset);
+		unsigned int spaces = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, blank), control));
+
+		// A word starts at each non-space byte which follows a space
+		unsigned int starts = ~spaces & ((spaces << 1) | carry) & 0xffff;
+		words += __builtin_popcount(starts);
+		carry = spaces >> 15;
+	}
+	*space = carry;
+#endif
+
+	for (; c < length; c++)
+	{
+		if (isspace((unsigned char) text[c]))
+			*space = true;
+		else if (*space)
+		{
+			*space = false;
+			words++;
+		}
+	}
+	return words;
+}
+
+// Recount a line which has changed or been added to a buffer, and update the buffer totals
+void update_stats(buffer *b, Line *line)
+{
+	int old_length = line->counted_length;
+	clear_stats(b, line);
+
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	if (line->storage == TEXT_SEGMENTS)
+	{
+		// Long lines are counted a segment at a time as they change, so the totals are at the root of the tree
+		Span *root = &line->long_text->tree[1];
+		line->words = root->words;
+		line->loc = root->code && !root->comment;
+	}
+	else
+	{
+		bool space = true;
+		line->words = count_words(LINE_TEXT(line), line->length, &space);
+
+		// Lines of code are those with something other than whitespace or a # comment
+		int x = 0;
+		while (x < line->length && isspace((unsigned char) LINE_TEXT(line)[x]))
+			x++;
+		line->loc = x < line->length && LINE_TEXT(line)[x] != '#';
+	}
+
+	b->words += line->words;
+	b->chars += line->length;
+	b->loc += line->loc;
+	line->counted_length = line->length;
+	if (words_indexed)
+		index_words(line);
+
+	// Columns widen as soon as a line changes, including in a scan which may already be past it.
+	// The line is counted among the widest of its columns by the scan while there is one, or by the columns shown
+	Table *t = b->table;
+	if (t != NULL)
+	{
+		if (t->scan_line != NULL)
+			widen_columns(t, &t->scan, line, true);
+		widen_columns(t, &t->shown, line, t->scan_line == NULL && !t->rescan);
+
+		// Columns past those counted can only narrow by scanning again
+		if (t->shown.count > TABLE_COUNTED_COLUMNS && line->length < old_length)
+			t->rescan = true;
+	}
+}
+
+// Take a line's counts out of a buffer's totals
+void clear_stats(buffer *b, Line *line)
+{
+	b->words -= line->words;
+	b->chars -= line->counted_length;
+	b->loc -= line->loc;
+	line->words = 0;
+	line->counted_length = 0;
+	line->loc = false;
+}
+
+// Take the counts of a line which is leaving a buffer out of its totals
+void remove_stats(buffer *b, Line *line)
+{
+	clear_stats(b, line);
+	forget_words(line);
+
+	// The columns may be narrower without this line, and the scan may have been about to read it
+	Table *t = b->table;
+	if (t != NULL)
+	{
+		if (t->scan_line != NULL)
+			forget_columns(t, &t->scan, line);
+		else if (!t->rescan)
+			forget_columns(t, &t->shown, line);
+		if (t->scan_line == line || t->shown.count > TABLE_COUNTED_COLUMNS)
+			t->rescan = true;
+	}
+}
+
+// Search the open buffers for some text, and the files under dir (if given) in the background
+void grep(char *pattern, char *dir)
+{
+	char text[MAX_FILENAME_LENGTH + 32];
+	stop_grep();
+	if (grep_pipe[0] < 0)
+	{
+		if (pipe2(grep_pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+			return;
+	}
+	snprintf(grep_pattern, sizeof(grep_pattern), "%s", pattern);
+	grep_matches = 0;
+	grep_files = 0;
+
+	// Open buffers are searched now, as they may have changed since they were read
+	if (grep_buffer != NULL)
+		close_buffer(grep_buffer);
+	buffer *first = first_buffer;
+	grep_buffer = report_buffer("grep");
+	grep_buffer->type = BUFFER_GREP;
+	if (first_buffer == NULL)
+		first_buffer = grep_buffer;
+	snprintf(text, sizeof(text), "grep %s %s", pattern, dir ? dir : "");
+	append_line(grep_buffer, text);
+	move_file_home();
+
+	for (buffer *b = first; b != NULL; b = b->next)
+	{
+		if (b->type != BUFFER_FILE)
+			continue;
+		// Files are told apart by device and inode, as the walker may reach them by another name
+		grep_skip = (struct stat *) realloc(grep_skip, sizeof(struct stat) * (grep_skip_count + 1));
+		if (stat(b->filename, &grep_skip[grep_skip_count]) == 0)
+			grep_skip_count++;
+		if (!b->loaded)
+		{
+			grep_push(strdup(b->filename));
+			continue;
+		}
+		grep_files++;
+
+		char *found = NULL;
+		size_t found_length = 0;
+		size_t found_size = 0;
+		int matches = 0;
+		int y = 1;
+		for (Line *l = b->first_line; l != NULL; l = l->next, y++)
+		{
+			bool paged = l->storage == TEXT_PAGED;
+			if (line_find(l, 0, pattern) >= 0)
+			{
+				int length = l->length < GREP_MAX_LINE ? l->length : GREP_MAX_LINE;
+				char line[GREP_MAX_LINE];
+				text_copy_out(l, 0, line, length);
+				grep_format(&found, &found_length, &found_size, b->filename, y, line, length);
+				matches++;
+			}
+			if (paged)
+				drop_text(l);
+		}
+		grep_add(found, found_length, matches);
+		free(found);
+	}
+
+	if (dir != NULL)
+	{
+		grep_walking = true;
+		pthread_create(&grep_walker, NULL, grep_walk_thread, strdup(dir));
+	}
+	else
+		grep_walked = true;
+
+	// Work on the files on as many threads as there are processors
+	grep_worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (grep_worker_count < 1)
+		grep_worker_count = 1;
+	if (grep_worker_count > GREP_THREADS)
+		grep_worker_count = GREP_THREADS;
+	grep_running = grep_worker_count;
+	for (int i = 0; i < grep_worker_count; i++)
+		pthread_create(&grep_workers[i], NULL, grep_worker, NULL);
+
+	grep_drain();
+}
+
+// Copy part of a line's text out into a plain string (which is not terminated)
+void text_copy_out(Line *line, int pos, char *dest, int length)
+{
+	int chunk_length;
+	for (int x = 0; x < length; x += chunk_length)
+	{
+		char *chunk = line_chunk(line, pos + x, &chunk_length);
+		if (chunk_length > length - x)
+			chunk_length = length - x;
+		memcpy(dest + x, chunk, chunk_length);
+	}
+}
+
+// Append a result line for a match to a file's results
+void grep_format(char **results, size_t *results_length, size_t *results_size, char *filename, int y, char *text, int length)
+{
+	char number[16];
+	int number_length = snprintf(number, sizeof(number), ":%d:", y);
+	size_t filename_length = strlen(filename);
+	size_t needed = *results_length + filename_length + number_length + length + 1;
+	if (needed > *results_size)
+	{
+		*results_size = needed * 2;
+		*results = (char *) realloc(*results, *results_size);
+	}
+
+	char *p = *results + *results_length;
+	memcpy(p, filename, filename_length);
+	memcpy(p += filename_length, number, number_length);
+	memcpy(p += number_length, text, length);
+	p[length] = '\n';
+	*results_length = needed;
+}
+
+// Add a file's result lines, waking the main loop if the results were empty (call with grep_lock held once threads run)
+void grep_add(char *text, size_t length, int matches)
+{
+	if (matches == 0)
+		return;
+	size_t needed = grep_results_length + length;
+	if (needed > grep_results_size)
+	{
+		grep_results_size = needed * 2;
+		grep_results = (char *) realloc(grep_results, grep_results_size);
+	}
+	bool was_empty = grep_results_length == 0;
+	memcpy(grep_results + grep_results_length, text, length);
+	grep_results_length = needed;
+
+	grep_matches += matches;
+	if (grep_matches >= GREP_MAX_RESULTS)
+		__atomic_store_n(&grep_cancel, true, __ATOMIC_RELAXED);
+	if (was_empty)
+		grep_wake();
+}
+
+void grep_wake()
+{
+	char c = 0;
+	if (write(grep_pipe[1], &c, 1) < 0)
+		return; // The pipe is full, so the main loop will wake anyway
+}
+
+// Queue a file to be searched, taking ownership of the name
+void grep_push(char *filename)
+{
+	pthread_mutex_lock(&grep_lock);
+	if (grep_queue_count == grep_queue_size)
+	{
+		// Move the queue back to the start of the array before growing it
+		memmove(grep_queue, grep_queue + grep_queue_head, sizeof(char *) * (grep_queue_count - grep_queue_head));
+		grep_queue_count -= grep_queue_head;
+		grep_queue_head = 0;
+		if (grep_queue_count == grep_queue_size)
+		{
+			grep_queue_size = grep_queue_size ? grep_queue_size * 2 : 1024;
+			grep_queue = (char **) realloc(grep_queue, sizeof(char *) * grep_queue_size);
+		}
+	}
+	grep_queue[grep_queue_count++] = filename;
+	pthread_cond_signal(&grep_queued);
+	pthread_mutex_unlock(&grep_lock);
+}
+
+// Queue every file under a directory, skipping hidden files and directories
+void *grep_walk_thread(void *dir)
+{
+	grep_walk((char *) dir);
+	free(dir);
+
+	pthread_mutex_lock(&grep_lock);
+	grep_walked = true;
+	pthread_cond_broadcast(&grep_queued);
+	pthread_mutex_unlock(&grep_lock);
+	return NULL;
+}
+
+void grep_walk(char *path)
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL && !__atomic_load_n(&grep_cancel, __ATOMIC_RELAXED))
+	{
+		if (entry->d_name[0] == '.')
+			continue;
+
+		char *child = (char *) malloc(strlen(path) + strlen(entry->d_name) + 2);
+		if (strcmp(path, ".") == 0)
+			strcpy(child, entry->d_name);
+		else
+			sprintf(child, "%s/%s", path, entry->d_name);
+
+		int type = entry->d_type;
+		if (type == DT_UNKNOWN)
+		{
+			struct stat st;
+			type = lstat(child, &st) != 0 ? DT_UNKNOWN : S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+		if (type == DT_DIR)
+			grep_walk(child);
+		if (type == DT_REG && !grep_skipped(child, entry->d_ino))
+			grep_push(child);
+		else
+			free(child);
+	}
+	closedir(dir);
+}
+
+// Whether a file is open in a buffer, checking the inode from its directory entry before statting it
+bool grep_skipped(char *filename, ino_t inode)
+{
+	struct stat st;
+	for (int i = 0; i < grep_skip_count; i++)
+	{
+		if (grep_skip[i].st_ino == inode && stat(filename, &st) == 0 &&
+			st.st_ino == grep_skip[i].st_ino && st.st_dev == grep_skip[i].st_dev)
+			return true;
+	}
+	return false;
+}
+
+// Search queued files until there are no more
+void *grep_worker(void *unused)
+{
+	(void) unused;
+	while (true)
+	{
+		pthread_mutex_lock(&grep_lock);
+		while (grep_queue_head == grep_queue_count && !grep_walked && !grep_cancel)
+			pthread_cond_wait(&grep_queued, &grep_lock);
+		if (grep_queue_head == grep_queue_count || grep_cancel)
+			break;
+		char *filename = grep_queue[grep_queue_head++];
+		pthread_mutex_unlock(&grep_lock);
+
+		grep_file(filename);
+		free(filename);
+	}
+
+	// The last worker to finish wakes the main loop to report the totals
+	if (--grep_running == 0)
+		grep_wake();
+	pthread_mutex_unlock(&grep_lock);
+	return NULL;
+}
+
+// Search a file through a read only mapping, collecting its matches to add to the results together
+void grep_file(char *filename)
+{
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	{
+		close(fd);
+		return;
+	}
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return;
+
+	// Leave out binary files
+	size_t size = st.st_size;
+	if (memchr(data, 0, size < 4096 ? size : 4096) != NULL)
+	{
+		munmap(data, size);
+		return;
+	}
+
+	int pattern_length = strlen(grep_pattern);
+	char *p = data;
+	char *end = data + size;
+	char *counted = data; // Lines have been counted up to here
+	int y = 1;
+	char *found = NULL;
+	size_t found_length = 0;
+	size_t found_size = 0;
+	int matches = 0;
+	char *match;
+	while (matches < GREP_MAX_RESULTS && (match = memmem(p, end - p, grep_pattern, pattern_length)) != NULL)
+	{
+		for (char *c = counted; (c = memchr(c, '\n', match - c)) != NULL; c++)
+			y++;
+
+		char *start = memrchr(data, '\n', match - data);
+		start = start ? start + 1 : data;
+		char *line_end = memchr(match, '\n', end - match);
+		if (line_end == NULL)
+			line_end = end;
+		int length = line_end - start < GREP_MAX_LINE ? line_end - start : GREP_MAX_LINE;
+		if (length > 0 && start[length - 1] == '\r')
+			length--;
+
+		grep_format(&found, &found_length, &found_size, filename, y, start, length);
+		matches++;
+
+		counted = p = line_end;
+		if (p == end)
+			break;
+	}
+	munmap(data, size);
+
+	// Take the lock once the file is searched, so its matches stay together without holding up other workers
+	if (matches > 0)
+	{
+		pthread_mutex_lock(&grep_lock);
+		grep_add(found, found_length, matches);
+		grep_files++;
+		pthread_mutex_unlock(&grep_lock);
+	}
+	free(found);
+}
+
+// Move the results found so far into the results buffer, and finish once every worker has stopped
+void grep_drain()
+{
+	char c[64];
+	while (read(grep_pipe[0], c, sizeof(c)) > 0)
+		;
+
+	pthread_mutex_lock(&grep_lock);
+	char *results = grep_results;
+	size_t length = grep_results_length;
+	grep_results = NULL;
+	grep_results_length = 0;
+	grep_results_size = 0;
+	bool finished = grep_running == 0 && grep_worker_count > 0;
+	pthread_mutex_unlock(&grep_lock);
+
+	if (grep_buffer != NULL && length > 0)
+	{
+		buffer *current = current_buffer;
+		current_buffer = grep_buffer;
+		Line *last = current_buffer->current_line;
+		while (last->next != NULL)
+			last = last->next;
+
+		Line *line = last;
+		for (char *p = results; p < results + length; )
+		{
+			char *end = memchr(p, '\n', results + length - p);
+			line = insert_line(line, NULL, p, end - p);
+			current_buffer->lines++;
+			update_stats(grep_buffer, line);
+			p = end + 1;
+		}
+		index_insert_lines(last->next, line);
+		current_buffer = current;
+	}
+	free(results);
+
+	if (finished)
+	{
+		int matches = grep_matches;
+		int files = grep_files;
+		bool cancelled = grep_cancel;
+		stop_grep();
+
+		char msg[MAX_MESSAGE_LENGTH];
+		snprintf(msg, sizeof(msg), "%d matches in %d files%s", matches, files, cancelled ? " (stopped)" : "");
+		message(msg);
+	}
+}
+
+// Stop any grep which is running and wait for its threads
+void stop_grep()
+{
+	if (grep_worker_count == 0)
+		return;
+
+	pthread_mutex_lock(&grep_lock);
+	__atomic_store_n(&grep_cancel, true, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&grep_queued);
+	pthread_mutex_unlock(&grep_lock);
+
+	if (grep_walking)
+		pthread_join(grep_walker, NULL);
+	for (int i = 0; i < grep_worker_count; i++)
+		pthread_join(grep_workers[i], NULL);
+
+	for (int i = grep_queue_head; i < grep_queue_count; i++)
+		free(grep_queue[i]);
+	free(grep_skip);
+	free(grep_results);
+	grep_skip = NULL;
+	grep_skip_count = 0;
+	grep_results = NULL;
+	grep_results_length = 0;
+	grep_results_size = 0;
+	grep_queue_head = 0;
+	grep_queue_count = 0;
+	grep_worker_count = 0;
+	grep_walking = false;
+	grep_walked = false;
+	grep_cancel = false;
+}
+
+// Open the file and line of the result on the cursor line
+void grep_jump()
+{
+	char text[MAX_FILENAME_LENGTH + 16];
+	Line *line = current_buffer->current_line;
+	int length = line->length < (int) sizeof(text) - 1 ? line->length : (int) sizeof(text) - 1;
+	text_copy_out(line, 0, text, length);
+	text[length] = 0;
+
+	// Results are filename:line:text, and the filename may have colons in it
+	char *colon = text;
+	int y = 0;
+	while ((colon = strchr(colon, ':')) != NULL)
+	{
+		char *end;
+		y = strtol(colon + 1, &end, 10);
+		if (end > colon + 1 && *end == ':')
+			break;
+		colon++;
+	}
+	if (colon == NULL || y <= 0)
+		return;
+	*colon = 0;
+
+	buffer *b = first_buffer;
+	while (b != NULL && (b->type != BUFFER_FILE || strcmp(b->filename, text) != 0))
+		b = b->next;
+	if (b == NULL)
+	{
+		if (!open_lazy(text))
+			return;
+		b = current_buffer;
+	}
+	switch_buffer(b);
+	goto_line(y);
+
+	int x = line_find(current_buffer->current_line, 0, grep_pattern);
+	if (x > 0)
+	{
+		current_buffer->cx = x;
+		check_boundx();
+	}
+}
+
+// Compare the text of two lines byte by byte
+int compare_lines(Line *a, Line *b)
+{
+	if (a->storage == TEXT_PAGED)
+		page_in(a);
+	if (b->storage == TEXT_PAGED)
+		page_in(b);
+	int length = a->length < b->length ? a->length : b->length;
+	if (a->storage != TEXT_SEGMENTS && b->storage != TEXT_SEGMENTS)
+	{
+		int result = length > 0 ? memcmp(LINE_TEXT(a), LINE_TEXT(b), length) : 0;
+		if (result != 0)
+			return result;
+	}
+	else
+	{
+		for (int x = 0; x < length; x++)
+		{
+			unsigned char ca = line_char(a, x);
+			unsigned char cb = line_char(b, x);
+			if (ca != cb)
+				return ca - cb;
+		}
+	}
+	return a->length - b->length;
+}
+
+// Order two lines by the sort options, falling back on their text when the numbers are the same
+// (except when removing duplicates, as sort -nu keeps the first line with each number)
+int compare_items(Sort_item *a, Sort_item *b)
+{
+	int result = 0;
+	if (sort_numeric)
+		result = compare_numbers(a, b);
+	if (result == 0 && !(sort_numeric && sort_unique))
+		result = compare_lines(a->line, b->line);
+	return sort_reverse ? -result : result;
+}
+
+// Merge the sorted runs items[0..mid) and items[mid..n) through tmp, keeping equal lines in order
+void merge_items(Sort_item *items, Sort_item *tmp, int mid, int n)
+{
+	int i = 0;
+	int j = mid;
+	int k = 0;
+	while (i < mid && j < n)
+		tmp[k++] = compare_items(&items[j], &items[i]) < 0 ? items[j++] : items[i++];
+	while (i < mid)
+		tmp[k++] = items[i++];
+	while (j < n)
+		tmp[k++] = items[j++];
+	memcpy(items, tmp, sizeof(Sort_item) * n);
+}
+
+void merge_sort_items(Sort_item *items, Sort_item *tmp, int n)
+{
+	if (n < 2)
+		return;
+	int mid = n / 2;
+	merge_sort_items(items, tmp, mid);
+	merge_sort_items(items + mid, tmp + mid, n - mid);
+	merge_items(items, tmp, mid, n);
+}
+
+void *sort_thread(void *task)
+{
+	Sort_task *t = (Sort_task *) task;
+	if (t->mid == 0)
+		merge_sort_items(t->items, t->tmp, t->n);
+	else
+		merge_items(t->items, t->tmp, t->mid, t->n);
+	return NULL;
+}
+
+// Sort items with a merge sort, splitting the work over threads when there are many
+void sort_items(Sort_item *items, int n)
+{
+	Sort_item *tmp = (Sort_item *) malloc(sizeof(Sort_item) * (n > 0 ? n : 1));
+	int runs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (runs > SORT_THREADS)
+		runs = SORT_THREADS;
+	if (n < SORT_PARALLEL_LINES || runs < 2)
+	{
+		merge_sort_items(items, tmp, n);
+		free(tmp);
+		return;
+	}
+
+	// Sort a run on each thread
+	pthread_t thread[SORT_THREADS];
+	Sort_task task[SORT_THREADS];
+	int start[SORT_THREADS + 1];
+	for (int i = 0; i <= runs; i++)
+		start[i] = (long) n * i / runs;
+	for (int i = 0; i < runs; i++)
+	{
+		task[i] = (Sort_task) { items + start[i], tmp + start[i], start[i + 1] - start[i], 0 };
+		pthread_create(&thread[i], NULL, sort_thread, &task[i]);
+	}
+	for (int i = 0; i < runs; i++)
+		pthread_join(thread[i], NULL);
+
+	// Then merge pairs of runs on threads until there is only one
+	while (runs > 1)
+	{
+		int tasks = 0;
+		for (int i = 0; i + 1 < runs; i += 2, tasks++)
+		{
+			task[tasks] = (Sort_task) { items + start[i], tmp + start[i], start[i + 2] - start[i], start[i + 1] - start[i] };
+			pthread_create(&thread[tasks], NULL, sort_thread, &task[tasks]);
+		}
+		for (int i = 0; i < tasks; i++)
+			pthread_join(thread[i], NULL);
+
+		int merged = 0;
+		for (int i = 0; i < runs; i += 2)
+			start[merged++] = start[i];
+		start[merged] = n;
+		runs = merged;
+	}
+	free(tmp);
+}
+
+// Compare the numbers at the start of two lines. Their values decide, unless they are too close for a double to tell
+// apart, when the digits are compared
+int compare_numbers(Sort_item *a, Sort_item *b)
+{
+	if (a->number != b->number)
+		return a->number < b->number ? -1 : 1;
+
+	int a_start, a_point, a_end;
+	int b_start, b_point, b_end;
+	bool a_negative = number_parts(a->line, &a_start, &a_point, &a_end);
+	bool b_negative = number_parts(b->line, &b_start, &b_point, &b_end);
+	if (a_negative != b_negative)
+		return a_negative ? -1 : 1;
+
+	// More digits before the point is bigger, then the first digit which differs
+	int result = (a_point - a_start) - (b_point - b_start);
+	for (int i = 0; result == 0 && i < a_point - a_start; i++)
+		result = line_char(a->line, a_start + i) - line_char(b->line, b_start + i);
+	for (int i = 1; result == 0 && (a_point + i < a_end || b_point + i < b_end); i++)
+	{
+		char ca = a_point + i < a_end ? line_char(a->line, a_point + i) : '0';
+		char cb = b_point + i < b_end ? line_char(b->line, b_point + i) : '0';
+		result = ca - cb;
+	}
+	result = (result > 0) - (result < 0);
+	return a_negative ? -result : result;
+}
+
+// Find the digits of the number at the start of a line: where those before the point start (after any leading zeros)
+// and end, and where those after it end (before any trailing zeros). Returns whether it is below zero
+bool number_parts(Line *line, int *start, int *point, int *end)
+{
+	int x = 0;
+	while (line_char(line, x) == ' ' || line_char(line, x) == '\t')
+		x++;
+	bool negative = line_char(line, x) == '-';
+	if (negative)
+		x++;
+	while (line_char(line, x) == '0')
+		x++;
+	*start = x;
+	while (isdigit((unsigned char) line_char(line, x)))
+		x++;
+	*point = x;
+	*end = x;
+	if (line_char(line, x) == '.')
+	{
+		for (x++; isdigit((unsigned char) line_char(line, x)); x++)
+			if (line_char(line, x) != '0')
+				*end = x + 1;
+	}
+	return negative && (*point > *start || *end > *point); // -0 is 0
+}
+
+// The number at the start of a line, or 0 if there is none
+double line_number_value(Line *line)
+{
+	// As sort -n reads it: blanks, an optional minus sign, then digits with at most one decimal point.
+	// No plus sign, exponent, hex or inf/nan, so those lines count as 0 (and are then compared as text)
+	int x = 0;
+	while (line_char(line, x) == ' ' || line_char(line, x) == '\t')
+		x++;
+
+	char text[64];
+	int n = 0;
+	int extra = 0; // Digits before the point which did not fit
+	bool point = false;
+	if (line_char(line, x) == '-')
+		text[n++] = line_char(line, x++);
+	for (;; x++)
+	{
+		char c = line_char(line, x);
+		if (c == '.' && !point)
+			point = true;
+		else if (!isdigit((unsigned char) c))
+			break;
+		if (n < (int) sizeof(text) - 1)
+			text[n++] = c;
+		else if (!point)
+			extra++;
+	}
+	text[n] = 0;
+
+	double number = strtod(text, NULL);
+	for (; extra > 0; extra--)
+		number *= 10;
+	return number;
+}
+
+// Put n lines in order between before and after, which stay where they are
+void relink_lines(Line *before, Line *after, Line **lines, int n)
+{
+	Line *prev = before;
+	for (int i = 0; i < n; i++)
+	{
+		lines[i]->prev = prev;
+		if (prev != NULL)
+			prev->next = lines[i];
+		else
+			current_buffer->first_line = lines[i];
+		prev = lines[i];
+	}
+	prev->next = after;
+	if (after != NULL)
+		after->prev = prev;
+	lines_moved(lines[0]);
+}
+
+// Drop the index and the lexer states from a line on, which no longer follow the lines after a reordering
+void lines_moved(Line *line)
+{
+	free_index(current_buffer);
+	current_buffer->last_line = NULL;
+	current_buffer->page_line = NULL;
+	if (current_buffer->table != NULL && current_buffer->table->scan_line != NULL)
+		current_buffer->table->rescan = true; // Lines not yet scanned may have moved before the scan
+	for (Line *l = line; l != NULL; l = l->next)
+		l->hl_valid = false;
+}
+
+// Sort the selected lines, or the whole buffer, by relinking them, and return how many duplicates were removed
+int sort_lines()
+{
+	Line *first = current_buffer->first_line;
+	int start_y = 0;
+	int n = current_buffer->lines;
+	if (current_buffer->select_mark.line != NULL)
+	{
+		Select_mark select_start, select_end;
+		get_select_extents(current_buffer, &select_start, &select_end);
+		first = select_start.line;
+		start_y = select_start.y;
+		n = select_end.y - select_start.y + 1;
+
+		// A selection ending at the start of a line leaves that line out
+		if (select_end.x == 0 && n > 1)
+			n--;
+		clear_mark(current_buffer);
+	}
+
+	Sort_item *items = (Sort_item *) malloc(sizeof(Sort_item) * n);
+	Line *line = first;
+	for (int i = 0; i < n; i++, line = line->next)
+	{
+		// Paged out lines are read back here, as the sort threads cannot do it
+		if (line->storage == TEXT_PAGED)
+			page_in(line);
+		items[i].line = line;
+		items[i].index = i;
+		items[i].number = sort_numeric ? line_number_value(line) : 0;
+	}
+	Line *before = first->prev;
+	Line *after = line;
+	sort_items(items, n);
+
+	// Keep the first of each run of equal lines, and hold on to the rest for undo
+	Line **lines = (Line **) malloc(sizeof(Line *) * n);
+	int *order = (int *) malloc(sizeof(int) * n);
+	int kept = 0;
+	int removed = 0;
+	Line *removed_first = NULL;
+	Line *removed_last = NULL;
+	int *removed_order = (int *) malloc(sizeof(int) * n);
+	for (int i = 0; i < n; i++)
+	{
+		Sort_item *item = &items[i];
+		if (sort_unique && kept > 0 && (sort_numeric ? compare_numbers(item, &items[kept - 1]) == 0 : compare_lines(item->line, items[kept - 1].line) == 0))
+		{
+			remove_stats(current_buffer, item->line);
+			item->line->prev = removed_last;
+			item->line->next = NULL;
+			if (removed_last != NULL)
+				removed_last->next = item->line;
+			else
+				removed_first = item->line;
+			removed_last = item->line;
+			removed_order[removed++] = item->index;
+			continue;
+		}
+		items[kept] = *item;
+		lines[kept] = item->line;
+		order[kept++] = item->index;
+	}
+	memcpy(order + kept, removed_order, sizeof(int) * removed);
+	free(removed_order);
+	free(items);
+
+	relink_lines(before, after, lines, kept);
+	current_buffer->lines -= removed;
+	free(lines);
+
+	// Undo puts the lines back by where each one came from
+	push_undo(1, start_y, UNDO_SORT, (char *) order, sizeof(int) * n);
+	undo_head->lines = kept;
+	undo_head->removed = removed_first;
+	free(order);
+
+	current_buffer->modified = true;
+	goto_line(start_y + 1);
+	return removed;
+}
+
+// Put sorted lines back in their original order, along with any duplicates which were removed
+void unsort_lines(Undo_mark *mark)
+{
+	int *order = (int *) mark->text;
+	int n = mark->length / sizeof(int);
+	Line **lines = (Line **) malloc(sizeof(Line *) * n);
+
+	Line *line = current_buffer->current_line;
+	Line *before = line->prev;
+	for (int i = 0; i < mark->lines; i++, line = line->next)
+		lines[order[i]] = line;
+	Line *after = line;
+	int i = mark->lines;
+	for (line = mark->removed; line != NULL; line = line->next)
+		lines[order[i++]] = line;
+
+	relink_lines(before, after, lines, n);
+	for (i = mark->lines; i < n; i++)
+	{
+		current_buffer->lines++;
+		update_stats(current_buffer, lines[order[i]]);
+	}
+	free(lines);
+	goto_line(mark->y + 1);
+}
+
+// Swap n lines starting at first for a chain of new lines, returning the old ones as a chain of their own
+Line *replace_lines(Line *first, int n, Line *chain, int chain_lines)
+{
+	Line *last = first;
+	for (int i = 1; i < n; i++)
+		last = last->next;
+	Line *before = first->prev;
+	Line *after = last->next;
+	for (Line *l = first; l != after; l = l->next)
+		remove_stats(current_buffer, l);
+	first->prev = NULL;
+	last->next = NULL;
+
+	Line *chain_last = chain;
+	update_stats(current_buffer, chain);
+	while (chain_last->next != NULL)
+	{
+		chain_last = chain_last->next;
+		update_stats(current_buffer, chain_last);
+	}
+	chain->prev = before;
+	if (before != NULL)
+		before->next = chain;
+	else
+		current_buffer->first_line = chain;
+	chain_last->next = after;
+	if (after != NULL)
+		after->prev = chain_last;
+
+	current_buffer->lines += chain_lines - n;
+	lines_moved(chain);
+	return first;
+}
+
+// Run the selected lines (or the whole buffer) through a shell command and replace them with its output.
+// The lines are written to the command and its output read back at the same time, a buffer at a time,
+// so neither side waits on a full pipe and the text is never gathered up in one piece
+bool filter_lines(char *command)
+{
+	char msg[MAX_MESSAGE_LENGTH];
+	Line *first = current_buffer->first_line;
+	int start_y = 0;
+	int n = current_buffer->lines;
+	if (current_buffer->select_mark.line != NULL)
+	{
+		Select_mark select_start, select_end;
+		get_select_extents(current_buffer, &select_start, &select_end);
+		first = select_start.line;
+		start_y = select_start.y;
+		n = select_end.y - select_start.y + 1;
+		if (select_end.x == 0 && n > 1)
+			n--;
+	}
+
+	int to_child[2];
+	int from_child[2];
+	if (pipe2(to_child, O_CLOEXEC) != 0)
+		return false;
+	if (pipe2(from_child, O_CLOEXEC) != 0)
+	{
+		close(to_child[0]);
+		close(to_child[1]);
+		return false;
+	}
+
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		setpgid(0, 0); // So stopping the command stops everything it started
+		dup2(to_child[0], STDIN_FILENO);
+		dup2(from_child[1], STDOUT_FILENO);
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDERR_FILENO);
+		execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+		_exit(127);
+	}
+	close(to_child[0]);
+	close(from_child[1]);
+	if (pid < 0)
+	{
+		close(to_child[1]);
+		close(from_child[0]);
+		return false;
+	}
+	setpgid(pid, pid); // As well as in the child, so the group exists whichever runs first
+
+	// A command which stops reading early must not kill the editor
+	void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+	int in = to_child[1];
+	int out = from_child[0];
+	fcntl(in, F_SETFL, O_NONBLOCK);
+	fcntl(out, F_SETFL, O_NONBLOCK);
+
+	char *in_buffer = (char *) malloc(FILTER_BUFFER);
+	char *out_buffer = (char *) malloc(FILTER_BUFFER);
+	int in_start = 0;
+	int in_end = 0;
+	Line *in_line = first;
+	int in_x = 0;
+	int in_lines = n;
+
+	Line *chain = NULL;
+	Line *chain_last = NULL;
+	int chain_lines = 0;
+	bool partial = false;
+	long output_length = 0;
+	bool stopped = false;
+	bool too_long = false;
+	long long checked = monotonic_us();
+
+	while (out >= 0)
+	{
+		struct pollfd fds[2] = { { out, POLLIN, 0 }, { in, POLLOUT, 0 } };
+		int ready = poll(fds, in >= 0 ? 2 : 1, FILTER_POLL_TIME);
+		if (ready < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		// Check for ESC between waits, and as often even while the command keeps the pipes busy
+		if (ready == 0 || monotonic_us() - checked > FILTER_POLL_TIME * 1000)
+		{
+			checked = monotonic_us();
+			if (escape_pending())
+			{
+				stopped = true;
+				break;
+			}
+		}
+
+		if (in >= 0 && fds[1].revents)
+		{
+			// Refill the buffer from the lines, with a newline after each
+			if (in_start == in_end)
+			{
+				in_start = in_end = 0;
+				while (in_lines > 0 && in_end < FILTER_BUFFER)
+				{
+					if (in_x < in_line->length)
+					{
+						int length;
+						char *chunk = line_chunk(in_line, in_x, &length);
+						if (length > FILTER_BUFFER - in_end)
+							length = FILTER_BUFFER - in_end;
+						memcpy(in_buffer + in_end, chunk, length);
+						in_end += length;
+						in_x += length;
+					}
+					else
+					{
+						in_buffer[in_end++] = '\n';
+						in_line = in_line->next;
+						in_x = 0;
+						in_lines--;
+					}
+				}
+			}
+
+			ssize_t written = in_start < in_end ? write(in, in_buffer + in_start, in_end - in_start) : 0;
+			if (written > 0)
+				in_start += written;
+			if ((written < 0 && errno != EAGAIN) || (in_start == in_end && in_lines == 0))
+			{
+				close(in);
+				in = -1;
+			}
+		}
+
+		if (fds[0].revents)
+		{
+			ssize_t length = read(out, out_buffer, FILTER_BUFFER);
+			if (length < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if (length <= 0)
+			{
+				close(out);
+				out = -1;
+				break;
+			}
+
+			// Split the output into lines, carrying on a line left partial by the last read
+			for (char *p = out_buffer; p < out_buffer + length; )
+			{
+				char *end = memchr(p, '\n', out_buffer + length - p);
+				int line_length = (end ? end : out_buffer + length) - p;
+				if (partial)
+					text_insert(chain_last, chain_last->length, p, line_length);
+				else
+				{
+					chain_last = insert_line(chain_last, NULL, p, line_length);
+					if (chain == NULL)
+						chain = chain_last;
+					chain_lines++;
+				}
+				partial = end == NULL;
+				p += line_length + 1;
+			}
+
+			// Count each line's own size too, as output of short lines takes far more memory than its bytes
+			output_length += length;
+			if (output_length + (long) chain_lines * sizeof(Line) > FILTER_MAX_OUTPUT)
+			{
+				too_long = true;
+				break;
+			}
+		}
+	}
+	if (in >= 0)
+		close(in);
+	if (out >= 0)
+		close(out);
+	free(in_buffer);
+	free(out_buffer);
+
+	int status;
+	if (stopped || too_long)
+		kill(-pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	signal(SIGPIPE, old_sigpipe);
+
+	if (stopped || too_long || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		delete_lines(chain);
+		if (stopped)
+			snprintf(msg, sizeof(msg), "Command stopped, nothing changed");
+		else if (too_long)
+			snprintf(msg, sizeof(msg), "Command output too large (over %ld MB), nothing changed", FILTER_MAX_OUTPUT >> 20);
+		else
+			snprintf(msg, sizeof(msg), "Command failed, nothing changed");
+		message(msg);
+		return false;
+	}
+
+	// No output still leaves a line in place of the old ones
+	if (chain == NULL)
+	{
+		chain = insert_line(NULL, NULL, NULL, 0);
+		chain_lines = 1;
+	}
+
+	clear_mark(current_buffer);
+	Line *old = replace_lines(first, n, chain, chain_lines);
+	push_undo(1, start_y, UNDO_FILTER, NULL, 0);
+	undo_head->lines = chain_lines;
+	undo_head->removed = old;
+	current_buffer->modified = true;
+	goto_line(start_y + 1);
+
+	snprintf(msg, sizeof(msg), "%d lines filtered into %d", n, chain_lines);
+	message(msg);
+	return true;
+}
+
+// Hash a line's text (FNV-1a)
+unsigned long hash_line(Line *line)
+{
+	unsigned long hash = 14695981039346656037UL;
+	int length;
+	for (int x = 0; x < line->length; x += length)
+	{
+		char *chunk = line_chunk(line, x, &length);
+		for (int i = 0; i < length; i++)
+			hash = (hash ^ (unsigned char) chunk[i]) * 1099511628211UL;
+	}
+	return hash;
+}
+
+// Number the lines of both sides, hashing each line once, so that equal lines get the same number
+void diff_number_lines(Line *a, int a_lines, Line *b, int b_lines)
+{
+	int size = 1;
+	while (size < (a_lines + b_lines) * 2)
+		size *= 2;
+	Line **table = (Line **) calloc(size, sizeof(Line *));
+	unsigned long *hashes = (unsigned long *) malloc(sizeof(unsigned long) * size);
+
+	for (int side = 0; side < 2; side++)
+	{
+		Line *line = side == 0 ? a : b;
+		int *numbers = side == 0 ? diff_a : diff_b;
+		for (int i = 0; line != NULL; i++, line = line->next)
+		{
+			bool paged = line->storage == TEXT_PAGED;
+			unsigned long hash = hash_line(line);
+			int slot = hash & (size - 1);
+			while (table[slot] != NULL && (hashes[slot] != hash || compare_lines(table[slot], line) != 0))
+				slot = (slot + 1) & (size - 1);
+			if (table[slot] == NULL)
+			{
+				table[slot] = line;
+				hashes[slot] = hash;
+			}
+			numbers[i] = slot;
+			if (paged)
+				drop_text(line);
+		}
+	}
+	free(table);
+	free(hashes);
+}
+
+// Find where a shortest edit script between a[xoff..xlim) and b[yoff..ylim) crosses the middle,
+// searching forwards and backwards at once as in Myers' linear space algorithm
+void diff_middle(int xoff, int xlim, int yoff, int ylim, int *middle_x, int *middle_y)
+{
+	int *fd = diff_forward;
+	int *bd = diff_backward;
+	int dmin = xoff - ylim;
+	int dmax = xlim - yoff;
+	int fmid = xoff - yoff;
+	int bmid = xlim - ylim;
+	int fmin = fmid;
+	int fmax = fmid;
+	int bmin = bmid;
+	int bmax = bmid;
+	bool odd = (fmid - bmid) & 1;
+	fd[fmid] = xoff;
+	bd[bmid] = xlim;
+
+	for (int cost = 1; ; cost++)
+	{
+		if (diff_escaped())
+		{
+			*middle_x = xoff;
+			*middle_y = yoff;
+			return;
+		}
+
+		// Extend the forward paths by one edit
+		if (fmin > dmin)
+			fd[--fmin - 1] = -1;
+		else
+			fmin++;
+		if (fmax < dmax)
+			fd[++fmax + 1] = -1;
+		else
+			fmax--;
+		for (int d = fmax; d >= fmin; d -= 2)
+		{
+			int x = fd[d - 1] >= fd[d + 1] ? fd[d - 1] + 1 : fd[d + 1];
+			int y = x - d;
+			while (x < xlim && y < ylim && diff_a[x] == diff_b[y])
+				x++, y++;
+			fd[d] = x;
+			if (odd && bmin <= d && d <= bmax && bd[d] <= x)
+			{
+				*middle_x = x;
+				*middle_y = y;
+				return;
+			}
+		}
+
+		// And the backward paths
+		if (bmin > dmin)
+			bd[--bmin - 1] = INT_MAX;
+		else
+			bmin++;
+		if (bmax < dmax)
+			bd[++bmax + 1] = INT_MAX;
+		else
+			bmax--;
+		for (int d = bmax; d >= bmin; d -= 2)
+		{
+			int x = bd[d - 1] < bd[d + 1] ? bd[d - 1] : bd[d + 1] - 1;
+			int y = x - d;
+			while (x > xoff && y > yoff && diff_a[x - 1] == diff_b[y - 1])
+				x--, y--;
+			bd[d] = x;
+			if (!odd && fmin <= d && d <= fmax && x <= fd[d])
+			{
+				*middle_x = x;
+				*middle_y = y;
+				return;
+			}
+		}
+
+		// Very different inputs would take quadratic time, so past a limit split
+		// at whichever of the forward and backward paths has got furthest
+		if (cost >= diff_cost_limit)
+		{
+			int forward_best = -1;
+			int forward_x = xoff;
+			for (int d = fmax; d >= fmin; d -= 2)
+			{
+				int x = fd[d] < xlim ? fd[d] : xlim;
+				int y = x - d;
+				if (y > ylim)
+				{
+					x = ylim + d;
+					y = ylim;
+				}
+				if (x + y > forward_best)
+				{
+					forward_best = x + y;
+					forward_x = x;
+				}
+			}
+			int backward_best = INT_MAX;
+			int backward_x = xlim;
+			for (int d = bmax; d >= bmin; d -= 2)
+			{
+				int x = bd[d] > xoff ? bd[d] : xoff;
+				int y = x - d;
+				if (y < yoff)
+				{
+					x = yoff + d;
+					y = yoff;
+				}
+				if (x + y < backward_best)
+				{
+					backward_best = x + y;
+					backward_x = x;
+				}
+			}
+			if ((xlim + ylim) - backward_best < forward_best - (xoff + yoff))
+			{
+				*middle_x = forward_x;
+				*middle_y = forward_best - forward_x;
+			}
+			else
+			{
+				*middle_x = backward_x;
+				*middle_y = backward_best - backward_x;
+			}
+			return;
+		}
+	}
+}
+
+// Check for ESC every so often while comparing, so that a long diff can be abandoned
+bool diff_escaped()
+{
+	if (!diff_stopped && monotonic_us() - diff_checked > DIFF_KEY_CHECK_TIME * 1000)
+	{
+		diff_checked = monotonic_us();
+		diff_stopped = escape_pending();
+	}
+	return diff_stopped;
+}
+
+// Mark the lines of a[xoff..xlim) and b[yoff..ylim) which are not in a longest common subsequence
+void diff_compare(int xoff, int xlim, int yoff, int ylim)
+{
+	if (diff_stopped)
+		return;
+	while (xoff < xlim && yoff < ylim && diff_a[xoff] == diff_b[yoff])
+		xoff++, yoff++;
+	while (xlim > xoff && ylim > yoff && diff_a[xlim - 1] == diff_b[ylim - 1])
+		xlim--, ylim--;
+
+	if (xoff == xlim)
+		while (yoff < ylim)
+			diff_changed_b[yoff++] = true;
+	else if (yoff == ylim)
+		while (xoff < xlim)
+			diff_changed_a[xoff++] = true;
+	else
+	{
+		int x, y;
+		diff_middle(xoff, xlim, yoff, ylim, &x, &y);
+		diff_compare(xoff, x, yoff, y);
+		diff_compare(x, xlim, y, ylim);
+	}
+}
+
+// Add a line of the diff: a prefix character and the text of a line
+void append_diff_line(buffer *b, char prefix, Line *line)
+{
+	char *text = (char *) malloc(line->length + 2);
+	text[0] = prefix;
+	text_copy_out(line, 0, text + 1, line->length);
+	text[line->length + 1] = 0;
+	append_line(b, text);
+	free(text);
+}
+
+// Compare the current buffer with another open buffer, or a file, and show the differences in a diff buffer
+bool diff(char *name)
+{
+	char text[MAX_FILENAME_LENGTH * 2];
+	buffer *a = current_buffer;
+
+	// Prefer an open buffer of that name, unless it is this one (then compare with the file as saved)
+	buffer *b = first_buffer;
+	while (b != NULL && (b == a || b->type != BUFFER_FILE || strcmp(b->filename, name) != 0))
+		b = b->next;
+	buffer *file = NULL;
+	if (b == NULL || !b->loaded)
+	{
+		FILE *fp = fopen(name, "r");
+		if (!fp)
+			return false;
+		file = add_sbuffer();
+		current_buffer = file;
+		read_lines(fp, NULL);
+		fclose(fp);
+		current_buffer = a;
+		b = file;
+	}
+
+	// Against its own file as saved, the file is the old side and the buffer the new
+	if (file != NULL && strcmp(name, a->filename) == 0)
+	{
+		b = a;
+		a = file;
+	}
+
+	int n = a->lines;
+	int m = b->lines;
+	diff_a = (int *) malloc(sizeof(int) * (n + 1));
+	diff_b = (int *) malloc(sizeof(int) * (m + 1));
+	diff_changed_a = (bool *) calloc(n + 1, sizeof(bool));
+	diff_changed_b = (bool *) calloc(m + 1, sizeof(bool));
+	int *diagonals = (int *) malloc(sizeof(int) * 2 * (n + m + 3));
+	diff_forward = diagonals + m + 1;
+	diff_backward = diagonals + (n + m + 3) + m + 1;
+
+	// Search about the square root of the size of the inputs before cutting the search short
+	diff_cost_limit = 1;
+	for (int diagonals = n + m + 3; diagonals != 0; diagonals >>= 2)
+		diff_cost_limit <<= 1;
+	if (diff_cost_limit < DIFF_MIN_COST_LIMIT)
+		diff_cost_limit = DIFF_MIN_COST_LIMIT;
+
+	diff_number_lines(a->first_line, n, b->first_line, m);
+	diff_stopped = false;
+	diff_checked = monotonic_us();
+	diff_compare(0, n, 0, m);
+	free(diagonals);
+	free(diff_a);
+	free(diff_b);
+
+	if (diff_stopped)
+	{
+		free(diff_changed_a);
+		free(diff_changed_b);
+		if (file != NULL)
+		{
+			delete_lines(file->first_line);
+			close_pages(file);
+			free(file);
+		}
+		message("Diff stopped");
+		return true;
+	}
+
+	// Lines of each side by number, for writing out the hunks
+	Line **a_lines = (Line **) malloc(sizeof(Line *) * (n + 1));
+	Line **b_lines = (Line **) malloc(sizeof(Line *) * (m + 1));
+	Line *line = a->first_line;
+	for (int i = 0; i < n; i++, line = line->next)
+		a_lines[i] = line;
+	line = b->first_line;
+	for (int j = 0; j < m; j++, line = line->next)
+		b_lines[j] = line;
+
+	buffer *report = report_buffer("diff");
+	report->type = BUFFER_DIFF;
+	snprintf(text, sizeof(text), "--- %s (%s)", a == file ? name : a->filename, a == file ? "saved" : "buffer");
+	append_line(report, text);
+	snprintf(text, sizeof(text), "+++ %s (%s)", b == file ? name : b->filename, b == file ? "saved" : "buffer");
+	append_line(report, text);
+
+	// Write unified hunks, joining changes with no more than twice the context between them
+	int i = 0;
+	int j = 0;
+	int hunks = 0;
+	while (true)
+	{
+		while (i < n && j < m && !diff_changed_a[i] && !diff_changed_b[j])
+			i++, j++;
+		if (i >= n && j >= m)
+			break;
+
+		int context = i < DIFF_CONTEXT ? i : DIFF_CONTEXT;
+		int start_i = i - context;
+		int start_j = j - context;
+		int end_i, end_j;
+		while (true)
+		{
+			while (i < n && diff_changed_a[i])
+				i++;
+			while (j < m && diff_changed_b[j])
+				j++;
+			int same = 0;
+			while (i + same < n && j + same < m && !diff_changed_a[i + same] && !diff_changed_b[j + same])
+				same++;
+			if (same <= DIFF_CONTEXT * 2 && (i + same < n || j + same < m))
+			{
+				i += same;
+				j += same;
+				continue;
+			}
+			end_i = i + (same < DIFF_CONTEXT ? same : DIFF_CONTEXT);
+			end_j = j + (same < DIFF_CONTEXT ? same : DIFF_CONTEXT);
+			break;
+		}
+
+		snprintf(text, sizeof(text), "@@ -%d,%d +%d,%d @@", end_i > start_i ? start_i + 1 : start_i, end_i - start_i,
+			end_j > start_j ? start_j + 1 : start_j, end_j - start_j);
+		append_line(report, text);
+		for (int x = start_i, y = start_j; x < end_i || y < end_j; )
+		{
+			if (x < end_i && diff_changed_a[x])
+				append_diff_line(report, '-', a_lines[x++]);
+			else if (y < end_j && diff_changed_b[y])
+				append_diff_line(report, '+', b_lines[y++]);
+			else
+			{
+				append_diff_line(report, ' ', a_lines[x++]);
+				y++;
+			}
+		}
+		hunks++;
+		i = end_i;
+		j = end_j;
+	}
+
+	free(a_lines);
+	free(b_lines);
+	free(diff_changed_a);
+	free(diff_changed_b);
+	if (file != NULL)
+	{
+		delete_lines(file->first_line);
+		close_pages(file);
+		free(file);
+	}
+
+	move_file_home();
+	next_hunk(1);
+	snprintf(text, sizeof(text), hunks ? "%d hunks, F8 and F7 move between them" : "No differences", hunks);
+	message(text);
+	return true;
+}
+
+// Move the cursor to the next (or previous) hunk header of a diff
+void next_hunk(int direction)
 {
-	b->select_mark.line = NULL;
-	b->select_mark.x = 0;
-	b->select_mark.y = 0;
+	int y = current_buffer->cy + current_buffer->offsety;
+	for (Line *line = current_buffer->current_line; line != NULL; line = direction > 0 ? line->next : line->prev, y += direction)
+	{
+		if (line != current_buffer->current_line && line->length >= 2 && line_char(line, 0) == '@' && line_char(line, 1) == '@')
+		{
+			goto_line(y + 1);
+			return;
+		}
+	}
 }
 
-void get_select_extents(buffer *b, Select_mark *start, Select_mark *end)
+// Open the compared buffer at the line of the diff under the cursor
+void diff_jump()
 {
-	if ((b->cy + b->offsety < b->select_mark.y) || ((b->cy + b->offsety == b->select_mark.y) && (b->cx < b->select_mark.x)))
+	// The headers label each side, and the old side is gone to unless it is a file as saved
+	char name[MAX_FILENAME_LENGTH + 16];
+	char side = 0;
+	Line *line = current_buffer->first_line;
+	for (int i = 0; i < 2 && line != NULL && side == 0; i++, line = line->next)
 	{
-		start->x = b->cx;
-		start->y = b->cy + b->offsety ;
-		start->line = b->current_line;
-		end->x = b->select_mark.x;
-		end->y = b->select_mark.y;
-		end->line = b->select_mark.line;
+		int length = line->length < (int) sizeof(name) - 1 ? line->length : (int) sizeof(name) - 1;
+		text_copy_out(line, 0, name, length);
+		name[length] = 0;
+		char *label = strrchr(name, ' ');
+		if (length > 4 && (strncmp(name, "--- ", 4) == 0 || strncmp(name, "+++ ", 4) == 0) &&
+			label != NULL && strcmp(label, " (buffer)") == 0)
+		{
+			*label = 0;
+			side = name[0];
+		}
 	}
-	else
+	if (side == 0)
+		return;
+
+	// Count that side's lines back to the hunk header
+	int offset = 0;
+	line = current_buffer->current_line;
+	for (; line != NULL && !(line->length >= 2 && line_char(line, 0) == '@' && line_char(line, 1) == '@'); line = line->prev)
 	{
-		start->x = b->select_mark.x;
-		start->y = b->select_mark.y;
-		start->line = b->select_mark.line;
-		end->x = b->cx;
-		end->y = b->cy + b->offsety ;
-		end->line = b->current_line;
+		if (line != current_buffer->current_line && line_char(line, 0) != (side == '-' ? '+' : '-'))
+			offset++;
 	}
+	if (line == NULL)
+		return;
+
+	char text[64];
+	int length = line->length < (int) sizeof(text) - 1 ? line->length : (int) sizeof(text) - 1;
+	text_copy_out(line, 0, text, length);
+	text[length] = 0;
+	int old_start = 0;
+	int new_start = 0;
+	if (sscanf(text, "@@ -%d,%*d +%d", &old_start, &new_start) != 2)
+		return;
+	int start = side == '-' ? old_start : new_start;
+
+	buffer *b = first_buffer;
+	while (b != NULL && (b->type != BUFFER_FILE || strcmp(b->filename, name + 4) != 0))
+		b = b->next;
+	if (b == NULL)
+		return;
+	switch_buffer(b);
+	goto_line(start + offset > 0 ? start + offset : 1);
 }
 
-void copy_line()
+bool is_word_char(char c)
 {
-	// Clear the paste buffer
-	delete_lines(paste_buffer->first_line); 
+	return isalnum((unsigned char) c) || c == '_';
+}
 
-	// Copy current line into paste buffer	
-	Line *dest_line = NULL;
-	dest_line = insert_line(dest_line, NULL, current_buffer->current_line->text, current_buffer->current_line->length);
-	paste_buffer->first_line = dest_line;
+// Find the trie node for a word, adding nodes for it if add is set (or returning -1 if it is not there)
+int trie_find(char *word, int length, bool add)
+{
+	if (trie == NULL)
+	{
+		trie_size = 1024;
+		trie = (Trie_node *) counted_malloc(sizeof(Trie_node) * trie_size);
+		trie[0] = (Trie_node) { 0, -1, -1, -1, 0, -1, 0 };
+		trie_count = 1;
+	}
 
-	// Insert a blank line for carriage return
-	dest_line = insert_line(dest_line, NULL, current_buffer->current_line->text, 0);
-	paste_buffer->lines = 2;
+	int node = 0;
+	for (int i = 0; i < length; i++)
+	{
+		int child = trie[node].first_child;
+		int previous = -1;
+		while (child >= 0 && trie[child].c != word[i])
+		{
+			previous = child;
+			child = trie[child].next_sibling;
+		}
+		if (child >= 0 && previous >= 0)
+		{
+			// Move the child to the front, so common letters are found quickly
+			trie[previous].next_sibling = trie[child].next_sibling;
+			trie[child].next_sibling = trie[node].first_child;
+			trie[node].first_child = child;
+		}
+		if (child < 0)
+		{
+			if (!add)
+				return -1;
+			if (trie_count == trie_size)
+			{
+				trie_size *= 2;
+				trie = (Trie_node *) counted_realloc(trie, sizeof(Trie_node) * trie_size);
+			}
+			child = trie_count++;
+			trie[child] = (Trie_node) { word[i], -1, trie[node].first_child, node, 0, -1, 0 };
+			trie[node].first_child = child;
+		}
+		node = child;
+	}
+	return node;
 }
 
-void copy()
+// Change how many times a word occurs, and keep the most frequent word under each node up to date
+void trie_count_word(int node, int change)
 {
-	Line *dest_line = NULL;
-	Line *source_line;
-	Select_mark select_start;
-	Select_mark select_end;
-	int startx = 0;
-	int endx = 0;
+	int word = node;
+	trie[word].count += change;
+	for (; node >= 0; node = trie[node].parent)
+	{
+		Trie_node *t = &trie[node];
+		int best = t->best;
+		int best_count = t->best_count;
+		if (t->best == word)
+			t->best_count = trie[word].count;
+		else if (trie[word].count > t->best_count)
+		{
+			t->best = word;
+			t->best_count = trie[word].count;
+		}
 
-	get_select_extents(current_buffer, &select_start, &select_end);
+		// Only a drop in the best word itself means looking through the children again
+		if (change < 0 && best == word)
+		{
+			t->best = t->count > 0 ? node : -1;
+			t->best_count = t->count;
+			for (int child = t->first_child; child >= 0; child = trie[child].next_sibling)
+			{
+				if (trie[child].best_count > t->best_count)
+				{
+					t->best = trie[child].best;
+					t->best_count = trie[child].best_count;
+				}
+			}
+		}
 
-	// Clear the paste buffer
-	delete_lines(paste_buffer->first_line); 
-	paste_buffer->first_line = NULL;
-	paste_buffer->lines = 0;
+		// Nodes further up only change if this one did
+		if (t->best == best && t->best_count == best_count)
+			break;
+	}
+}
 
-	source_line = select_start.line;
+// Add the words of a line to the index, or bring them up to date if it has changed, remembering their nodes so they
+// can be taken out again
+void index_words(Line *line)
+{
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
 
-	// Loop until current line is the end line
-	while (source_line != select_end.line->next)
+	// A long line's segments hold its words, so only those which have changed are looked at again
+	if (line->storage == TEXT_SEGMENTS)
 	{
-		if (source_line == select_start.line)
-			startx = select_start.x;
+		if (line->word_ids == segment_words)
+			update_segment_words(line->long_text);
 		else
-			startx = 0;
-		if (source_line == select_end.line)
 		{
-			endx = select_end.x + 1;
-			if (endx - startx > source_line->length)
-				endx--;
+			forget_words(line);
+			count_segment_words(line->long_text, 1);
+			line->word_ids = segment_words;
 		}
-		else
-			endx = source_line->length;
+		return;
+	}
 
-		dest_line = insert_line(dest_line, NULL, source_line->text + startx, endx - startx);
+	forget_words(line);
+	char word[MAX_WORD_LENGTH];
+	int length = 0;
+	int ids = 0;
+	int ids_size = 0;
 
-		paste_buffer->lines += 1;
-		if (paste_buffer->first_line == NULL)
-			paste_buffer->first_line = dest_line;
-		source_line = source_line->next;
+	int chunk_length;
+	for (int x = 0; x <= line->length; x += chunk_length)
+	{
+		// A space after the end finishes the last word
+		char *chunk = " ";
+		chunk_length = 1;
+		if (x < line->length)
+			chunk = line_chunk(line, x, &chunk_length);
+
+		for (int i = 0; i < chunk_length; i++)
+		{
+			if (is_word_char(chunk[i]))
+			{
+				if (length < MAX_WORD_LENGTH)
+					word[length] = chunk[i];
+				length++;
+				continue;
+			}
+			if (length >= MIN_WORD_LENGTH && length <= MAX_WORD_LENGTH)
+			{
+				if (ids == ids_size)
+				{
+					ids_size = ids_size ? ids_size * 2 : 8;
+					line->word_ids = (int *) counted_realloc(line->word_ids, sizeof(int) * (ids_size + 1));
+				}
+				int node = trie_find(word, length, true);
+				trie_count_word(node, 1);
+				line->word_ids[ids++] = node;
+			}
+			length = 0;
+		}
 	}
+	if (line->word_ids != NULL)
+		line->word_ids[ids] = -1;
 }
 
-void cut()
+// Take a line's words back out of the index
+void forget_words(Line *line)
 {
-	copy();
-	delete_selection();
+	if (line->word_ids == segment_words)
+	{
+		count_segment_words(line->long_text, -1);
+		line->word_ids = NULL;
+		return;
+	}
+	if (line->word_ids == NULL)
+		return;
+	for (int *id = line->word_ids; *id >= 0; id++)
+		trie_count_word(*id, -1);
+	free(line->word_ids);
+	line->word_ids = NULL;
 }
 
-void cut_line()
+// Mark the words of a segment as changed, along with those in the segments around it which may run into it
+// or start straight after it
+void mark_words_stale(Long_text *t, int i)
 {
-	copy_line();
-	delete_line(current_buffer->current_line);
-	check_boundx();
+	t->words_stale = true;
+	t->segments[i].words_stale = true;
+	if (i + 1 < t->count)
+		t->segments[i + 1].words_stale = true;
+	int gap = 0;
+	for (int j = i - 1; j >= 0 && gap <= MAX_WORD_LENGTH; j--)
+	{
+		t->segments[j].words_stale = true;
+		gap += t->segments[j].length;
+	}
 }
 
-void paste()
+// Take a segment's words out of the index for the lines counting them, before it is dropped or broken up
+void drop_segment_words(Long_text *t, int i)
 {
-	Line *source_line = paste_buffer->first_line;
-	
-	// If nothing in paste buffer then return
-	if (!source_line)
+	int *ids = t->segments[i].word_ids;
+	if (ids == NULL)
 		return;
+	if (t->words_counted > 0)
+		for (int *id = ids; *id >= 0; id++)
+			trie_count_word(*id, -t->words_counted);
+	free(ids);
+	t->segments[i].word_ids = NULL;
+}
 
-	// Paste first line into current line
-	insert_string(current_buffer->current_line, current_buffer->cx, source_line->text, source_line->length);
-	current_buffer->cx += source_line->length;
-	source_line = source_line->next;
-
-	while (source_line != NULL)
+// Find the words starting in a segment (reading on into the following segments for their ends), counting them
+// for the lines which count the segments' words
+void index_segment(Long_text *t, int i)
+{
+	drop_segment_words(t, i);
+	Segment *segment = &t->segments[i];
+	segment->words_stale = false;
+	int ids = 0;
+	int ids_size = 0;
+
+	bool after_word = i > 0 && is_word_char(t->segments[i - 1].text[t->segments[i - 1].length - 1]);
+	for (int x = 0; x < segment->length; x++)
 	{
-		// Use enter() and insert_string() in case pasting in middle of line and need to preserve rest of  text
-		enter();
-		if (source_line->length > 0)
-			insert_string(current_buffer->current_line, current_buffer->cx, source_line->text, source_line->length);
-		current_buffer->cx += source_line->length;
-		source_line = source_line->next;
+		bool starts = is_word_char(segment->text[x]) && !after_word;
+		after_word = is_word_char(segment->text[x]);
+		if (!starts)
+			continue;
+
+		// Read to the end of the word, or just past the longest word worth completing
+		char word[MAX_WORD_LENGTH];
+		int length = 0;
+		int k = i;
+		int pos = x;
+		while (k < t->count && length <= MAX_WORD_LENGTH && is_word_char(t->segments[k].text[pos]))
+		{
+			if (length < MAX_WORD_LENGTH)
+				word[length] = t->segments[k].text[pos];
+			length++;
+			if (++pos == t->segments[k].length)
+			{
+				k++;
+				pos = 0;
+			}
+		}
+		if (length < MIN_WORD_LENGTH || length > MAX_WORD_LENGTH)
+			continue;
+
+		if (ids == ids_size)
+		{
+			ids_size = ids_size ? ids_size * 2 : 8;
+			segment->word_ids = (int *) counted_realloc(segment->word_ids, sizeof(int) * (ids_size + 1));
+		}
+		int node = trie_find(word, length, true);
+		if (t->words_counted > 0)
+			trie_count_word(node, t->words_counted);
+		segment->word_ids[ids++] = node;
 	}
+	if (segment->word_ids != NULL)
+		segment->word_ids[ids] = -1;
+}
 
-	check_boundx();
+// Find the words again in the segments which have changed
+void update_segment_words(Long_text *t)
+{
+	if (!t->words_stale)
+		return;
+	t->words_stale = false;
+	for (int i = 0; i < t->count; i++)
+		if (t->segments[i].words_stale)
+			index_segment(t, i);
 }
 
-void delete_line(Line *line)
+// Add (or take out) one line's count of the words in a long line's segments
+void count_segment_words(Long_text *t, int change)
 {
-	// Delete selection mark if the line with the mark is deleted
-	if (current_buffer->select_mark.line == line) clear_mark(current_buffer);
-	// Adjust the mark cy if it is after the deleted line
-	else if (current_buffer->cy < current_buffer->select_mark.y) current_buffer->select_mark.y--;
+	update_segment_words(t);
+	for (int i = 0; i < t->count; i++)
+		if (t->segments[i].word_ids != NULL)
+			for (int *id = t->segments[i].word_ids; *id >= 0; id++)
+				trie_count_word(*id, change);
+	t->words_counted += change;
+}
 
-	if (line == current_buffer->first_line) current_buffer->first_line = line->next;
-	if (line == current_buffer->first_screen_line) current_buffer->first_screen_line = line->next;
+// Copy out the word nodes held by a long line's segments, as they are counted now
+int *collect_segment_words(Long_text *t)
+{
+	int n = 0;
+	for (int i = 0; i < t->count; i++)
+		if (t->segments[i].word_ids != NULL)
+			for (int *id = t->segments[i].word_ids; *id >= 0; id++)
+				n++;
+	int *ids = (int *) counted_malloc(sizeof(int) * (n + 1));
+	n = 0;
+	for (int i = 0; i < t->count; i++)
+		if (t->segments[i].word_ids != NULL)
+			for (int *id = t->segments[i].word_ids; *id >= 0; id++)
+				ids[n++] = *id;
+	ids[n] = -1;
+	return ids;
+}
 
-	if (line->prev != NULL) line->prev->next = line->next;
-	if (line->next != NULL) line->next->prev = line->prev;
+// Build the text of the word ending at a node (into a buffer of MAX_WORD_LENGTH + 1)
+void trie_word(int node, char *word)
+{
+	int length = 0;
+	for (int n = node; n > 0; n = trie[n].parent)
+		length++;
+	word[length] = 0;
+	for (int n = node; n > 0; n = trie[n].parent)
+		word[--length] = trie[n].c;
+}
 
-	if (line == current_buffer->current_line) 
+// Collect the most frequent words under a node, skipping subtrees which cannot beat those found already
+void trie_best(int node, int *results, int *count, int max, int exclude)
+{
+	Trie_node *t = &trie[node];
+	if (t->best_count == 0 || (*count == max && t->best_count <= trie[results[max - 1]].count))
+		return;
+
+	if (t->count > 0 && node != exclude)
 	{
-		if (line->next != NULL) current_buffer->current_line = line->next;
-		else current_buffer->current_line = line->prev;
+		// Insert in order of count
+		int i = *count < max ? (*count)++ : max - 1;
+		while (i > 0 && trie[results[i - 1]].count < t->count)
+		{
+			results[i] = results[i - 1];
+			i--;
+		}
+		results[i] = node;
 	}
+	for (int child = t->first_child; child >= 0; child = trie[child].next_sibling)
+		trie_best(child, results, count, max, exclude);
+}
 
-	free(line->text);
-	free(line);
-	current_buffer->lines--;
+// Index the words of every open buffer, the first time completion is used
+void index_all_words()
+{
+	if (words_indexed)
+		return;
+	words_indexed = true;
+	for (buffer *b = first_buffer; b != NULL; b = b->next)
+		for (Line *line = b->first_line; line != NULL; line = line->next)
+		{
+			bool paged = line->storage == TEXT_PAGED;
+			index_words(line);
+			if (paged)
+				drop_text(line);
+		}
 }
 
-void delete_lines(Line *start_line)
+// Find up to max words which start with a prefix (and are longer), most frequent first
+int find_completions(char *prefix, int length, int *results, int max)
 {
-	Line *l;
-	while (start_line != NULL)
+	index_all_words();
+	int node = trie_find(prefix, length, false);
+	if (node < 0)
+		return 0;
+	int count = 0;
+	trie_best(node, results, &count, max, node);
+	return count;
+}
+
+// Where the word before the cursor starts
+int word_start()
+{
+	int x = current_buffer->cx;
+	while (x > 0 && is_word_char(line_char(current_buffer->current_line, x - 1)))
+		x--;
+	return x;
+}
+
+// Show the best completions of the word being typed
+void hint_completion()
+{
+	char prefix[MAX_WORD_LENGTH];
+	char msg[MAX_MESSAGE_LENGTH];
+	int start = word_start();
+	int length = current_buffer->cx - start;
+	if (length > MAX_WORD_LENGTH)
+		return;
+	text_copy_out(current_buffer->current_line, start, prefix, length);
+
+	int results[COMPLETIONS];
+	int count = find_completions(prefix, length, results, COMPLETIONS);
+	if (count == 0)
+		return;
+	int used = snprintf(msg, sizeof(msg), "CTRL-k:");
+	for (int i = 0; i < count && used < (int) sizeof(msg); i++)
 	{
-		l = start_line;
-		start_line = start_line->next;
-		free (l->text);
-		free(l);
+		char word[MAX_WORD_LENGTH + 1];
+		trie_word(results[i], word);
+		used += snprintf(msg + used, sizeof(msg) - used, " %s", word);
 	}
-	return;
+	message(msg);
 }
 
-void save_file(char *save_filename)
+// Complete the word before the cursor with the most frequent word it starts, or the next one on a repeat
+void complete()
 {
-	FILE *fp = fopen(save_filename, "w");
-	if (!fp)
+	Line *line = current_buffer->current_line;
+	int results[COMPLETIONS];
+
+	if (completing)
+	{
+		// Take the last completion (and its undo marks) back out, to put in the next one
+		int length = current_buffer->cx - complete_start - complete_length;
+		delete_string(line, complete_start + complete_length, length);
+		current_buffer->cx -= length;
+		for (int i = 0; i < length && undo_head != NULL; i++)
+		{
+			Undo_mark *u = undo_head;
+			undo_head = u->next;
+			free(u->text);
+			free(u);
+		}
+		complete_choice++;
+	}
+	else
+	{
+		complete_start = word_start();
+		complete_length = current_buffer->cx - complete_start;
+		if (complete_length < 1 || complete_length > MAX_WORD_LENGTH)
+			return;
+		text_copy_out(line, complete_start, complete_prefix, complete_length);
+		complete_choice = 0;
+	}
+
+	int count = find_completions(complete_prefix, complete_length, results, COMPLETIONS);
+	if (count == 0)
+	{
+		message("No completions");
+		return;
+	}
+
+	char word[MAX_WORD_LENGTH + 1];
+	trie_word(results[complete_choice % count], word);
+	for (char *c = word + complete_length; *c; c++)
+	{
+		insert_char(line, current_buffer->cx, *c);
+		current_buffer->cx++;
+		push_undo(current_buffer->cx, current_buffer->cy + current_buffer->offsety, UNDO_INSERTCHAR, c, 1);
+	}
+	check_boundx();
+	current_buffer->modified = true;
+	completing = true;
+}
+
+// Read a paged out line's text back into memory
+void page_in(Line *line)
+{
+	if (line->length <= SHORT_LINE_LENGTH)
+	{
+		read_page(line, line->short_text);
+		line->storage = TEXT_INLINE;
 		return;
+	}
+
+	char *text = (char *) counted_malloc(sizeof(char) * line->length);
+	read_page(line, text);
+	if (line->length > LONG_LINE_LENGTH)
+	{
+		segment_line(line, text, line->length);
+		free(text);
+	}
+	else
+	{
+		line->text = text;
+		line->refs = NULL;
+		line->storage = TEXT_HEAP;
+	}
+	line_bytes += line->length;
+}
+
+// Read the copy of a line's text from its page file
+void read_page(Line *line, char *dest)
+{
+	if (line->length <= PAGE_BLOCK)
+	{
+		if (line->page_fd != page_block_fd || line->page_pos < page_block_pos ||
+			line->page_pos + line->length > page_block_pos + page_block_length)
+		{
+			page_block_fd = line->page_fd;
+			page_block_pos = line->page_pos;
+			page_block_length = pread(line->page_fd, page_block, PAGE_BLOCK, line->page_pos);
+		}
+		if (line->page_pos + line->length <= page_block_pos + page_block_length)
+		{
+			memcpy(dest, page_block + (line->page_pos - page_block_pos), line->length);
+			return;
+		}
+	}
 
-	Line *line = current_buffer->first_line;
-	while (line != NULL)
+	long n = 0;
+	while (n < line->length)
 	{
-		fwrite(line->text, sizeof(char), line->length, fp);
-		fputc('\n', fp);
-		line = line->next;
+		long r = pread(line->page_fd, dest + n, line->length - n, line->page_pos + n);
+		if (r <= 0)
+			break;
+		n += r;
 	}
-	fclose(fp);
-	current_buffer->modified = false;
+	if (n < line->length)
+	{
+		memset(dest + n, ' ', line->length - n);
+		message("Could not read a line back from its file, which may have been changed by another program");
+	}
+}
 
-	return;
+// Free the text of a line which has a copy in its page file, until it is next used
+void drop_text(Line *line)
+{
+	free_text(line);
+	line->storage = TEXT_PAGED;
 }
 
-bool open_file(char *open_filename)
+// Page out a line of a buffer, copying it to the swap file first if it has changed, and return the bytes freed
+long page_out_line(buffer *b, Line *line)
 {
-	char *read_line = NULL;
-	Line *line = NULL;
-	long length = 0;
-	size_t max_length = 0;
+	// Short lines are held in the line itself, so there is nothing to free
+	if (line->storage < TEXT_HEAP || line->refs != NULL)
+		return 0;
+
+	// A copy in another buffer's files (from undo moving lines between buffers) may not last
+	if (line->page_fd >= 0 && line->page_fd != b->page_fd && line->page_fd != b->swap_fd)
+		line->page_fd = -1;
+	if (line->page_fd < 0 && !swap_line(b, line))
+		return 0;
+	drop_text(line);
+	return line->length;
+}
 
-	FILE *fp = fopen(open_filename, "r");
-	if (!fp)
+// Copy a line to the end of its buffer's swap file, opening or growing the file as needed
+bool swap_line(buffer *b, Line *line)
+{
+	if (b->swap_fd < 0 && !open_swap(b))
 		return false;
 
-	current_buffer = add_buffer();
-	current_buffer->filename = (char *)realloc(current_buffer->filename, sizeof(char) * strlen(open_filename) + 1);
-	strcpy(current_buffer->filename, open_filename);
-
-	while ((length = getline(&read_line, &max_length, fp)) != -1)
+	if (page_block_fd == b->swap_fd)
+		page_block_fd = -1; // The block may have been read from past the end of what was written
+	if (b->swap_length + line->length > b->swap_size)
 	{
-		// Trim trailing newlines
-		while (length > 0 && (read_line[length - 1] == '\n' || read_line[length - 1] == '\r'))
-			length--;
-		current_buffer->lines += 1;
-		line = insert_line(line, NULL, read_line, length);
-		if (current_buffer->first_line == NULL)
-			current_buffer->first_line = line;
+		long size = b->swap_size + (line->length > SWAP_GROWTH ? line->length : SWAP_GROWTH);
+		if (b->swap != NULL)
+			madvise(b->swap, b->swap_size, MADV_DONTNEED);
+
+		// The disk space is taken now, as running out of it while writing to the mapping would be fatal
+		if (posix_fallocate(b->swap_fd, 0, size) != 0)
+			return false;
+		char *swap;
+		if (b->swap == NULL)
+			swap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, b->swap_fd, 0);
+		else
+			swap = mremap(b->swap, b->swap_size, size, MREMAP_MAYMOVE);
+		if (swap == MAP_FAILED)
+			return false;
+		b->swap = swap;
+		b->swap_size = size;
 	}
 
-	free(read_line);
-	fclose(fp);
-	current_buffer->modified = false;
+	if (line->storage == TEXT_PAGED)
+		read_page(line, b->swap + b->swap_length);
+	else
+		text_copy_out(line, 0, b->swap + b->swap_length, line->length);
+	line->page_fd = b->swap_fd;
+	line->page_pos = b->swap_length;
+	b->swap_length += line->length;
+	return true;
+}
+
+// Make a swap file next to a buffer's file, or in /tmp if that directory cannot be written to.
+// It is removed straight away, so it goes when the editor exits however that happens
+bool open_swap(buffer *b)
+{
+	char name[MAX_FILENAME_LENGTH + 16];
+	char *slash = strrchr(b->filename, '/');
+	if (slash == NULL)
+		snprintf(name, sizeof(name), ".%s.swp", b->filename);
+	else
+		snprintf(name, sizeof(name), "%.*s.%s.swp", (int) (slash - b->filename) + 1, b->filename, slash + 1);
 
+	b->swap_fd = open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (b->swap_fd < 0)
+	{
+		strcpy(name, "/tmp/write-swap-XXXXXX");
+		b->swap_fd = mkostemp(name, O_CLOEXEC);
+	}
+	if (b->swap_fd < 0)
+		return false;
+	unlink(name);
 	return true;
 }
 
-void new_file(char *new_filename)
+// Empty a buffer's swap file once no lines are held in it
+void clear_swap(buffer *b)
 {
-	current_buffer = add_buffer();
-	current_buffer->filename = (char *)realloc(current_buffer->filename, sizeof(char) * strlen(new_filename) + 1);
-	strcpy(current_buffer->filename, new_filename);
-	current_buffer->first_line = insert_line(NULL, NULL, NULL, 0);
-	current_buffer->lines = 1;
-	current_buffer->modified = false;
+	if (b->swap != NULL)
+		munmap(b->swap, b->swap_size);
+	if (b->swap_fd >= 0)
+		ftruncate(b->swap_fd, 0);
+	b->swap = NULL;
+	b->swap_size = 0;
+	b->swap_length = 0;
+	page_block_fd = -1;
 }
 
-void load_options()
+// Page out lines of a buffer away from its cursor, until about the given number of bytes have been freed.
+// Each pass carries on from where the last one stopped, so lines already paged out are not walked again
+long page_out(buffer *b, long bytes)
 {
-    char *read_line = NULL;
-	char *p;
-	char *o;
-	size_t max_length = 0;
+	if (b->type != BUFFER_FILE || !b->loaded)
+		return 0;
+
+	// Find the lines kept around the cursor (which is at the top while the file is first read), to step over them
+	Line *keep_first = b->current_line != NULL ? b->current_line : b->first_line;
+	Line *keep_last = keep_first;
+	for (int i = 0; i < PAGE_KEEP_LINES && keep_first->prev != NULL; i++)
+		keep_first = keep_first->prev;
+	for (int i = 0; i < PAGE_KEEP_LINES && keep_last->next != NULL; i++)
+		keep_last = keep_last->next;
+	Line *start = b->page_line != NULL ? b->page_line : b->first_line;
+	for (Line *l = keep_first; l != keep_last->next; l = l->next)
+	{
+		if (l == start)
+		{
+			start = keep_last->next != NULL ? keep_last->next : b->first_line;
+			break;
+		}
+	}
 
-    // Set default options
-    o_tabsize = 4;
-    o_messagecooldown = 2;
-	o_show_linenumbers = false;
+	long freed = 0;
+	long swapped = b->swap_length;
+	Line *line = start;
+	do
+	{
+		if (line == keep_first)
+			line = keep_last;
+		else
+			freed += page_out_line(b, line);
+		line = line->next != NULL ? line->next : b->first_line;
+	}
+	while (line != start && freed < bytes);
+	b->page_line = line;
+
+	// Changed lines are copied to the mapping in one batch, then its pages are let go of.
+	// What was written stays in the file (and the page cache, until the kernel needs the memory)
+	if (b->swap_length > swapped)
+		madvise(b->swap, b->swap_size, MADV_DONTNEED);
+	return freed;
+}
 
-    char filename[256];
-    strcat(strcpy(filename, getenv("HOME")), "/.write");
+// Bytes of memory the process has resident, or 0 if that cannot be found out
+long resident_memory()
+{
+	char text[64];
+	int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	int n = read(fd, text, sizeof(text) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	text[n] = 0;
+	long pages = 0;
+	sscanf(text, "%*d %ld", &pages);
+	return pages * sysconf(_SC_PAGESIZE);
+}
 
-	FILE *fp = fopen(filename, "r");
-	if (!fp) return;
+// Page out lines far from the cursors once the lines and their text have grown past the memory budget,
+// aiming to get back under three quarters of it. Buffers which are not being shown go first.
+// Returns whether they are over budget
+bool check_memory()
+{
+	if (o_memory <= 0)
+		return false;
+	long budget = (long) o_memory * 1024 * 1024;
+	if (line_bytes <= budget || line_bytes <= page_retry)
+		return line_bytes > budget;
+
+	long excess = line_bytes - budget / 4 * 3;
+	for (buffer *b = first_buffer; b != NULL && excess > 0; b = b->next)
+		if (b != current_buffer)
+			excess -= page_out(b, excess);
+	if (excess > 0 && current_buffer != NULL)
+		page_out(current_buffer, excess);
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+
+	// Lines near the cursors and the lines themselves are never paged out, so if that leaves it over
+	// budget, wait for some more to be read in before trying again
+	page_retry = line_bytes > budget ? line_bytes + budget / 8 : 0;
+	return line_bytes > budget;
+}
 
-	while (getline(&read_line, &max_length, fp) != -1)
-	{
-        // Skip blank lines and comments prefaced with '#'
-        if (strlen(read_line) == 1) continue;
-        if (read_line[0] == '#') continue;
+// Close the file and swap file a buffer's lines are paged out to, once the buffer is done with
+void close_pages(buffer *b)
+{
+	unpage_undo(b);
+	clear_swap(b);
+	if (b->swap_fd >= 0)
+		close(b->swap_fd);
+	if (b->page_fd >= 0)
+		close(b->page_fd);
+	b->swap_fd = -1;
+	b->page_fd = -1;
+	page_block_fd = -1;
+}
 
-		while ((p = strtok(read_line, " ")))
+// Read back lines held by undo marks which were paged out to a buffer's files, before they are closed or overwritten
+void unpage_undo(buffer *b)
+{
+	for (Undo_mark *u = undo_head; u != NULL; u = u->next)
+	{
+		for (Line *line = u->removed; line != NULL; line = line->next)
 		{
-			if (strcmp(p, "set") == 0)
-			{
-				// Need two more 
-				if (!(p = strtok(NULL, " "))) break;
-				if (!(o = strtok(NULL, " "))) break;
-				if (strcmp(p, "tabsize") == 0) o_tabsize = atoi(o);
-				else if (strcmp(p, "message_cooldown") == 0) o_messagecooldown = atoi(o);
-				else if (strcmp(p, "show_linenumbers") == 0) o_show_linenumbers = atoi(o);
-				break;
-			}
+			if (line->page_fd < 0 || (line->page_fd != b->page_fd && line->page_fd != b->swap_fd))
+				continue;
+			if (line->storage == TEXT_PAGED)
+				page_in(line);
+			line->page_fd = -1;
 		}
 	}
+}
 
- 	free(read_line);
-	fclose(fp);
-    return;
+// Stop a buffer's lines depending on its file, before the file is overwritten
+void unpage_file(buffer *b)
+{
+	for (Line *line = b->first_line; line != NULL; line = line->next)
+	{
+		if (line->page_fd != b->page_fd)
+			continue;
+		if (line->storage != TEXT_PAGED)
+			line->page_fd = -1;
+		else if (!swap_line(b, line))
+			page_in(line);
+	}
+	if (b->swap != NULL)
+		madvise(b->swap, b->swap_size, MADV_DONTNEED);
 }
 
-buffer *add_buffer()
+// Point each line of a buffer at its text in the file it has just been saved to, which empties the swap file
+void repoint_lines(buffer *b, char *saved_filename)
 {
-	buffer *new_buffer;
-	new_buffer = add_sbuffer();
-	if (current_buffer == NULL)
-		new_buffer->next = NULL;
-	else
+	page_block_fd = -1;
+	int fd = open(saved_filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	long offset = 0;
+	for (Line *line = b->first_line; line != NULL; line = line->next)
 	{
-		new_buffer->next = current_buffer->next;
-		current_buffer->next = new_buffer;
+		line->page_fd = fd;
+		line->page_pos = offset;
+		offset += line->length + 1;
 	}
-	return new_buffer;
+	if (b->page_fd >= 0)
+		close(b->page_fd);
+	b->page_fd = fd;
+	clear_swap(b);
 }
 
-buffer *add_sbuffer()
+// Display width of a whole line, without keeping it in memory if it had been paged out
+int line_width(Line *line)
 {
-	buffer *new_buffer;
-	new_buffer = (buffer *) malloc(sizeof(buffer));
-	new_buffer->first_line = NULL;
-	new_buffer->current_line = NULL;
-	new_buffer->first_screen_line = NULL;
-	new_buffer->lines = 0;
-	new_buffer->filename = NULL;
-	clear_mark(new_buffer);
-	return new_buffer;
+	bool paged = line->storage == TEXT_PAGED;
+	int width = cxtodx(line, line->length);
+	if (paged)
+		drop_text(line);
+	return width;
+}
+
+// Whether a line of a buffer is shown in aligned columns
+bool table_line(buffer *b, Line *line)
+{
+	return b != NULL && b->table != NULL && !o_soft_wrap && line->storage != TEXT_SEGMENTS;
 }
 
-void close(buffer *close_buffer)
+// End of the field which starts at x: the next delimiter outside double quotes, or the end of the line
+int field_end(char *text, int length, int x, char delimiter)
 {
-	if (close_buffer == first_buffer)
+	bool quoted = false;
+	for (; x < length; x++)
 	{
-		first_buffer = close_buffer->next;
-		current_buffer = first_buffer;
+		if (text[x] == '"')
+			quoted = !quoted;
+		else if (text[x] == delimiter && !quoted)
+			break;
 	}
-	else
+	return x;
+}
+
+// Display position of a byte of a line shown in aligned columns
+int table_cxtodx(Table *t, Line *line, int cx)
+{
+	char *text = LINE_TEXT(line);
+	int column = 0;
+	int x = 0;
+	for (int k = 0; ; k++)
 	{
-		// Loop through buffers until we find the preceding
-		current_buffer = first_buffer;
-		while (current_buffer->next != close_buffer)
-			current_buffer = current_buffer->next;
-		current_buffer->next = close_buffer->next;
+		int end = field_end(text, line->length, x, t->delimiter);
+		int width = k < t->shown.count && t->shown.widths[k] > end - x ? t->shown.widths[k] : end - x;
+		if (cx < end || end >= line->length)
+			return column + (cx < end ? cx : end) - x;
+		if (cx == end)
+			return column + width + 1;
+		column += width + 3;
+		x = end + 1;
 	}
-	delete_lines(close_buffer->first_line); // Clear the text buffer starting at the first line
-	free(close_buffer->filename);
-	free(close_buffer);
-	return;
 }
 
-void prompt_save()
+// Byte of a line shown in aligned columns at a display position, or the nearest one before it
+int table_dxtocx(Table *t, Line *line, int dx)
 {
-	char s[MAX_FILENAME_LENGTH];
-	if (get_input("Save as ", current_buffer->filename, s, MAX_FILENAME_LENGTH))
+	char *text = LINE_TEXT(line);
+	int column = 0;
+	int x = 0;
+	for (int k = 0; ; k++)
 	{
-		current_buffer->filename = (char *)realloc(current_buffer->filename, sizeof(char) * strlen(s) + 1);
-		strcpy(current_buffer->filename, s);
-		save_file(current_buffer->filename);
-
-		message("Saved");
+		int end = field_end(text, line->length, x, t->delimiter);
+		int width = k < t->shown.count && t->shown.widths[k] > end - x ? t->shown.widths[k] : end - x;
+		if (end >= line->length || dx < column + width + 3)
+			return dx - column < end - x ? x + dx - column : end;
+		column += width + 3;
+		x = end + 1;
 	}
 }
 
-bool find(char *find_string, Line *start_line, int start_x)
+// Width of column k in a set of columns, adding columns up to it as needed
+int *column_width(Columns *c, int k)
 {
-	Line *l = start_line;
-	int find_y = current_buffer->cy + current_buffer->offsety;
-	int find_x = start_x + 1;
-
-	while (l != start_line->prev)
+	while (c->count <= k)
 	{
-		char *match = strstr(l->text + find_x, find_string);
-		if (match)
-		{
-			goto_line(find_y + 1);
-			current_buffer->cx = match - l->text;
-			check_boundx();
-			return true;
-		}
-
-		l = l->next;
-		find_y += 1;
-		find_x = 0;
-
-		// If last line then jump back to first
-		if ((l == NULL) && (start_line != current_buffer->first_line))
+		if (c->count == c->size)
 		{
-			l = current_buffer->first_line;
-			find_y = 0;
+			c->size = c->size ? c->size * 2 : 16;
+			c->widths = (int *) realloc(c->widths, sizeof(int) * c->size);
+			c->widest = (int *) realloc(c->widest, sizeof(int) * c->size);
 		}
+		c->widest[c->count] = 0;
+		c->widths[c->count++] = 0;
 	}
-	return false;
+	return &c->widths[k];
 }
 
-void resize_window()
+// Bits of a line's table_widest which are its columns, if they were counted under the table's current generation
+unsigned int widest_columns(Table *t, Line *line)
 {
-	getmaxyx(stdscr, windowy, windowx);
-	windowy -= 2; // Reduce for status bar and message buffer
-
-	// Resize all windows
-	textscr = subwin(stdscr, windowy, windowx, 0, 0);
-	statusscr = subwin(stdscr, 1, windowx, windowy, 0);
-	commandscr = subwin(stdscr, 1, windowx, windowy + 1, 0);
-
-	// Set background for status line
-	wbkgd(statusscr, COLOR_PAIR(COL_WHITEBLUE));
-
-	// Clear command line
-	werase(commandscr);
-	wrefresh(commandscr);
+	if (line->table_widest >> TABLE_COUNTED_COLUMNS != t->generation)
+		return 0;
+	return line->table_widest & ((1u << TABLE_COUNTED_COLUMNS) - 1);
 }
 
-bool run_command(char *s)
+// Stop counting a line among the widest of a column, which then has to be measured again if it was the last
+void forget_column(Table *t, Columns *c, int k)
 {
-	char *token;
-	char msg[255];
-	token = strtok(s, " ");
-	if (token == NULL) return false;
+	if (k < c->count && --c->widest[k] <= 0)
+		t->rescan = true;
+}
 
-	if (strcmp(token, "count") == 0)
+// Widen a set of columns to fit the fields of a line. If counted, the line is also counted among the widest lines of
+// each column it fills, and no longer among those of the columns it has narrowed in since it was last counted.
+// A column it was widest in before which grew since then has its count come up short, which only costs an early scan
+void widen_columns(Table *t, Columns *c, Line *line, bool counted)
+{
+	unsigned int was = counted ? widest_columns(t, line) : 0;
+	unsigned int now = 0;
+	if (line->storage != TEXT_SEGMENTS)
 	{
-		token = strtok(NULL, " ");
-		if (token == NULL) // default count words
+		bool paged = line->storage == TEXT_PAGED;
+		if (paged)
+			page_in(line);
+		char *text = LINE_TEXT(line);
+		int x = 0;
+		for (int k = 0; ; k++)
 		{
-			int words = 0;
-			Line *l = current_buffer->first_line;
-			while (l != NULL)
+			int end = field_end(text, line->length, x, t->delimiter);
+			int *width = column_width(c, k);
+			unsigned int bit = k < TABLE_COUNTED_COLUMNS ? 1u << k : 0;
+			if (*width < end - x)
 			{
-				int c = 0;
-				bool w = false;
-				while (c < l->length)
-				{
-					if (isspace(l->text[c])) w = false;
-					else if (!w)
-					{
-						w = true;
-						words++;
-					}
-					c++;
-				}
-
-				l = l->next;
+				*width = end - x;
+				c->widest[k] = 0;
+				was &= ~bit;
 			}
-
-			sprintf(msg, "Words: %d", words);
-			message(msg);
+			if (counted && bit && *width == end - x)
+			{
+				if (!(was & bit))
+					c->widest[k]++;
+				now |= bit;
+			}
+			if (end >= line->length)
+				break;
+			x = end + 1;
 		}
+		if (paged)
+			drop_text(line);
+	}
+	if (!counted)
+		return;
 
-		else if (strcmp(token, "loc") == 0) // count lines of code
-		{
-			int lines = 0;
-			Line *l = current_buffer->first_line;
-			while (l != NULL)
-			{
-				if (l->length <= 0)  // Blank line
-				{
-					l = l->next;
-					continue;
-				}
+	for (int k = 0; k < TABLE_COUNTED_COLUMNS; k++)
+		if (was & ~now & 1u << k)
+			forget_column(t, c, k);
+	line->table_widest = (unsigned int) t->generation << TABLE_COUNTED_COLUMNS | now;
+}
 
-				int trim_start = 0;
-				while ((trim_start < l->length) && (isspace(l->text[trim_start]))) trim_start++;
+// Stop counting a line which is leaving a buffer among the widest of its columns
+void forget_columns(Table *t, Columns *c, Line *line)
+{
+	unsigned int was = widest_columns(t, line);
+	for (int k = 0; was != 0; k++, was >>= 1)
+		if (was & 1)
+			forget_column(t, c, k);
+	line->table_widest = 0;
+}
 
-				if (trim_start == l->length) // Blank line of whitespace
-				{
-					l = l->next;
-					continue;
-				}
+// Whether the current buffer's columns are still to be measured
+bool scanning_table()
+{
+	return current_buffer != NULL && current_buffer->table != NULL &&
+		(current_buffer->table->scan_line != NULL || current_buffer->table->rescan);
+}
 
-				if (l->text[trim_start] == '#') // Comment
-				{
-					l = l->next;
-					continue;
-				}
+// Measure the next chunk of lines for a buffer's column widths, starting again from the top if lines have changed.
+// Returns true if the widths in use have changed
+bool scan_table(buffer *b)
+{
+	Table *t = b->table;
+	if (!t->rescan && t->scan_line == NULL)
+		return false;
+	if (t->rescan)
+	{
+		// Lines counted before now are not counted in this scan, nor does generation 0 count any (as new lines have it)
+		t->rescan = false;
+		t->scan_line = b->first_line;
+		t->scan.count = 0;
+		if (++table_generations == 0)
+			table_generations = 1;
+		t->generation = table_generations;
+	}
+
+	// Lines which have changed since the scan started have been counted in it already
+	Line *line = t->scan_line;
+	for (int i = 0; i < TABLE_SCAN_LINES && line != NULL; i++, line = line->next)
+		if (line->table_widest >> TABLE_COUNTED_COLUMNS != t->generation)
+			widen_columns(t, &t->scan, line, true);
+	t->scan_line = line;
 
-				lines++;
-				l = l->next;
+	// Columns wider than so far shown are shown straight away, rather than waiting for the whole file
+	if (line != NULL)
+	{
+		bool wider = false;
+		for (int k = 0; k < t->scan.count; k++)
+		{
+			int *width = column_width(&t->shown, k);
+			if (*width < t->scan.widths[k])
+			{
+				*width = t->scan.widths[k];
+				wider = true;
 			}
-			sprintf(msg, "LOC: %d", lines);
-			message(msg);
 		}
+		return wider;
 	}
 
-	// Return true if executed command
+	// Swap the columns measured in for the ones which have only been widened as lines changed
+	Columns shown = t->shown;
+	t->shown = t->scan;
+	t->scan = shown;
+	t->scan.count = 0;
+	if (b == current_buffer)
+		check_boundx();
 	return true;
 }
 
+// Start or stop showing the current buffer in aligned columns, split on delimiter (or a guess from the file if 0)
+void toggle_table(char delimiter)
+{
+	buffer *b = current_buffer;
+	if (b->table != NULL && delimiter == 0)
+	{
+		free_table(b);
+		b->offsetx = 0;
+		check_boundx();
+		return;
+	}
+
+	if (delimiter == 0)
+	{
+		// Tab separated files either say so or have tabs and no commas in their first line
+		char *dot = strrchr(b->filename, '.');
+		int length;
+		char *text = b->first_line != NULL ? line_chunk(b->first_line, 0, &length) : NULL;
+		if (dot != NULL && strcmp(dot, ".tsv") == 0)
+			delimiter = '\t';
+		else if (text != NULL && memchr(text, '\t', length) != NULL && memchr(text, ',', length) == NULL)
+			delimiter = '\t';
+		else
+			delimiter = ',';
+	}
+
+	free_table(b);
+	Table *t = (Table *) malloc(sizeof(Table));
+	t->delimiter = delimiter;
+	t->shown = (Columns) { 0 };
+	t->scan = (Columns) { 0 };
+	t->scan_line = NULL;
+	t->rescan = true;
+	t->generation = 0;
+	b->table = t;
+
+	// Without a screen there are no keys to wait for, so the whole scan is done now
+	if (headless)
+		while (scanning_table())
+			scan_table(b);
+	b->offsetx = 0;
+	check_boundx();
+}
+
+void free_table(buffer *b)
+{
+	if (b->table == NULL)
+		return;
+	free(b->table->shown.widths);
+	free(b->table->shown.widest);
+	free(b->table->scan.widths);
+	free(b->table->scan.widest);
+	free(b->table);
+	b->table = NULL;
+}
+
+// Move to the start of field n (counting from 1) of the current line, returning false if there is no such field
+bool goto_column(int n)
+{
+	buffer *b = current_buffer;
+	char delimiter = b->table != NULL ? b->table->delimiter : ',';
+	Line *line = b->current_line;
+	if (line->storage == TEXT_PAGED)
+		page_in(line);
+	if (line->storage == TEXT_SEGMENTS)
+		return false;
 
+	char *text = LINE_TEXT(line);
+	int x = 0;
+	for (int k = 1; k < n; k++)
+	{
+		int end = field_end(text, line->length, x, delimiter);
+		if (end >= line->length)
+			return false;
+		x = end + 1;
+	}
+	b->cx = x;
+	check_boundx();
+	return true;
+}
@@ -2,17 +2,101 @@
 
 #define MAX_FILENAME_LENGTH 255
 #define MAX_COMMAND_LENGTH 255
+#define MAX_MESSAGE_LENGTH 255
+#define MESSAGE_HISTORY 32 // Messages kept in the ring
+
+// Lines longer than this are held in segments
+#define LONG_LINE_LENGTH 65536
+#define SEGMENT_LENGTH 4096
+#define MAX_SEGMENT_LENGTH (SEGMENT_LENGTH * 2)
+
+// Where a line's text is held
+#define SHORT_LINE_LENGTH 24 // Lines up to this long are held in the line itself
+#define TEXT_INLINE 0 // In short_text
+#define TEXT_PAGED 1 // Dropped from memory, to be read back from page_fd
+#define TEXT_HEAP 2 // In text (this and TEXT_SEGMENTS are on the heap, where copies of lines may share them)
+#define TEXT_SEGMENTS 3 // In long_text
+
+// Session trace records
+#define TRACE_KEY 1 // Value is the key read
+#define TRACE_HANDLE 2 // Value is the time spent acting on the key
+#define TRACE_DRAW 3 // Value is the time spent redrawing the screen
+#define TRACE_RESIZE 4 // Value is the screen width << 16 | height
+#define TRACE_MAGIC "WTRACE1"
+
+// Performance histograms
+#define PERF_DRAW 0
+#define PERF_KEY 1
+#define PERF_ALLOCS 2
+#define PERF_BYTES 3
+#define PERF_METRICS 4
+#define PERF_BUCKETS 40
+
+// Buffer types
+#define BUFFER_FILE 0
+#define BUFFER_PICKER 1 // List of buffers to switch to
+#define BUFFER_GREP 2 // Grep results to jump to
+#define BUFFER_DIFF 3 // Differences from a buffer, to jump back to
+
+// Word completion
+#define MIN_WORD_LENGTH 3 // Shorter words are not worth completing
+#define MAX_WORD_LENGTH 64
+#define COMPLETIONS 5 // Candidates shown and cycled through
+
+// Lines of context around each diff hunk
+#define DIFF_CONTEXT 3
+#define DIFF_MIN_COST_LIMIT 4096 // Fewest edits searched for before a diff may settle for a longer script
+#define DIFF_KEY_CHECK_TIME 100 // Milliseconds between checks for ESC while diffing
+
+// Grep
+#define GREP_THREADS 16 // Most threads searching files
+#define GREP_MAX_LINE 200 // Longest part of a matching line shown
+#define GREP_MAX_RESULTS 100000
+
+// Sort
+#define SORT_THREADS 16
+#define SORT_PARALLEL_LINES 65536 // Fewer lines than this are sorted on one thread
+
+// Bytes moved through the pipes at a time by filter
+#define FILTER_BUFFER 65536
+#define FILTER_POLL_TIME 100 // Milliseconds between checks for ESC while a filter runs
+#define FILTER_MAX_OUTPUT (512L << 20) // Most memory the output may take before the command is stopped
+
+// Aligned columns
+#define TABLE_SCAN_LINES 20000 // Lines measured between checks for a key
+#define TABLE_COUNTED_COLUMNS 24 // Columns whose widest lines are counted, so they can narrow without a scan
+
+// Paging lines out of memory once the memory budget is reached
+#define PAGE_KEEP_LINES 1000 // Lines either side of each cursor which are never paged out
+#define SWAP_GROWTH (64L * 1024 * 1024) // Bytes a swap file grows by when it fills up
+#define PAGE_BLOCK 65536 // Bytes read from a page file at a time
+
+// Results of a script command
+#define SCRIPT_CONTINUE 0
+#define SCRIPT_STOP 1 // Nothing more to do for this file
+#define SCRIPT_ERROR 2
+
+// Longest time in milliseconds to keep applying typed ahead keys without a redraw
+#define MAX_FRAME_TIME 50
 
 // Options
-int o_tabsize;
-int o_messagecooldown;
-bool o_show_linenumbers;
+extern int o_tabsize;
+extern int o_messagecooldown;
+extern bool o_show_linenumbers;
+extern bool o_soft_wrap;
+extern bool o_perf_hud;
+extern bool o_complete;
+extern int o_memory;
 
 // Colours
 #define COL_WHITEBLUE 1
 #define COL_GREENBLACK 2
 #define COL_BLACKWHITE 3
 #define COL_BLUEWHITE 4
+#define COL_CYANBLACK 5
+#define COL_YELLOWBLACK 6
+#define COL_MAGENTABLACK 7
+#define COL_REDBLACK 8
 
 // Undo types
 #define UNDO_INSERTCHAR 1
@@ -22,46 +106,260 @@ bool o_show_linenumbers;
 #define UNDO_PASTE 5
 #define UNDO_ENTER 6
 #define UNDO_DELETESELECTION 7
+#define UNDO_SORT 8
+#define UNDO_FILTER 9
+#define UNDO_REPLACE 10 // Part of a line replaced, with end_x the length of the new text
+
+// Highlight types
+#define HL_NORMAL 0
+#define HL_COMMENT 1
+#define HL_KEYWORD 2
+#define HL_TYPE 3
+#define HL_STRING 4
+#define HL_NUMBER 5
+#define HL_VARIABLE 6
+#define HL_WARNING 7
+#define HL_ERROR 8
+
+// Syntax flags
+#define HL_HIGHLIGHT_NUMBERS (1 << 0)
+#define HL_HIGHLIGHT_STRINGS (1 << 1)
+#define HL_HIGHLIGHT_VARIABLES (1 << 2)
+#define HL_MULTILINE_STRINGS (1 << 3)
+
+// Lexer states at the end of a line (any other state is the open quote character)
+#define HLS_NORMAL 0
+#define HLS_COMMENT 1
+
+typedef struct Keyword {
+	char *word;
+	int type;
+} Keyword;
+
+// Syntax definition (one entry per language in the syntax table)
+typedef struct Syntax {
+	char *name;
+	char **filematch;
+	Keyword *keywords;
+	char *line_comment;
+	char *block_comment_start;
+	char *block_comment_end;
+	char *quotes;
+	int flags;
+} Syntax;
+
+// Byte count, display width and word count of a run of text (these combine in order, so can be summed in a tree)
+typedef struct Span {
+	int bytes;
+	bool tab; // Whether the text contains a tab
+	int pre; // Display width before the first tab
+	int rest; // Display width after the first tab, counted from a tab stop
+	int words; // Words starting in the text, as if it came after whitespace
+	bool lead; // Whether the text starts with a byte other than whitespace
+	bool trail; // Whether the text ends with a byte other than whitespace
+	bool code; // Whether the text has a byte other than whitespace
+	bool comment; // Whether the first such byte is a #
+} Span;
+
+typedef struct Segment {
+	int length;
+	char *text;
+	Span span;
+	int *word_ids; // Completion trie nodes of the words starting in the segment, ending in -1, or NULL
+	bool words_stale; // Whether word_ids are from before the text (or the text around it) changed
+} Segment;
+
+// Text of a long line, split into segments with a tree of cumulative byte counts and widths
+typedef struct Long_text {
+	int count; // Segments in use
+	int size; // Leaves in the tree, a power of two no less than count
+	Segment *segments;
+	Span *tree; // tree[1] is the root and tree[size + i] is segment i
+	int words_counted; // Lines counting the segments' word_ids in the completion index
+	bool words_stale; // Whether any segment's word_ids are stale
+} Long_text;
 
 // Line structure (a double linked list)
+// The fields used when drawing and moving about come first, so that they share a cache line
 typedef struct Line {
-	int length;
 	struct Line *prev;
 	struct Line *next;
-	char *text;
+	union {
+		char short_text[SHORT_LINE_LENGTH];
+		struct { // For TEXT_HEAP and TEXT_SEGMENTS
+			union {
+				char *text;
+				Long_text *long_text;
+			};
+			int *refs; // Count of lines sharing this text after a copy (NULL if not shared)
+		};
+	};
+	int length;
+	unsigned char storage; // Where the text is held (TEXT_...)
+	unsigned char hl_state; // Lexer state at the end of the line
+	bool hl_valid; // Whether hl_state is up to date
+	bool loc; // Whether the line counts as a line of code
+	int words; // Words counted in the line
+	int counted_length; // Length when the words were counted
+	int page_fd; // File holding a copy of the text at page_pos (the buffer's file or its swap file), or -1
+	unsigned int table_widest; // Columns the line is counted as widest in by its buffer's table, under the table's generation in the top byte
+	long page_pos;
+	int *word_ids; // Completion trie nodes of the words in the line, ending in -1 (or segment_words, if its segments hold them)
+	struct Line_node *node; // Position in the buffer's line index (if there is one)
 } Line;
 
+// Text of a line held in one piece, in the line itself or on the heap
+#define LINE_TEXT(line) ((line)->storage == TEXT_INLINE ? (line)->short_text : (line)->text)
+
+// Node in a buffer's line index, a treap ordered by position which sums the screen rows of wrapped lines
+typedef struct Line_node {
+	Line *line;
+	struct Line_node *left;
+	struct Line_node *right;
+	struct Line_node *parent;
+	int priority;
+	int count; // Lines in this subtree
+	int width; // Display width of the line
+	int rows; // Screen rows used by the line
+	long total_rows; // Screen rows used by this subtree
+} Line_node;
+
 typedef struct Select_mark {
 	Line *line;
 	int x;
 	int y;
 } Select_mark;
 
+// Widths of the columns of a table
+typedef struct Columns {
+	int *widths; // Widest field in each column
+	int *widest; // Lines with a field that wide in each column (of the first TABLE_COUNTED_COLUMNS)
+	int count; // Columns
+	int size;
+} Columns;
+
+// Column widths for showing a delimited file in aligned columns
+typedef struct Table {
+	char delimiter;
+	Columns shown; // Only widened as lines change while a scan is going on, and counted otherwise
+	Columns scan; // Measured so far by the scan, which replaces shown once it reaches the end
+	Line *scan_line; // Next line for the scan to measure, or NULL if it is finished
+	bool rescan; // Whether the scan is to start again from the top, as the widest lines of a column have narrowed or gone
+	unsigned char generation; // Of the latest scan, so lines measured since it started can be told apart
+} Table;
+
+// One of several cursors which typing and deleting act on together
+typedef struct Cursor {
+	int y;
+	int x;
+} Cursor;
+
 typedef struct Undo_mark {
 	int x;
 	int y;
 	int type;
 	char *text;
+	int length; // Bytes of text
+	int lines; // Lines spanned by a paste
+	int end_x; // Where a paste ends on its last line
+	Line *removed; // Lines taken out by sort or filter, to put back on undo
+	int group; // Marks in the same group (other than 0) are undone together
+	struct buffer *buffer; // Buffer the mark was made in
 	struct Undo_mark *next;
 } Undo_mark;
 
+// A node of the word completion trie, which ends a word if count is above 0
+typedef struct Trie_node {
+	char c;
+	int first_child;
+	int next_sibling;
+	int parent;
+	int count; // Times the word ending here occurs
+	int best; // Most frequent word in this subtree, or -1
+	int best_count;
+} Trie_node;
+
+// A line being sorted, by where it started
+typedef struct Sort_item {
+	Line *line;
+	double number;
+	int index;
+} Sort_item;
+
+// A run to sort (when mid is 0) or two runs to merge, on a thread
+typedef struct Sort_task {
+	Sort_item *items;
+	Sort_item *tmp;
+	int n;
+	int mid;
+} Sort_task;
+
+// Record in a session trace, preceded in the file by TRACE_MAGIC and the name of the file edited
+typedef struct Trace_record {
+	unsigned int delta; // Microseconds since the previous record
+	unsigned short type;
+	unsigned short unused;
+	int value; // Durations are in microseconds
+} Trace_record;
+
 typedef struct buffer {
 	char *filename;
+	int type;
+	bool loaded; // Whether the file has been read in yet
+	long file_size; // From stat when the buffer was added
+	long file_mtime;
 	Line *first_line;
 	Line *current_line;
 	Line *first_screen_line;
+	Line *last_line; // Kept as lines are linked in and out (through the index functions), or NULL to look for it
 	int lines;
 	int cx;
 	int cy;
 	int margin_left;
 	int offsetx;
 	int offsety;
+	int top_row; // First screen row shown of first_screen_line when soft wrapping
+	long words; // Running totals of the line counts
+	long chars;
+	int loc;
+	bool follow; // Reading what other programs append to the file
+	int follow_watch; // inotify watches on the file and its directory
+	int follow_dir_watch;
+	long file_offset; // Bytes of the file read so far
+	bool file_partial; // Whether the read stopped part way through a line
+	unsigned long file_inode;
+	int page_fd; // The file which unchanged lines are read back from once paged out, or -1
+	int swap_fd; // Where changed lines go when paged out, or -1
+	char *swap; // The swap file, mapped
+	long swap_size;
+	long swap_length; // Bytes of the swap file in use
+	Line *page_line; // Where page_out carries on from, or NULL to start at the top
 	bool modified;
+	Syntax *syntax;
+	Line_node *index;
+	int index_width; // Screen width the index rows were counted for
 	Select_mark select_mark;
+	Table *table; // Column widths when showing aligned columns, or NULL
+	bool block_select; // Whether the selection is the rectangle between select_mark and the cursor
+	Cursor *cursors; // Every cursor in order when there are several, or NULL
+	int cursor_count;
+	int cursor_main; // The cursor which is also the buffer's own
+	struct buffer *prev;
 	struct buffer *next;
 } buffer;
 
+// Editor state (defined in write.c)
+extern int windowx, windowy;
+extern buffer *current_buffer;
+extern buffer *paste_buffer;
+extern buffer *first_buffer;
+extern buffer *last_buffer;
+extern Undo_mark *undo_head;
+extern int ch; // Last key read
+
 // Functions
+void clear_undo();
+void drop_undo(buffer *b);
 void push_undo(int x, int y, int type, char *text, int length);
 void pull_undo();
 
@@ -80,6 +378,11 @@ void move_file_end();
 
 int cxtodx(Line *line, int cx);
 int dxtocx(Line *line, int dx);
+void *counted_malloc(size_t size);
+void *counted_realloc(void *ptr, size_t size);
+bool key_pending();
+bool escape_pending();
+long long monotonic_us();
 bool shifted_navigation_key(int ch);
 bool navigation_key(int ch);
 
@@ -87,6 +390,26 @@ void check_boundx();
 void goto_line(int line);
 void move_lines_up(int count);
 void move_lines_down(int count);
+void move_rows(int count);
+void scroll_wrapped();
+int cursor_wrapped_row();
+int wrapped_rows(int width);
+void toggle_soft_wrap();
+
+void build_index(buffer *b);
+Line_node *build_nodes(Line *first, Line *last);
+void free_index(buffer *b);
+void check_index();
+void index_insert(Line *line);
+void index_insert_lines(Line *first, Line *last);
+void index_remove(Line *line);
+void index_remove_lines(Line *first, int count);
+void index_update(Line *line);
+Line *get_last_line(buffer *b);
+int index_of(Line *line);
+long row_of(Line *line);
+Line *line_at(int index);
+Line *line_at_row(long row, int *line_row);
 
 void mark(buffer *b);
 void clear_mark(buffer *b);
@@ -95,10 +418,14 @@ void cut_line();
 void copy();
 void cut();
 void paste();
+void terminal_paste();
+void paste_lines(Line *source_line);
+void delete_range(int lines, int end_x);
 void delete_selection();
 void get_select_extents(buffer *b, Select_mark *start, Select_mark *end);
 
 bool find(char *find_string, Line *start_line, int start_x);
+int line_find(Line *line, int start, char *find_string);
 void delete_line(Line *line);
 void delete_lines(Line *start_line);
 
@@ -108,7 +435,7 @@ void save_file(char *save_filename);
 void new_file(char *new_filename);
 void init();
 void shutdown();
-void close(buffer *close_buffer);
+void close_buffer(buffer *b);
 void prompt_save();
 void load_options();
 void resize_window();
@@ -118,11 +445,38 @@ void draw_screen();
 void refresh_screen();
 void update_status();
 void message(char *msg);
-void draw_line(int y, Line *line);
+int draw_line(int y, int line_y, Line *line);
 void toggle_linenumbers();
 
+void select_syntax(buffer *b);
+bool is_separator(char c);
+bool starts_with(char *text, int length, char *prefix);
+int syntax_lex(Syntax *syntax, Line *line, int state, unsigned char *hl, int limit);
+int syntax_start_state(Line *line);
+void update_syntax(Line *line);
+void line_changed(Line *line);
+
 void insert_string(Line *line, int pos, char *src, int length);
+void delete_string(Line *line, int pos, int length);
 void allocate_string(Line *line, int length);
+char line_char(Line *line, int pos);
+char *line_chunk(Line *line, int pos, int *length);
+void text_insert(Line *line, int pos, char *src, int length);
+void text_delete(Line *line, int pos, int length);
+void text_copy(Line *dest, int dest_pos, Line *source, int pos, int length);
+void free_text(Line *line);
+void unshare_text(Line *line);
+
+Span measure_span(char *text, int length);
+Span join_spans(Span a, Span b);
+int span_width(Span span, int dx);
+void segment_line(Line *line, char *src, int length);
+void flatten_line(Line *line);
+void reserve_segments(Long_text *t, int count);
+void build_segment_tree(Long_text *t);
+void update_segment(Long_text *t, int i);
+void split_segment(Long_text *t, int i);
+int find_segment(Long_text *t, int pos, int *offset, Span *before);
 Line *insert_line(Line *prev, Line *next, char *src, size_t length);
 void insert_char(Line *line, int position, char c);
 void enter();
@@ -130,4 +484,145 @@ void backspace();
 void delete();
 
 buffer *add_buffer();
-buffer *add_sbuffer();
\ No newline at end of file
+buffer *add_sbuffer();
+
+void init_headless();
+int run_script(char *script_filename, int count, char **filenames);
+int script_command(char *command);
+bool handle_key();
+int read_key();
+void unread_key(int key);
+bool start_trace(char *trace_filename, char *filename);
+void trace_event(int type, long long value);
+void end_trace();
+bool start_replay(char *trace_filename, char *filename);
+int replay_trace(char *trace_filename, char *filename);
+void perf_frame();
+void perf_record(int metric, long long value);
+long heap_in_use();
+bool perf_dump(char *dump_filename);
+long line_memory(Line *line, long *shared);
+long lines_memory(Line *line, long *shared);
+void append_line(buffer *b, char *text);
+buffer *report_buffer(char *name);
+void memory_report();
+int count_words(char *text, int length, bool *space);
+void update_stats(buffer *b, Line *line);
+void clear_stats(buffer *b, Line *line);
+void remove_stats(buffer *b, Line *line);
+Line *read_lines(FILE *fp, Line *last);
+bool follow(bool on);
+void unwatch(int watch);
+void follow_files();
+void follow_check(buffer *b);
+void reload_file(buffer *b);
+bool open_lazy(char *open_filename);
+void open_files(char *pattern);
+void load_buffer(buffer *b);
+void switch_buffer(buffer *b);
+void buffer_picker();
+void pick_buffer();
+void grep(char *pattern, char *dir);
+void text_copy_out(Line *line, int pos, char *dest, int length);
+void grep_format(char **results, size_t *results_length, size_t *results_size, char *filename, int y, char *text, int length);
+void grep_add(char *text, size_t length, int matches);
+void grep_wake();
+void grep_push(char *filename);
+void *grep_walk_thread(void *dir);
+void grep_walk(char *path);
+bool grep_skipped(char *filename, ino_t inode);
+void *grep_worker(void *unused);
+void grep_file(char *filename);
+void grep_drain();
+void stop_grep();
+void grep_jump();
+int compare_lines(Line *a, Line *b);
+int compare_items(Sort_item *a, Sort_item *b);
+void merge_items(Sort_item *items, Sort_item *tmp, int mid, int n);
+void merge_sort_items(Sort_item *items, Sort_item *tmp, int n);
+void *sort_thread(void *task);
+void sort_items(Sort_item *items, int n);
+int compare_numbers(Sort_item *a, Sort_item *b);
+bool number_parts(Line *line, int *start, int *point, int *end);
+double line_number_value(Line *line);
+void relink_lines(Line *before, Line *after, Line **lines, int n);
+int sort_lines();
+void unsort_lines(Undo_mark *mark);
+void lines_moved(Line *line);
+Line *replace_lines(Line *first, int n, Line *chain, int chain_lines);
+bool filter_lines(char *command);
+unsigned long hash_line(Line *line);
+void diff_number_lines(Line *a, int a_lines, Line *b, int b_lines);
+void diff_middle(int xoff, int xlim, int yoff, int ylim, int *middle_x, int *middle_y);
+bool diff_escaped();
+void diff_compare(int xoff, int xlim, int yoff, int ylim);
+void append_diff_line(buffer *b, char prefix, Line *line);
+bool diff(char *name);
+void next_hunk(int direction);
+void diff_jump();
+bool is_word_char(char c);
+int trie_find(char *word, int length, bool add);
+void trie_count_word(int node, int change);
+void index_words(Line *line);
+void forget_words(Line *line);
+void trie_word(int node, char *word);
+void trie_best(int node, int *results, int *count, int max, int exclude);
+void index_all_words();
+int find_completions(char *prefix, int length, int *results, int max);
+int word_start();
+void hint_completion();
+void complete();
+void page_in(Line *line);
+void read_page(Line *line, char *dest);
+void drop_text(Line *line);
+long page_out_line(buffer *b, Line *line);
+bool swap_line(buffer *b, Line *line);
+bool open_swap(buffer *b);
+void clear_swap(buffer *b);
+long page_out(buffer *b, long bytes);
+long resident_memory();
+bool check_memory();
+void close_pages(buffer *b);
+void unpage_undo(buffer *b);
+void unpage_file(buffer *b);
+void repoint_lines(buffer *b, char *saved_filename);
+int line_width(Line *line);
+void pull_undo_mark();
+void move_to_line(int line);
+bool moving_key(int ch);
+int record_key(int key);
+void record_macro();
+void play_macro(int count);
+bool cursors_key(int key);
+Line *line_near(int y);
+bool block_cursors();
+void cursors_edit(int key);
+void cursors_move(int key);
+void merge_cursors(buffer *b);
+void clear_cursors(buffer *b);
+int add_cursors(char *find_string);
+int cursor_at(buffer *b, int y);
+bool selected(Select_mark *start, Select_mark *end, int line_y, int x);
+int draw_table_line(int y, int line_y, Line *line);
+bool table_line(buffer *b, Line *line);
+int field_end(char *text, int length, int x, char delimiter);
+int table_cxtodx(Table *t, Line *line, int cx);
+int table_dxtocx(Table *t, Line *line, int dx);
+int *column_width(Columns *c, int k);
+void widen_columns(Table *t, Columns *c, Line *line, bool counted);
+void forget_columns(Table *t, Columns *c, Line *line);
+bool scanning_table();
+bool scan_table(buffer *b);
+void toggle_table(char delimiter);
+void free_table(buffer *b);
+bool goto_column(int n);
+void mark_words_stale(Long_text *t, int i);
+void drop_segment_words(Long_text *t, int i);
+void index_segment(Long_text *t, int i);
+void update_segment_words(Long_text *t);
+void count_segment_words(Long_text *t, int change);
+int *collect_segment_words(Long_text *t);
+void text_replace(Line *line, int pos, int length, char *src, int src_length);
+long held_text(Line *line);
+unsigned int widest_columns(Table *t, Line *line);
+void forget_column(Table *t, Columns *c, int k);
\ No newline at end of file